@@ -24,6 +24,7 @@
 #ifndef PF_Q_KCOMPAT_H
 #define PF_Q_KCOMPAT_H
 
+#include <linux/version.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 
@@ -31,6 +32,16 @@ extern  int pfq_netif_rx(struct sk_buff *);
 extern  int pfq_netif_receive_skb(struct sk_buff *);
 extern  gro_result_t pfq_gro_receive(struct napi_struct *, struct sk_buff *);
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0))
+extern  bool pfq_napi_complete(struct napi_struct *);
+extern  bool pfq_napi_complete_done(struct napi_struct *, int);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0))
+extern  void pfq_napi_complete(struct napi_struct *);
+extern  void pfq_napi_complete_done(struct napi_struct *, int);
+#else
+extern  void pfq_napi_complete(struct napi_struct *);
+#endif
+
 extern struct sk_buff * __pfq_alloc_skb(unsigned int size, gfp_t priority, int fclone, int node);
 extern struct sk_buff * pfq_dev_alloc_skb(unsigned int length);
 extern struct sk_buff * __pfq_netdev_alloc_skb(struct net_device *dev, unsigned int length, gfp_t gfp);
@@ -81,6 +92,11 @@ pfq_alloc_skb_fclone(unsigned int size, gfp_t priority)
 #define netif_rx(_skb)                                  pfq_netif_rx(_skb)
 #define napi_gro_receive(_napi, _skb)                   pfq_gro_receive(_napi, _skb)
 
+#define napi_complete(_napi)                            pfq_napi_complete(_napi)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0))
+#define napi_complete_done(_napi, _work)                pfq_napi_complete_done(_napi, _work)
+#endif
+
 #define netdev_alloc_skb(dev,len)	  		pfq_netdev_alloc_skb(dev,len)
 #define __netdev_alloc_skb_ip_align(dev,len, gfp)	__pfq_netdev_alloc_skb_ip_align(dev,len, gfp)
 #define   netdev_alloc_skb_ip_align(dev,len) 	        pfq_netdev_alloc_skb_ip_align(dev,len)
@@ -31,8 +31,6 @@
 #include <linux/filter.h>
 #include <linux/skbuff.h>
 
-#define Q_VERSION               "4.1"
-
 #else  /* user space */
 
 #define __user
@@ -63,6 +61,12 @@ static inline void smp_mb()  { mb();      }
 static inline void smp_rmb() { barrier(); }
 static inline void smp_wmb() { barrier(); }
 
+#if defined(__x86_64__) || defined(__i386__)
+static inline void pfq_cpu_relax() { asm volatile ("pause" ::: "memory"); }
+#else
+static inline void pfq_cpu_relax() { barrier(); }
+#endif
+
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
@@ -70,10 +74,19 @@ static inline void smp_wmb() { barrier(); }
 #endif /* __KERNEL__ */
 
 
+#define Q_VERSION               "4.2"        /* 4.2: 64-bit Rx queue data word (user ABI change) */
+
 #define PF_Q    			27   /* pfq socket family */
 
-#define Q_SHARED_QUEUE_INDEX(data)   	((data) >> 24)
-#define Q_SHARED_QUEUE_LEN(data)     	((data) & 0x00ffffffu )
+/* rx queue data: index (8 bits) | len in slots (24 bits) | offset in bytes (32 bits)
+ * (in continuous mode data is the free-running producer index) */
+
+#define Q_SHARED_QUEUE_INDEX(data)   	((unsigned int)((data) >> 56))
+#define Q_SHARED_QUEUE_LEN(data)     	((unsigned int)((data) >> 32) & 0x00ffffffu)
+#define Q_SHARED_QUEUE_OFF(data)     	((unsigned int)(data))
+
+#define Q_SHARED_QUEUE_DATA(index, len, off) \
+	(((unsigned long long)(index) << 56) | ((unsigned long long)(len) << 32) | (unsigned long long)(off))
 
 #define Q_MPDB_QUEUE_SLOT_SIZE(x)    	ALIGN(sizeof(struct pfq_pkthdr) + x, 8)
 #define Q_SPSC_QUEUE_SLOT_SIZE(x)    	ALIGN(sizeof(struct pfq_pkthdr_tx) + x, 8)
@@ -121,6 +134,33 @@ static inline void smp_wmb() { barrier(); }
 #define Q_SO_TX_FLUSH			35
 #define Q_SO_TX_ASYNC			36
 
+#define Q_SO_SET_RX_VARLEN          	37      /* variable-length slots */
+#define Q_SO_GET_RX_VARLEN          	38
+#define Q_SO_SET_RX_RINGS           	39      /* number of Rx rings (one per producing cpu) */
+#define Q_SO_GET_RX_RINGS           	40
+#define Q_SO_SET_RX_MODE            	41      /* double-buffer or continuous ring */
+#define Q_SO_GET_RX_MODE            	42
+#define Q_SO_SET_RX_WAKEUP_WATERMARK    43      /* wake up the reader when the queue holds N packets */
+#define Q_SO_GET_RX_WAKEUP_WATERMARK    44
+#define Q_SO_SET_RX_WAKEUP_TIMEOUT      45      /* max latency (usec) of the wakeup below the watermark */
+#define Q_SO_GET_RX_WAKEUP_TIMEOUT      46
+#define Q_SO_SET_RX_WAKEUP_BUSY_POLL    47      /* never wake up the reader */
+#define Q_SO_GET_RX_WAKEUP_BUSY_POLL    48
+#define Q_SO_SET_RX_BATCH_COMMIT        49      /* publish each burst with a single store (continuous mode) */
+#define Q_SO_GET_RX_BATCH_COMMIT        50
+#define Q_SO_SET_RX_LAYOUT              51      /* inline headers or header-split layout */
+#define Q_SO_GET_RX_LAYOUT              52
+#define Q_SO_SET_SHMEM_NODE             53      /* NUMA node of the Rx/Tx queues memory */
+#define Q_SO_GET_SHMEM_NODE             54
+#define Q_SO_SET_SHMEM_HUGEPAGES        55      /* kernel-allocated hugepages policy */
+#define Q_SO_GET_SHMEM_HUGEPAGES        56
+#define Q_SO_GET_TX_QUEUES              57      /* number of Tx queues (bound and reserved) */
+#define Q_SO_GET_RX_TSTAMP_ERROR        58      /* worst-case timestamp error (usec) */
+#define Q_SO_SET_TX_ZEROCOPY            59      /* Tx frames attached as pages of the shared memory */
+#define Q_SO_GET_TX_ZEROCOPY            60
+#define Q_SO_SET_TX_RATE                61      /* token-bucket shaping of a Tx queue */
+#define Q_SO_GET_TX_RATE                62
+
 
 /* general placeholders */
 
@@ -133,8 +173,43 @@ static inline void smp_wmb() { barrier(); }
 
 /* timestamp */
 
-#define Q_TSTAMP_OFF         	     	0       /* default */
+#define Q_TSTAMP_OFF         	     	0       /* default: no timestamp */
 #define Q_TSTAMP_ON          		1
+#define Q_TSTAMP_SOFTWARE    		1       /* kernel time on receive */
+#define Q_TSTAMP_HARDWARE    		2       /* raw hardware stamp (skb_hwtstamps), 0 if not available */
+#define Q_TSTAMP_BATCH       		3       /* kernel time, one per batch (see Q_SO_GET_RX_TSTAMP_ERROR) */
+
+/* rx slots */
+
+#define Q_SLOTS_FIXED			0       /* default */
+#define Q_SLOTS_VARLEN			1	/* sizeof(pfq_pkthdr) + ALIGN(caplen, 8) */
+
+/* rx queue mode */
+
+#define Q_RX_MODE_DOUBLE_BUFFER		0       /* default */
+#define Q_RX_MODE_CONTINUOUS		1	/* single ring with free-running producer/consumer indices */
+
+/* shared memory NUMA node */
+
+#define Q_NODE_ANY			-1      /* default: no preference */
+#define Q_NODE_DEVICE			-2      /* node of the bound device */
+
+/* shared memory hugepages */
+
+#define Q_HUGEPAGES_AUTO		0       /* default: user hugepages, kernel hugepages, then 4K pages */
+#define Q_HUGEPAGES_OFF			1       /* user hugepages or 4K pages */
+#define Q_HUGEPAGES_REQUIRE		2       /* kernel hugepages or fail */
+
+/* rx slots layout */
+
+#define Q_RX_LAYOUT_INLINE		0       /* default: each header is followed by its payload */
+#define Q_RX_LAYOUT_SPLIT		1	/* array of headers followed by the payload arena */
+
+/* rx wakeup */
+
+#define Q_WAKEUP_WATERMARK_DEFAULT	1       /* wake up on the first packet */
+#define Q_WAKEUP_TIMEOUT_OFF		0       /* default */
+#define Q_WAKEUP_TIMEOUT_MAX		1000000 /* 1 sec. */
 
 
 /* vlan */
@@ -167,7 +242,8 @@ static inline void smp_wmb() { barrier(); }
 /* additional constants */
 
 #define Q_MAX_COUNTERS          	64
-#define Q_MAX_TX_QUEUES 		4
+#define Q_MAX_TX_QUEUES 		64      /* per socket; memory is reserved for the bound ones only */
+#define Q_MAX_RX_RINGS 			64      /* per socket; headers are reserved for the configured ones only */
 
 
 /* PFQ socket queue */
@@ -175,9 +251,15 @@ static inline void smp_wmb() { barrier(); }
 
 struct pfq_rx_queue
 {
-        unsigned int   		data;
+        unsigned long long	data;
         unsigned int            size;       /* queue length in slots */
         unsigned int            slot_size;  /* sizeof(pfq_pkthdr) + caplen  */
+        unsigned int            varlen;     /* Q_SLOTS_FIXED or Q_SLOTS_VARLEN */
+        unsigned int            mode;       /* Q_RX_MODE_DOUBLE_BUFFER or Q_RX_MODE_CONTINUOUS */
+        unsigned long long      commit;     /* producer index published by the last burst (batch commit) */
+        unsigned int            layout;     /* Q_RX_LAYOUT_INLINE or Q_RX_LAYOUT_SPLIT */
+
+        unsigned long long      cons __attribute__((aligned(64)));  /* consumer index (continuous mode) */
 
 } __attribute__((aligned(64)));
 
@@ -196,11 +278,16 @@ struct pfq_tx_queue
 
 struct pfq_shared_queue
 {
-        struct pfq_rx_queue rx;
         struct pfq_tx_queue tx[Q_MAX_TX_QUEUES];
+        struct pfq_rx_queue rx[0];              /* one per Rx ring, rx[0] is the default ring */
 };
 
 
+/* size of the queue headers, followed by the Rx rings and the Tx queues */
+
+#define Q_SHARED_QUEUE_HDR_SIZE(rings)	(sizeof(struct pfq_shared_queue) + (rings) * sizeof(struct pfq_rx_queue))
+
+
 /* packet headers */
 
 
@@ -340,6 +427,16 @@ struct pfq_group_context
         int level;
 };
 
+/* pfq_tx_rate: token-bucket shaping of a Tx queue (0 = unlimited) */
+
+struct pfq_tx_rate
+{
+        int queue;              /* Tx queue index, Q_ANY_QUEUE = all */
+        unsigned int burst;     /* packets sent back-to-back (0 = 1) */
+        uint64_t pps;
+        uint64_t bps;           /* frame bytes, headers included */
+};
+
 /* pfq_fprog: per-group sock_fprog */
 
 struct pfq_fprog
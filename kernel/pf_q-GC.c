@@ -114,7 +114,7 @@ gc_copy_buff(struct gc_data *gc, struct gc_buff orig)
 
 
 inline void
-__gc_add_dev_to_targets(struct net_device *dev, struct gc_fwd_targets *ts)
+__gc_add_dev_to_targets(struct net_device *dev, size_t pkt, struct gc_fwd_targets *ts)
 {
 	size_t n = 0;
 
@@ -123,6 +123,8 @@ __gc_add_dev_to_targets(struct net_device *dev, struct gc_fwd_targets *ts)
         	if (dev == ts->dev[n]) {
         		ts->cnt[n]++;
         		ts->cnt_total++;
+        		if (__test_and_set_bit(pkt, ts->pkts[n]))
+        			__set_bit(pkt, ts->multi);
         		return;
 		}
 	}
@@ -132,6 +134,8 @@ __gc_add_dev_to_targets(struct net_device *dev, struct gc_fwd_targets *ts)
 		ts->cnt[n] = 1;
 		ts->cnt_total++;
 		ts->num++;
+		bitmap_zero(ts->pkts[n], Q_GC_POOL_QUEUE_LEN);
+		__set_bit(pkt, ts->pkts[n]);
 	}
 	else
 		pr_devel("[PFQ] GC: forward pool exhausted!\n");
@@ -146,11 +150,15 @@ gc_get_fwd_targets(struct gc_data *gc, struct gc_fwd_targets *ts)
 	ts->num = 0;
         ts->cnt_total = 0;
 
+	bitmap_zero(ts->multi, Q_GC_POOL_QUEUE_LEN);
+
+	/* a single pass over the logs: the targets, and the list of packets of each one */
+
 	for(n = 0; n < gc->pool.len; ++n)
 	{
 		for(i = 0; i < gc->log[n].num_devs; i++)
 		{
-         		__gc_add_dev_to_targets(gc->log[n].dev[i], ts);
+         		__gc_add_dev_to_targets(gc->log[n].dev[i], n, ts);
 		}
 	}
 }
@@ -25,6 +25,7 @@
 #define PF_Q_GC_H
 
 #include <linux/string.h>
+#include <linux/bitops.h>
 #include <linux/skbuff.h>
 
 #include <pf_q-skbuff.h>
@@ -66,6 +67,9 @@ struct gc_fwd_targets
 	size_t cnt [Q_GC_LOG_QUEUE_LEN];
 	size_t cnt_total;
 	size_t num;
+
+	unsigned long pkts[Q_GC_LOG_QUEUE_LEN][BITS_TO_LONGS(Q_GC_POOL_QUEUE_LEN)];	/* packets of each device */
+	unsigned long multi[BITS_TO_LONGS(Q_GC_POOL_QUEUE_LEN)];			/* packets sent more than once to a device */
 };
 
 
@@ -96,7 +100,7 @@ extern struct gc_buff pfq_copy_buff(struct gc_buff buff);
 extern void gc_get_fwd_targets(struct gc_data *gc, struct gc_fwd_targets *ts);
 
 
-static inline bool
+static inline size_t
 gc_count_dev_in_log(struct net_device *dev, struct gc_log *log)
 {
 	size_t n, ret = 0;
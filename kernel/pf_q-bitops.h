@@ -64,4 +64,23 @@
 }
 
 
+/* multi-word bitmaps: n is the index of each bit set */
+
+#define Q_BITMAP_WORDS(bits)	(((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+#define pfq_bitmap_foreach(map, words, n, ...) \
+{ \
+	size_t _w; \
+	for(_w = 0; _w < (words); _w++) \
+	{ \
+		unsigned long _mask = (map)[_w], _bit; \
+		for(; _bit = _mask & -_mask, _mask; _mask ^= _bit) \
+		{ \
+			n = _w * BITS_PER_LONG + pfq_ctz(_bit); \
+			__VA_ARGS__ \
+		} \
+	} \
+}
+
+
 #endif /* PF_Q_BITOPS_H */
@@ -28,49 +28,371 @@
 #include <linux/filter.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+
+#include <asm/unaligned.h>
 
 #include <net/sock.h>
 
 #include <pf_q-bpf.h>
 
-struct sk_filter *
-pfq_alloc_sk_filter(struct sock_fprog *fprog)
+/*
+ * Filters are built from the kernel copy of the program, checked once:
+ * the user buffer is never read again after pfq_bpf_get copied it.
+ */
+
+pfq_filter_t *
+pfq_alloc_sk_filter(struct sock_filter *insns, unsigned int len)
 {
-       	struct sock sk;
-       	int rv;
-
-       	sock_init_data(NULL, &sk);
-       	sk.sk_filter = NULL;
-       	atomic_set(&sk.sk_omem_alloc, 0);
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
-       	sock_reset_flag(&sk, SOCK_FILTER_LOCKED);
+	pfq_filter_t *filter;
+	int rv;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
+	struct sock_fprog_kern fprog = { .len = len, .filter = insns };
+#else
+	struct sock_fprog fprog = { .len = len, .filter = insns };
 #endif
-        pr_devel("[PFQ] BPF: new fprog (len %d)\n", fprog->len);
 
-	if ((rv = sk_attach_filter(fprog, &sk))) {
-		pr_devel("[PFQ] BPF: sk_attach_filter error: (%d)!\n", rv);
+        pr_devel("[PFQ] BPF: new fprog (len %u)\n", len);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0))
+	rv = bpf_prog_create(&filter, &fprog);
+#else
+	rv = sk_unattached_filter_create(&filter, &fprog);
+#endif
+	if (rv) {
+		pr_devel("[PFQ] BPF: filter create error: (%d)!\n", rv);
         	return NULL;
 	}
 
-	return sk.sk_filter;
+	return filter;
 }
 
 
 void
-pfq_free_sk_filter(struct sk_filter *filter)
+pfq_free_sk_filter(pfq_filter_t *filter)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0))
+	bpf_prog_destroy(filter);
+#else
+	sk_unattached_filter_destroy(filter);
+#endif
+}
+
+
+/* validate a classic BPF program, as sk_attach_filter does */
+
+static int
+pfq_bpf_check(struct sock_filter const *insns, unsigned int len)
 {
-       	struct sock sk;
-       	int rv;
-
-       	sock_init_data(NULL, &sk);
-       	sk.sk_filter = NULL;
-       	atomic_set(&sk.sk_omem_alloc, 0);
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
-       	sock_reset_flag(&sk, SOCK_FILTER_LOCKED);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0))
+	return bpf_check_classic(insns, len);
+#else
+	/* sk_chk_filter of older kernels rewrites the opcodes: check a scratch copy */
+
+	struct sock_filter *tmp = kmemdup(insns, len * sizeof(struct sock_filter), GFP_KERNEL);
+	int rv;
+
+	if (tmp == NULL)
+		return -ENOMEM;
+
+	rv = sk_chk_filter(tmp, len);
+	kfree(tmp);
+	return rv;
 #endif
-	sk.sk_filter = filter;
-	if ((rv = sk_detach_filter(&sk)))
-		pr_devel("[PFQ] BPF: sk_detach_filter error: (%d)!\n", rv);
 }
 
 
+/*
+ * Pre-analysis: straight-line programs, where every conditional jump either
+ * falls through or ends at a constant return, are lowered to native tests
+ * (e.g. ether proto, ip proto, ip and tcp port). Anything else runs by sk_filter.
+ */
+
+static int
+pfq_bpf_edge(struct pfq_bpf const *bpf, unsigned int pc, unsigned int off)
+{
+	struct sock_filter const *ret;
+
+	if (off == 0)
+		return Q_BPF_NEXT;
+
+	if (pc + 1 + off >= bpf->len)
+		return -1;
+
+	ret = &bpf->insns[pc + 1 + off];
+
+	if (BPF_CLASS(ret->code) != BPF_RET || BPF_RVAL(ret->code) != BPF_K)
+		return -1;
+
+	return ret->k ? Q_BPF_ACCEPT : Q_BPF_REJECT;
+}
+
+
+static bool
+pfq_bpf_analyze(struct pfq_bpf *bpf)
+{
+	struct pfq_bpf_test load = { 0 };
+	bool loaded = false;
+	int msh = -1;
+	unsigned int pc;
+
+	bpf->num_tests = 0;
+
+	for(pc = 0; pc < bpf->len; pc++)
+	{
+		struct sock_filter const *f = &bpf->insns[pc];
+
+		switch(BPF_CLASS(f->code))
+		{
+		case BPF_RET: {
+
+			if (BPF_RVAL(f->code) != BPF_K)
+				return false;
+
+			bpf->otherwise = f->k ? Q_BPF_ACCEPT : Q_BPF_REJECT;
+			return true;
+		}
+
+		case BPF_LD: {
+
+			if (BPF_SIZE(f->code) != BPF_W && BPF_SIZE(f->code) != BPF_H && BPF_SIZE(f->code) != BPF_B)
+				return false;
+
+			if (f->k >= 0xffff)  /* ancillary data */
+				return false;
+
+			if (BPF_MODE(f->code) == BPF_IND) {
+				if (msh < 0)
+					return false;
+			}
+			else if (BPF_MODE(f->code) != BPF_ABS)
+				return false;
+
+			load.code = f->code;
+			load.off  = (u16)f->k;
+			load.msh  = (u16)(msh < 0 ? 0 : msh);
+			load.mask = 0;
+			loaded = true;
+		} break;
+
+		case BPF_LDX: {
+
+			if (f->code != (BPF_LDX|BPF_MSH|BPF_B) || f->k >= 0xffff)
+				return false;
+
+			msh = (int)f->k;
+		} break;
+
+		case BPF_ALU: {
+
+			if (f->code != (BPF_ALU|BPF_AND|BPF_K) || f->k == 0 || !loaded)
+				return false;
+
+			load.mask = load.mask ? load.mask & f->k : f->k;
+		} break;
+
+		case BPF_JMP: {
+
+			struct pfq_bpf_test *test;
+			int on_true, on_false;
+
+			if (BPF_SRC(f->code) != BPF_K || !loaded || bpf->num_tests == Q_BPF_MAX_TESTS)
+				return false;
+
+			if (BPF_OP(f->code) != BPF_JEQ && BPF_OP(f->code) != BPF_JGT &&
+			    BPF_OP(f->code) != BPF_JGE && BPF_OP(f->code) != BPF_JSET)
+				return false;
+
+			on_true  = pfq_bpf_edge(bpf, pc, f->jt);
+			on_false = pfq_bpf_edge(bpf, pc, f->jf);
+			if (on_true < 0 || on_false < 0)
+				return false;
+
+			test = &bpf->test[bpf->num_tests++];
+
+			*test = load;
+			test->jmp      = BPF_OP(f->code);
+			test->k        = f->k;
+			test->on_true  = (u8)on_true;
+			test->on_false = (u8)on_false;
+		} break;
+
+		default:
+			return false;
+		}
+	}
+
+	return false;
+}
+
+
+static inline bool
+pfq_bpf_load(struct sk_buff const *skb, struct pfq_bpf_test const *test, u32 *a)
+{
+	int off = test->off;
+	void const *ptr;
+	u8 buf[4];
+
+	if (BPF_MODE(test->code) == BPF_IND) {
+		u8 const *ihl = skb_header_pointer(skb, test->msh, 1, buf);
+		if (ihl == NULL)
+			return false;
+		off += (*ihl & 0xf) << 2;
+	}
+
+	switch(BPF_SIZE(test->code))
+	{
+	case BPF_W:
+		if ((ptr = skb_header_pointer(skb, off, 4, buf)) == NULL)
+			return false;
+		*a = get_unaligned_be32(ptr);
+		break;
+	case BPF_H:
+		if ((ptr = skb_header_pointer(skb, off, 2, buf)) == NULL)
+			return false;
+		*a = get_unaligned_be16(ptr);
+		break;
+	default:
+		if ((ptr = skb_header_pointer(skb, off, 1, buf)) == NULL)
+			return false;
+		*a = *(u8 const *)ptr;
+	}
+
+	return true;
+}
+
+
+bool
+pfq_bpf_run_native(struct pfq_bpf const *bpf, struct sk_buff const *skb)
+{
+	int n;
+
+	for(n = 0; n < bpf->num_tests; n++)
+	{
+		struct pfq_bpf_test const *test = &bpf->test[n];
+		bool cond;
+		u32 a;
+		u8 action;
+
+		/* out of packet loads reject, as sk_run_filter does */
+
+		if (!pfq_bpf_load(skb, test, &a))
+			return false;
+
+		if (test->mask)
+			a &= test->mask;
+
+		switch(test->jmp)
+		{
+		case BPF_JEQ:	cond = a == test->k; break;
+		case BPF_JGT:	cond = a >  test->k; break;
+		case BPF_JGE:	cond = a >= test->k; break;
+		default:	cond = (a & test->k) != 0;
+		}
+
+		action = cond ? test->on_true : test->on_false;
+		if (action != Q_BPF_NEXT)
+			return action == Q_BPF_ACCEPT;
+	}
+
+	return bpf->otherwise == Q_BPF_ACCEPT;
+}
+
+
+/*
+ * Registry of the filters in use: identical programs are shared.
+ */
+
+static DEFINE_MUTEX(bpf_lock);
+static LIST_HEAD(bpf_list);
+
+
+struct pfq_bpf *
+pfq_bpf_get(struct sock_fprog *fprog)
+{
+	size_t size = fprog->len * sizeof(struct sock_filter);
+	struct pfq_bpf *bpf, *this;
+	int rv;
+
+	if (fprog->len == 0 || fprog->len > BPF_MAXINSNS)
+		return NULL;
+
+	bpf = kzalloc(sizeof(struct pfq_bpf) + size, GFP_KERNEL);
+	if (bpf == NULL)
+		return NULL;
+
+	/* the only read of the user program: analysis, dedup and sk_filter use this copy */
+
+	if (copy_from_user(bpf->insns, fprog->filter, size)) {
+		kfree(bpf);
+		return NULL;
+	}
+
+	bpf->len = fprog->len;
+
+	if ((rv = pfq_bpf_check(bpf->insns, bpf->len))) {
+		pr_devel("[PFQ] BPF: invalid fprog (%d)!\n", rv);
+		kfree(bpf);
+		return NULL;
+	}
+
+	mutex_lock(&bpf_lock);
+
+	list_for_each_entry(this, &bpf_list, list)
+	{
+		if (this->len == bpf->len && memcmp(this->insns, bpf->insns, size) == 0) {
+			this->users++;
+			mutex_unlock(&bpf_lock);
+			kfree(bpf);
+			pr_devel("[PFQ] BPF: fprog shared (%d users)\n", this->users);
+			return this;
+		}
+	}
+
+	if (pfq_bpf_analyze(bpf)) {
+		if (bpf->num_tests == 0)
+			bpf->kind = bpf->otherwise == Q_BPF_ACCEPT ? pfq_bpf_accept : pfq_bpf_reject;
+		else
+			bpf->kind = pfq_bpf_native;
+	}
+	else {
+		bpf->kind   = pfq_bpf_program;
+		bpf->filter = pfq_alloc_sk_filter(bpf->insns, bpf->len);
+		if (bpf->filter == NULL) {
+			mutex_unlock(&bpf_lock);
+			kfree(bpf);
+			return NULL;
+		}
+	}
+
+	bpf->users = 1;
+	list_add(&bpf->list, &bpf_list);
+
+	mutex_unlock(&bpf_lock);
+
+	pr_devel("[PFQ] BPF: new fprog (len %d, kind %d, %d native tests)\n", bpf->len, bpf->kind, bpf->num_tests);
+	return bpf;
+}
+
+
+/* the caller waits the grace period, the filter is no longer used by the receive path */
+
+void
+pfq_bpf_put(struct pfq_bpf *bpf)
+{
+	mutex_lock(&bpf_lock);
+
+	if (--bpf->users > 0) {
+		mutex_unlock(&bpf_lock);
+		return;
+	}
+
+	list_del(&bpf->list);
+	mutex_unlock(&bpf_lock);
+
+	if (bpf->filter)
+		pfq_free_sk_filter(bpf->filter);
+	kfree(bpf);
+}
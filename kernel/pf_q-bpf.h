@@ -25,10 +25,116 @@
 #ifndef PF_Q_BPF_H
 #define PF_Q_BPF_H
 
+#include <linux/version.h>
 #include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/list.h>
 
-struct sk_filter * pfq_alloc_sk_filter(struct sock_fprog *fprog);
+#define Q_BPF_MAX_TESTS 	8	/* max tests of a native fast path */
 
-void pfq_free_sk_filter(struct sk_filter *filter);
+/* actions of a fast path test */
+
+#define Q_BPF_NEXT 		0
+#define Q_BPF_ACCEPT 		1
+#define Q_BPF_REJECT 		2
+
+/* kinds of a pre-analyzed filter */
+
+enum pfq_bpf_kind
+{
+	pfq_bpf_accept,		/* trivial accept: not installed */
+	pfq_bpf_reject,		/* trivial reject */
+	pfq_bpf_native,		/* straight-line tests, run natively */
+	pfq_bpf_program		/* run by sk_filter */
+};
+
+
+/*
+ * A test of the native fast path: load (absolute, or indirect from an
+ * IPv4 header length), optional mask, conditional jump where each edge
+ * either falls through to the next test or ends the filter.
+ */
+
+struct pfq_bpf_test
+{
+	u16	code;		/* BPF_LD|BPF_ABS|size or BPF_LD|BPF_IND|size */
+	u16 	off;
+	u16	msh;		/* offset of the ldxb 4*([k]&0xf), for BPF_IND */
+	u32	mask;		/* 0: no mask */
+	u16	jmp;		/* BPF_JEQ, BPF_JGT, BPF_JGE or BPF_JSET */
+	u32	k;
+	u8	on_true;
+	u8	on_false;
+};
+
+
+/*
+ * Filters are shared among the groups with the same program (users),
+ * so that the verdict of a shared filter is computed once per packet.
+ */
+
+/* classic BPF program built from kernel memory */
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0))
+typedef struct bpf_prog 	pfq_filter_t;
+#else
+typedef struct sk_filter 	pfq_filter_t;
+#endif
+
+
+struct pfq_bpf
+{
+	struct list_head	list;
+	enum pfq_bpf_kind	kind;
+	int			users;
+
+	pfq_filter_t		*filter;	/* pfq_bpf_program only */
+
+	int			num_tests;
+	struct pfq_bpf_test	test[Q_BPF_MAX_TESTS];
+	u8			otherwise;	/* action after the last test */
+
+	unsigned int 		len;
+	struct sock_filter 	insns[0];
+};
+
+
+pfq_filter_t * pfq_alloc_sk_filter(struct sock_filter *insns, unsigned int len);
+
+void pfq_free_sk_filter(pfq_filter_t *filter);
+
+
+extern struct pfq_bpf * pfq_bpf_get(struct sock_fprog *fprog);
+extern void pfq_bpf_put(struct pfq_bpf *bpf);
+
+extern bool pfq_bpf_run_native(struct pfq_bpf const *bpf, struct sk_buff const *skb);
+
+
+static inline
+bool pfq_bpf_run(struct pfq_bpf const *bpf, struct sk_buff *skb)
+{
+	switch(bpf->kind)
+	{
+	case pfq_bpf_accept:	return true;
+	case pfq_bpf_reject:	return false;
+	case pfq_bpf_native:	return pfq_bpf_run_native(bpf, skb);
+	case pfq_bpf_program:	break;
+	}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0))
+	return BPF_PROG_RUN(bpf->filter, skb);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
+	return SK_RUN_FILTER(bpf->filter, skb);
+#else
+	return sk_run_filter(skb, bpf->filter->insns);
+#endif
+}
+
+
+static inline
+bool pfq_bpf_shared(struct pfq_bpf const *bpf)
+{
+	return bpf->kind == pfq_bpf_program && bpf->users > 1;
+}
 
 #endif /* PF_Q_BPF_H */
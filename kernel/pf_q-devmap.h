@@ -67,6 +67,8 @@ unsigned long __pfq_devmap_get_groups(int d, int q)
 }
 
 
+/* per device fast flag: some group listens to one of its queues */
+
 static inline
 int __pfq_devmap_monitor_get(int index)
 {
@@ -26,6 +26,7 @@
 #include <linux/types.h>
 
 #include <pf_q-global.h>
+#include <pf_q-macro.h>
 
 
 struct local_data __percpu    * cpu_data;
@@ -40,10 +41,15 @@ int cap_len      	= 1514;
 int max_len      	= 1514;
 
 int batch_len 		= 1;
+int flush_timeout 	= 1000;         /* max hold time of a batch (usec) */
+int rx_engine 		= Q_RX_ENGINE_GROUP;
+int prefetch_distance 	= 4;            /* packets (and Rx slots) prefetched ahead */
 int vl_untag     	= 0;
+int gro_split    	= 0;
 
 int skb_pool_size 	= 1024;
 int tx_max_retry 	= 1024;
+int tx_spin_usec 	= 50;		/* Tx pacing: busy-wait window before a deadline */
 
 struct pfq_global_stats global_stats;
 struct pfq_memory_stats memory_stats;
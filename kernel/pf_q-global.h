@@ -42,11 +42,16 @@ extern int cap_len;
 extern int max_len;
 
 extern int batch_len;
+extern int flush_timeout;
+extern int rx_engine;
+extern int prefetch_distance;
 
 extern int vl_untag;
+extern int gro_split;
 
 extern int skb_pool_size;
 extern int tx_max_retry;
+extern int tx_spin_usec;
 
 extern struct pfq_global_stats global_stats;
 extern struct pfq_memory_stats memory_stats;
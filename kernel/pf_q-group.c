@@ -27,6 +27,8 @@
 #include <linux/module.h>
 #include <linux/semaphore.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include <pf_q-group.h>
 #include <pf_q-devmap.h>
@@ -40,6 +42,94 @@ DEFINE_SEMAPHORE(group_sem);
 static struct pfq_group pfq_groups[Q_MAX_GROUP];
 
 
+/*
+ * Objects swapped out of a group: they are released once the readers of the
+ * Rx path (RCU read-side) are done with them. The release itself may sleep
+ * (computation fini, pfq_bpf_put), hence it is deferred from the RCU callback
+ * to a work item.
+ */
+
+struct pfq_group_retired
+{
+	struct rcu_head 		rcu;
+	struct work_struct 		work;
+
+	struct pfq_computation_tree    *comp;
+	void 			       *ctx;
+	struct pfq_bpf 		       *filter;
+};
+
+
+static void
+pfq_group_release(struct pfq_computation_tree *comp, void *ctx, struct pfq_bpf *filter)
+{
+	/* call fini on old computation */
+
+	if (comp)
+		pfq_computation_fini(comp);
+
+        kfree(comp);
+        kfree(ctx);
+
+	if (filter)
+        	pfq_bpf_put(filter);
+}
+
+
+static void
+pfq_group_retire_work(struct work_struct *work)
+{
+	struct pfq_group_retired *r = container_of(work, struct pfq_group_retired, work);
+
+	pfq_group_release(r->comp, r->ctx, r->filter);
+	kfree(r);
+}
+
+
+static void
+pfq_group_retire_rcu(struct rcu_head *head)
+{
+	struct pfq_group_retired *r = container_of(head, struct pfq_group_retired, rcu);
+
+	INIT_WORK(&r->work, pfq_group_retire_work);
+	schedule_work(&r->work);
+}
+
+
+static void
+pfq_group_retire(struct pfq_computation_tree *comp, void *ctx, struct pfq_bpf *filter)
+{
+	struct pfq_group_retired *r;
+
+	if (!comp && !ctx && !filter)
+		return;
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (r == NULL) {
+		/* no memory: wait for the readers here */
+		synchronize_rcu();
+		pfq_group_release(comp, ctx, filter);
+		return;
+	}
+
+	r->comp   = comp;
+	r->ctx    = ctx;
+	r->filter = filter;
+
+	call_rcu(&r->rcu, pfq_group_retire_rcu);
+}
+
+
+/* wait for the release of all the retired objects (user-context) */
+
+void
+pfq_group_barrier(void)
+{
+	rcu_barrier();
+	flush_scheduled_work();
+}
+
+
 bool
 __pfq_group_access(int gid, int id, int policy, bool create)
 {
@@ -82,12 +172,12 @@ __pfq_group_init(int gid)
 
         for(i = 0; i < Q_CLASS_MAX; i++)
         {
-                atomic_long_set(&g->sock_mask[i], 0);
+                pfq_atomic_sock_mask_zero(&g->sock_mask[i]);
         }
 
-        atomic_long_set(&g->bp_filter,0L);
-        atomic_long_set(&g->comp,     0L);
-        atomic_long_set(&g->comp_ctx, 0L);
+        RCU_INIT_POINTER(g->bp_filter, NULL);
+        RCU_INIT_POINTER(g->comp, NULL);
+        g->comp_ctx = NULL;
 
 	pfq_group_stats_reset(&g->stats);
 
@@ -108,7 +198,7 @@ static void
 __pfq_group_free(int gid)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        struct sk_filter *filter;
+        struct pfq_bpf *filter;
         struct pfq_computation_tree *old_comp;
         void *old_ctx;
 
@@ -123,22 +213,15 @@ __pfq_group_free(int gid)
         g->owner = -1;
         g->policy = Q_POLICY_GROUP_UNDEFINED;
 
-        filter   = (struct sk_filter *)atomic_long_xchg(&g->bp_filter, 0L);
-        old_comp = (struct pfq_computation_tree *)atomic_long_xchg(&g->comp, 0L);
-        old_ctx  = (void *)atomic_long_xchg(&g->comp_ctx, 0L);
-
-        msleep(Q_GRACE_PERIOD);   /* sleeping is possible here: user-context */
-
-	/* call fini on old computation */
-
-	if (old_comp)
- 		pfq_computation_fini(old_comp);
+        filter   = rcu_dereference_protected(g->bp_filter, 1);
+        old_comp = rcu_dereference_protected(g->comp, 1);
+        old_ctx  = g->comp_ctx;
 
-        kfree(old_comp);
-        kfree(old_ctx);
+        RCU_INIT_POINTER(g->bp_filter, NULL);
+        RCU_INIT_POINTER(g->comp, NULL);
+        g->comp_ctx = NULL;
 
-	if (filter)
-        	pfq_free_sk_filter(filter);
+        pfq_group_retire(old_comp, old_ctx, filter);
 
         g->vlan_filt = false;
         pr_devel("[PFQ] group %d destroyed.\n", gid);
@@ -149,7 +232,6 @@ static int
 __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        unsigned long tmp = 0;
         unsigned long bit;
 
         if (!g)
@@ -168,9 +250,7 @@ __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
         pfq_bitwise_foreach(class_mask, bit,
         {
                  int class = pfq_ctz(bit);
-                 tmp = atomic_long_read(&g->sock_mask[class]);
-                 tmp |= 1L << id;
-                 atomic_long_set(&g->sock_mask[class], tmp);
+                 pfq_atomic_sock_mask_assign(&g->sock_mask[class], id, true);
         })
 
 	if (g->owner == -1) {
@@ -189,7 +269,6 @@ static int
 __pfq_leave_group(int gid, int id)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        unsigned long tmp;
         int i;
 
         if (!g)
@@ -200,9 +279,7 @@ __pfq_leave_group(int gid, int id)
 
         for(i = 0; i < Q_CLASS_MAX; ++i)
         {
-                tmp = atomic_long_read(&g->sock_mask[i]);
-                tmp &= ~(1L << id);
-                atomic_long_set(&g->sock_mask[i], tmp);
+                pfq_atomic_sock_mask_assign(&g->sock_mask[i], id, false);
         }
 
         if (__pfq_group_is_empty(gid))
@@ -211,40 +288,43 @@ __pfq_leave_group(int gid, int id)
         return 0;
 }
 
-unsigned long
-__pfq_get_all_groups_mask(int gid)
+void
+__pfq_get_all_groups_mask(int gid, pfq_sock_mask_t *mask)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        unsigned long mask = 0;
         int i;
 
+        pfq_sock_mask_zero(mask);
+
         if (!g)
-                return mask;
+                return;
 
         for(i = 0; i < Q_CLASS_MAX; ++i)
         {
-                mask |= atomic_long_read(&g->sock_mask[i]);
+                pfq_sock_mask_or_atomic(mask, &g->sock_mask[i]);
         }
-        return mask;
 }
 
 
-void __pfq_set_group_filter(int gid, struct sk_filter *filter)
+void __pfq_set_group_filter(int gid, struct pfq_bpf *filter)
 {
         struct pfq_group * g = pfq_get_group(gid);
-        struct sk_filter * old_filter;
+        struct pfq_bpf * old_filter;
 
         if (!g) {
-                pfq_free_sk_filter(filter);
+                if (filter)
+                        pfq_bpf_put(filter);
                 return;
         }
 
-        old_filter = (void *)atomic_long_xchg(&g->bp_filter, (long)filter);
+        down(&group_sem);
 
-        msleep(Q_GRACE_PERIOD);
+        old_filter = rcu_dereference_protected(g->bp_filter, 1);
+        rcu_assign_pointer(g->bp_filter, filter);
 
-	if (old_filter)
-        	pfq_free_sk_filter(old_filter);
+        pfq_group_retire(NULL, NULL, old_filter);
+
+        up(&group_sem);
 }
 
 
@@ -252,9 +332,13 @@ void __pfq_dismiss_function(void *f)
 {
         int n;
 
+        /* the computations retired may still refer to this function */
+
+        pfq_group_barrier();
+
         for(n = 0; n < Q_MAX_GROUP; n++)
         {
-                struct pfq_computation_tree *comp = (struct pfq_computation_tree *)atomic_long_read(&pfq_get_group(n)->comp);
+                struct pfq_computation_tree *comp = rcu_access_pointer(pfq_get_group(n)->comp);
 
                 BUG_ON(comp != NULL);
         }
@@ -274,20 +358,15 @@ int pfq_set_group_prog(int gid, struct pfq_computation_tree *comp, void *ctx)
 
         down(&group_sem);
 
-        old_comp = (struct pfq_computation_tree *)atomic_long_xchg(&g->comp, (long)comp);
-        old_ctx  = (void *)atomic_long_xchg(&g->comp_ctx, (long)ctx);
-
-        msleep(Q_GRACE_PERIOD);   /* sleeping is possible here: user-context */
-
-	/* call fini on old computation */
+        old_comp = rcu_dereference_protected(g->comp, 1);
+        old_ctx  = g->comp_ctx;
 
-	if (old_comp)
- 		pfq_computation_fini(old_comp);
+        g->comp_ctx = ctx;
+        rcu_assign_pointer(g->comp, comp);
 
-        /* free the old computation/context */
+        /* fini and free the old computation/context after the grace period */
 
-        kfree(old_comp);
-        kfree(old_ctx);
+        pfq_group_retire(old_comp, old_ctx, NULL);
 
         up(&group_sem);
         return 0;
@@ -318,7 +397,7 @@ pfq_join_free_group(int id, unsigned long class_mask, int policy)
         int n = 0;
 
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < Q_MAX_GROUP; n++)
         {
                 if(!pfq_get_group(n)->pid) {
                         __pfq_join_group(n, id, class_mask, policy);
@@ -352,7 +431,7 @@ pfq_leave_all_groups(int id)
 {
         int n = 0;
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < Q_MAX_GROUP; n++)
         {
                 __pfq_leave_group(n, id);
         }
@@ -366,10 +445,11 @@ pfq_get_groups(int id)
         unsigned long ret = 0;
         int n = 0;
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < Q_MAX_GROUP; n++)
         {
-                unsigned long mask = __pfq_get_all_groups_mask(n);
-                if(mask & (1L << id))
+                pfq_sock_mask_t mask;
+                __pfq_get_all_groups_mask(n, &mask);
+                if(pfq_sock_mask_test(&mask, id))
                         ret |= (1UL << n);
         }
         up(&group_sem);
@@ -30,8 +30,10 @@
 #include <linux/filter.h>
 #include <linux/spinlock.h>
 #include <linux/semaphore.h>
+#include <linux/rcupdate.h>
 
 #include <pf_q-macro.h>
+#include <pf_q-sockmask.h>
 #include <pf_q-sparse.h>
 #include <pf_q-stats.h>
 #include <pf_q-bpf.h>
@@ -58,15 +60,15 @@ struct pfq_group
         int pid;	                                /* process id for restricted/private group */
 	int owner;					/* id of the owner */
 
-        atomic_long_t sock_mask[Q_CLASS_MAX];           /* for class: Q_CLASS_DEFAULT, Q_CLASS_USER_PLANE, Q_CLASS_CONTROL_PLANE etc... */
+        pfq_atomic_sock_mask_t sock_mask[Q_CLASS_MAX];  /* for class: Q_CLASS_DEFAULT, Q_CLASS_USER_PLANE, Q_CLASS_CONTROL_PLANE etc... */
 
-        atomic_long_t bp_filter; 			/* struct sk_filter pointer */
+        struct pfq_bpf __rcu *bp_filter; 		/* bpf filter (RCU) */
 
         bool   vlan_filt;                               /* enable/disable vlan filtering */
         char   vid_filters[4096];                       /* vlan filters */
 
-        atomic_long_t comp;                             /* struct pfq_computation_tree *  (new functional program) */
-        atomic_long_t comp_ctx;                         /* void *: storage context (new functional program) */
+        struct pfq_computation_tree __rcu *comp;        /* functional program (RCU) */
+        void *comp_ctx;                                 /* storage context of the program (under group_sem) */
 
 	struct pfq_group_stats stats;
 
@@ -88,14 +90,15 @@ extern int pfq_check_group(int id, int gid, const char *msg);
 extern int pfq_check_group_access(int id, int gid, const char *msg);
 
 extern unsigned long pfq_get_groups(int id);
-extern unsigned long __pfq_get_all_groups_mask(int gid);
+extern void __pfq_get_all_groups_mask(int gid, pfq_sock_mask_t *mask);
 
 extern bool __pfq_group_access(int gid, int id, int policy, bool join);
 
 extern int  __pfq_get_group_context(int gid, int level, int size, void __user *context);
-extern void __pfq_set_group_filter(int gid, struct sk_filter *filter);
+extern void __pfq_set_group_filter(int gid, struct pfq_bpf *filter);
 
 extern void __pfq_dismiss_function(void *f);
+extern void pfq_group_barrier(void);
 
 extern struct pfq_group * pfq_get_group(int gid);
 
@@ -107,13 +110,17 @@ extern void __pfq_set_group_vlan_filter(int gid, bool value, int vid);
 static inline
 bool __pfq_group_is_empty(int gid)
 {
-        return __pfq_get_all_groups_mask(gid) == 0;
+        pfq_sock_mask_t mask;
+        __pfq_get_all_groups_mask(gid, &mask);
+        return pfq_sock_mask_empty(&mask);
 }
 
 static inline
 bool __pfq_has_joined_group(int gid, int id)
 {
-        return __pfq_get_all_groups_mask(gid) & (1L << id);
+        pfq_sock_mask_t mask;
+        __pfq_get_all_groups_mask(gid, &mask);
+        return pfq_sock_mask_test(&mask, id);
 }
 
 
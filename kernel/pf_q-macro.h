@@ -24,7 +24,7 @@
 #ifndef PF_Q_MACRO_H
 #define PF_Q_MACRO_H
 
-#define Q_MAX_ID                (sizeof(long)<<3)
+#define Q_MAX_ID                256     /* sockets, see pf_q-sockmask.h */
 #define Q_MAX_GROUP             (sizeof(long)<<3)
 #define Q_SKBUFF_SHORT_BATCH	(sizeof(long)<<3)
 #define Q_SKBUFF_LONG_BATCH	128
@@ -40,6 +40,14 @@
 
 #define Q_GRACE_PERIOD 		100 /* msec */
 
+#define Q_RX_ENGINE_GROUP 	0   /* rx_engine: group-major, each group walks the batch */
+#define Q_RX_ENGINE_PACKET 	1   /* rx_engine: packet-major, each packet visits its groups */
+#define Q_RX_SOCK_GIDS 		4   /* packet-major: groups pending per socket in a batch */
+
+#define Q_TX_SKB_CACHE_DEVS 	4   /* devices with a Tx skb cache, per cpu */
+
+#define Q_TX_ZCOPY_HEAD 	128 /* bytes copied into the linear part of a zero-copy Tx skb */
+
 #define Q_TX_RING_SIZE          (8192)
 #define Q_TX_RING_MASK          (PFQ_TX_RING_SIZE-1)
 
@@ -41,6 +41,9 @@ pfq_get_skb_pool_stats(void)
                                         sparse_read(&memory_stats.err_shared),
                                         sparse_read(&memory_stats.err_cloned),
                                         sparse_read(&memory_stats.err_memory),
+                                        sparse_read(&memory_stats.tx_hit),
+                                        sparse_read(&memory_stats.tx_miss),
+                                        sparse_read(&memory_stats.tx_busy),
         			      };
         return ret;
 }
@@ -28,6 +28,7 @@
 #include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/hardirq.h>
+#include <linux/netdevice.h>
 #include <net/dst.h>
 
 #include <pf_q-skbuff-list.h>
@@ -52,6 +53,10 @@ struct pfq_skb_pool_stat
         uint64_t        err_shared;
         uint64_t        err_cloned;
         uint64_t        err_memory;
+
+        uint64_t        tx_hit;
+        uint64_t        tx_miss;
+        uint64_t        tx_busy;
 };
 
 
@@ -262,16 +267,52 @@ struct sk_buff * ____pfq_alloc_skb_pool(unsigned int size, gfp_t priority, int f
 }
 
 
+#ifdef PFQ_USE_SKB_RECYCLE
+
+/* Tx skb cache of this cpu for the given device and size, NULL if all the caches are taken */
+
+static inline
+struct pfq_sk_buff_cache *
+pfq_skb_tx_cache(struct local_data *local, struct net_device *dev, unsigned int size)
+{
+        struct pfq_sk_buff_cache *unused = NULL;
+        int n;
+
+        for(n = 0; n < Q_TX_SKB_CACHE_DEVS; n++)
+        {
+                struct pfq_sk_buff_cache *cache = &local->tx_cache[n];
+
+                if (cache->ifindex == dev->ifindex && cache->size == size)
+                        return cache;
+
+                if (cache->ifindex == 0 && unused == NULL)
+                        unused = cache;
+        }
+
+        if (unused) {
+                unused->ifindex = dev->ifindex;
+                unused->size = size;
+        }
+
+        return unused;
+}
+
+#endif
+
+
 static inline
 int pfq_skb_pool_init(void)
 {
-        int cpu;
+        int cpu, n;
         for_each_possible_cpu(cpu)
         {
                 struct local_data *this_cpu = per_cpu_ptr(cpu_data, cpu);
 
-                if (pfq_sk_buff_list_init(&this_cpu->tx_pool) != 0)
-                	return -ENOMEM;
+                for(n = 0; n < Q_TX_SKB_CACHE_DEVS; n++)
+                {
+                        if (pfq_sk_buff_cache_init(&this_cpu->tx_cache[n], skb_pool_size) != 0)
+                                return -ENOMEM;
+                }
 
                 if (pfq_sk_buff_list_init(&this_cpu->rx_pool) != 0)
                 	return -ENOMEM;
@@ -299,16 +340,20 @@ void pfq_skb_pool_enable(bool value)
 static inline
 int pfq_skb_pool_purge(void)
 {
-        int cpu, total = 0;
+        int cpu, n, total = 0;
         for_each_possible_cpu(cpu)
         {
                 struct local_data *local = per_cpu_ptr(cpu_data, cpu);
 
                 total += pfq_sk_buff_list_size(&local->rx_pool);
-                total += pfq_sk_buff_list_size(&local->tx_pool);
+
+                for(n = 0; n < Q_TX_SKB_CACHE_DEVS; n++)
+                {
+                        total += pfq_sk_buff_cache_len(&local->tx_cache[n]);
+                        pfq_sk_buff_cache_free(&local->tx_cache[n]);
+                }
 
                 pfq_sk_buff_list_free(&local->rx_pool);
-                pfq_sk_buff_list_free(&local->tx_pool);
         }
 
 #ifdef PFQ_USE_EXTENDED_PROC
@@ -335,20 +380,93 @@ struct sk_buff * pfq_alloc_skb(unsigned int size, gfp_t priority)
 }
 
 
+/* allocate a Tx skb from the OS, bypassing the cache (e.g. zero-copy heads, never parked) */
+
+static inline
+struct sk_buff * __pfq_tx_alloc_skb(struct net_device *dev, unsigned int size, gfp_t priority, int node)
+{
+        unsigned int headroom = LL_RESERVED_SPACE(dev);
+        struct sk_buff *skb;
+
+#ifdef PFQ_USE_EXTENDED_PROC
+        sparse_inc(&memory_stats.os_alloc);
+#endif
+        skb = __alloc_skb(NET_SKB_PAD + headroom + size, priority, 0, node);
+        if (likely(skb))
+                skb_reserve(skb, NET_SKB_PAD + headroom);
+        return skb;
+}
+
+
 static inline
-struct sk_buff * pfq_tx_alloc_skb(unsigned int size, gfp_t priority, int node)
+struct sk_buff * pfq_tx_alloc_skb(struct net_device *dev, unsigned int size, gfp_t priority, int node)
 {
 #ifdef PFQ_USE_SKB_RECYCLE
+        unsigned int headroom = LL_RESERVED_SPACE(dev);
         struct local_data *this_cpu = __this_cpu_ptr(cpu_data);
+        struct sk_buff *skb;
 
-        if (atomic_read(&this_cpu->enable_skb_pool))
-                return ____pfq_alloc_skb_pool(size, priority, 0, node, &this_cpu->tx_pool);
+        if (atomic_read(&this_cpu->enable_skb_pool)) {
+
+                struct pfq_sk_buff_cache *cache = pfq_skb_tx_cache(this_cpu, dev, size);
+                if (cache) {
+
+                        /* the oldest skb parked is reusable once the driver has released it */
 
+                        skb = pfq_sk_buff_cache_peek(cache);
+                        if (skb && !skb_shared(skb)) {
+
+                                pfq_sk_buff_cache_dequeue(cache);
+
+                                if (likely(pfq_skb_is_recycleable(skb, headroom + size))) {
 #ifdef PFQ_USE_EXTENDED_PROC
-        sparse_inc(&memory_stats.os_alloc);
+                                        sparse_inc(&memory_stats.tx_hit);
+#endif
+                                        skb = pfq_skb_recycle(skb);
+                                        skb_reserve(skb, headroom);
+                                        return skb;
+                                }
+
+                                consume_skb(skb);
+                                skb = NULL;
+                        }
+#ifdef PFQ_USE_EXTENDED_PROC
+                        if (skb)
+                                sparse_inc(&memory_stats.tx_busy);
+                        else
+                                sparse_inc(&memory_stats.tx_miss);
 #endif
+                }
+        }
 #endif
-        return __alloc_skb(size, priority, 0, NUMA_NO_NODE);
+        return __pfq_tx_alloc_skb(dev, size, priority, node);
+}
+
+
+/* release a transmitted skb: it is parked in the Tx cache of the device, even if the driver still holds it */
+
+static inline
+void pfq_kfree_skb_tx(struct sk_buff *skb, struct net_device *dev, unsigned int size)
+{
+#ifdef PFQ_USE_SKB_RECYCLE
+        struct local_data *this_cpu = __this_cpu_ptr(cpu_data);
+
+        if (atomic_read(&this_cpu->enable_skb_pool) && pfq_skb_is_parkable(skb)) {
+
+                struct pfq_sk_buff_cache *cache = pfq_skb_tx_cache(this_cpu, dev, size);
+                if (cache && pfq_sk_buff_cache_park(cache, skb)) {
+#ifdef PFQ_USE_EXTENDED_PROC
+                        sparse_inc(&memory_stats.rc_free);
+#endif
+                        return;
+                }
+        }
+#endif
+
+#ifdef PFQ_USE_EXTENDED_PROC
+        sparse_inc(&memory_stats.os_free);
+#endif
+        consume_skb(skb);
 }
 
 
@@ -28,10 +28,30 @@
 
 #include <pf_q-global.h>
 #include <pf_q-memory.h>
+#include <pf_q-percpu.h>
 #include <pf_q-module.h>
 #include <pf_q-GC.h>
 
 
+static void
+pfq_flush_tasklet(unsigned long data)
+{
+	pfq_receive_flush();
+}
+
+
+static enum hrtimer_restart
+pfq_flush_timer(struct hrtimer *timer)
+{
+	struct local_data *local = container_of(timer, struct local_data, flush_timer);
+
+	/* the batch is processed in softirq context, on this cpu */
+
+	tasklet_schedule(&local->flush_tasklet);
+	return HRTIMER_NORESTART;
+}
+
+
 int pfq_percpu_init(void)
 {
 	int cpu;
@@ -49,12 +69,31 @@ int pfq_percpu_init(void)
                 struct local_data *local = per_cpu_ptr(cpu_data, cpu);
 
 		gc_data_init(&local->gc);
+
+		hrtimer_init(&local->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		local->flush_timer.function = pfq_flush_timer;
+
+		tasklet_init(&local->flush_tasklet, pfq_flush_tasklet, 0);
 	}
 
 	return 0;
 }
 
 
+void pfq_percpu_fini(void)
+{
+	int cpu;
+
+        for_each_possible_cpu(cpu) {
+
+                struct local_data *local = per_cpu_ptr(cpu_data, cpu);
+
+		hrtimer_cancel(&local->flush_timer);
+		tasklet_kill(&local->flush_tasklet);
+	}
+}
+
+
 int pfq_percpu_flush(void)
 {
         int cpu;
@@ -76,6 +115,16 @@ int pfq_percpu_flush(void)
                 total += local->gc.pool.len;
 
 		gc_reset(&local->gc);
+
+#ifdef PFQ_USE_SKB_RECYCLE
+		/* release the Tx caches: the devices may go away */
+
+		for(n = 0; n < Q_TX_SKB_CACHE_DEVS; n++)
+		{
+			if (local->tx_cache[n].node)
+				total += pfq_sk_buff_cache_purge(&local->tx_cache[n]);
+		}
+#endif
         }
 
         return total;
@@ -26,29 +26,67 @@
 
 #include <linux/percpu.h>
 #include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/timex.h>
 
 #include <pf_q-skbuff-list.h>
 #include <pf_q-macro.h>
+#include <pf_q-sockmask.h>
+#include <pf_q-bpf.h>
 #include <pf_q-GC.h>
 
 int pfq_percpu_init(void);
+void pfq_percpu_fini(void);
 int pfq_percpu_flush(void);
 
+/* defined in pf_q.c */
+
+void pfq_receive_flush(void);
+
 /* per-cpu data... */
 
 struct local_data
 {
-        unsigned long           eligible_mask;
-        unsigned long           sock_mask [Q_MAX_ID];
+        pfq_sock_mask_t         eligible_mask;
+        int                     sock_id [Q_MAX_ID];     /* sockets of eligible_mask, for steering */
 
         int                     sock_cnt;
 
+        unsigned long long      sock_queue [Q_MAX_ID];  /* per socket: packets of the batch (zero between batches) */
+
+        struct
+        {
+                unsigned long long queue;
+                int             gid;
+        } sock_pending [Q_MAX_ID][Q_RX_SOCK_GIDS];      /* per socket and group: pending packets (packet-major) */
+
+        struct
+        {
+                struct pfq_bpf const *bpf;
+                bool            pass;
+        } bpf_verdict [Q_SKBUFF_SHORT_BATCH];           /* per packet: last shared filter run */
+
+#ifdef PFQ_RX_PROFILE
+        struct
+        {
+                cycles_t        setup;                  /* group masks and control blocks */
+                cycles_t        eval;                   /* filters and functional programs */
+                cycles_t        copy;                   /* enqueue into the endpoints */
+                cycles_t        fwd;                    /* forward to kernel/devices and free */
+                size_t          packets;
+        } rx_prof;
+#endif
+
 	struct gc_data 		gc;		/* garbage collector */
 	ktime_t 		last_ts;	/* timestamp of the last packet */
 
+	struct hrtimer 		flush_timer;	/* bounds the hold time of the batch */
+	struct tasklet_struct 	flush_tasklet;
+
         atomic_t                enable_skb_pool;
 
-        struct pfq_sk_buff_list tx_pool;
+        struct pfq_sk_buff_cache tx_cache[Q_TX_SKB_CACHE_DEVS];
         struct pfq_sk_buff_list rx_pool;
 
 } ____cacheline_aligned;
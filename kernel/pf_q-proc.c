@@ -25,6 +25,7 @@
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/rcupdate.h>
 #include <linux/pf_q.h>
 
 #include <net/net_namespace.h>
@@ -32,6 +33,7 @@
 #include <pf_q-module.h>
 #include <pf_q-global.h>
 #include <pf_q-group.h>
+#include <pf_q-sock.h>
 #include <pf_q-bitops.h>
 #include <pf_q-sparse.h>
 #include <pf_q-macro.h>
@@ -48,6 +50,7 @@ struct proc_dir_entry *pfq_proc_dir = NULL;
 static const char proc_computations[] = "computations";
 static const char proc_groups[]       = "groups";
 static const char proc_stats[]        = "stats";
+static const char proc_sockets[]      = "sockets";
 
 #ifdef PFQ_USE_EXTENDED_PROC
 static const char proc_memory[]       = "memory";
@@ -97,7 +100,7 @@ static int pfq_proc_comp(struct seq_file *m, void *v)
 		if (!this_group->policy)
 			continue;
 
-                comp = (struct pfq_computation_tree *)atomic_long_read(&this_group->comp);
+                comp = rcu_dereference_protected(this_group->comp, 1);
 
 		seq_printf(m, "group=%zu ", n);
 
@@ -108,17 +111,35 @@ static int pfq_proc_comp(struct seq_file *m, void *v)
 	return 0;
 }
 
+/* print a socket mask in hex, most significant word first */
+
+static void
+seq_printf_sock_mask(struct seq_file *m, pfq_atomic_sock_mask_t *mask)
+{
+	int n = Q_SOCK_MASK_WORDS - 1;
+
+	while (n > 0 && atomic_long_read(&mask->word[n]) == 0)
+		n--;
+
+	seq_printf(m, "%08lx", atomic_long_read(&mask->word[n]));
+	while (n-- > 0)
+		seq_printf(m, "%016lx", atomic_long_read(&mask->word[n]));
+	seq_printf(m, " ");
+}
+
 static int pfq_proc_groups(struct seq_file *m, void *v)
 {
 	size_t n;
 
-	seq_printf(m, "group: recv      drop      forward   kernel    disc      quit      pol pid   def.    uplane   cplane    ctrl\n");
+	seq_printf(m, "group: recv      drop      forward   kernel    disc      quit      pol pid bpf def.    uplane   cplane    ctrl\n");
 
 	down(&group_sem);
 
 	for(n = 0; n < Q_MAX_GROUP; n++)
 	{
 		struct pfq_group *this_group = pfq_get_group(n);
+		struct pfq_bpf *bpf;
+
 		if (!this_group->policy)
 			continue;
 
@@ -131,10 +152,18 @@ static int pfq_proc_groups(struct seq_file *m, void *v)
 
         	seq_printf(m, "%3d %3d ", this_group->policy, this_group->pid);
 
-        	seq_printf(m, "%08lx %08lx %08lx %08lx \n", atomic_long_read(&this_group->sock_mask[pfq_ctz(Q_CLASS_DEFAULT)]),
-        				                    atomic_long_read(&this_group->sock_mask[pfq_ctz(Q_CLASS_USER_PLANE)]),
-        				                    atomic_long_read(&this_group->sock_mask[pfq_ctz(Q_CLASS_CONTROL_PLANE)]),
-        				                    atomic_long_read(&this_group->sock_mask[63]));
+		/* users of the group filter: groups with identical programs share it */
+
+		rcu_read_lock();
+		bpf = rcu_dereference(this_group->bp_filter);
+        	seq_printf(m, "%3d ", bpf ? ACCESS_ONCE(bpf->users) : 0);
+		rcu_read_unlock();
+
+        	seq_printf_sock_mask(m, &this_group->sock_mask[pfq_ctz(Q_CLASS_DEFAULT)]);
+        	seq_printf_sock_mask(m, &this_group->sock_mask[pfq_ctz(Q_CLASS_USER_PLANE)]);
+        	seq_printf_sock_mask(m, &this_group->sock_mask[pfq_ctz(Q_CLASS_CONTROL_PLANE)]);
+        	seq_printf_sock_mask(m, &this_group->sock_mask[63]);
+        	seq_printf(m, "\n");
 
 	}
 
@@ -142,17 +171,58 @@ static int pfq_proc_groups(struct seq_file *m, void *v)
 	return 0;
 }
 
+static int pfq_proc_sockets(struct seq_file *m, void *v)
+{
+	int n;
+
+	seq_printf(m, "sock: enabled memory    kind node tstamp err(usec)\n");
+
+	/* a socket released during the walk stays valid until rcu_read_unlock:
+	 * pfq_release clears its id and then waits for a grace period */
+
+	rcu_read_lock();
+
+	for(n = 0; n < Q_MAX_ID; n++)
+	{
+		struct pfq_sock *so = pfq_get_sock_by_id(n);
+		void *addr;
+		int tstamp;
+
+		if (!so)
+			continue;
+
+		addr   = ACCESS_ONCE(so->shmem.addr);
+		tstamp = ACCESS_ONCE(so->rx_opt.tstamp);
+
+		seq_printf(m, "%4d: %-7d %-10zu %-4s %-4d %-6s %d\n", n, addr != NULL,
+			   ACCESS_ONCE(so->shmem.size),
+			   so->shmem.kind == pfq_shmem_user ? "user" :
+			   so->shmem.kind == pfq_shmem_huge ? "huge" : "virt",
+			   addr ? so->shmem.node : so->shmem_node,
+			   tstamp == Q_TSTAMP_SOFTWARE ? "sw"    :
+			   tstamp == Q_TSTAMP_HARDWARE ? "hw"    :
+			   tstamp == Q_TSTAMP_BATCH    ? "batch" : "off",
+			   pfq_sock_tstamp_error(so));
+	}
+
+	rcu_read_unlock();
+
+	return 0;
+}
+
 static int pfq_proc_stats(struct seq_file *m, void *v)
 {
 	seq_printf(m, "INPUT:\n");
 	seq_printf(m, "received  : %ld\n", sparse_read(&global_stats.recv));
 	seq_printf(m, "lost      : %ld\n", sparse_read(&global_stats.lost));
+	seq_printf(m, "dropped   : %ld\n", sparse_read(&global_stats.drop));
 	seq_printf(m, "OUTPUT:\n");
 	seq_printf(m, "sent      : %ld\n", sparse_read(&global_stats.sent));
 	seq_printf(m, "kernel    : %ld\n", sparse_read(&global_stats.kern));
 	seq_printf(m, "forwarded : %ld\n", sparse_read(&global_stats.frwd));
 	seq_printf(m, "discarded : %ld\n", sparse_read(&global_stats.disc));
 	seq_printf(m, "quit      : %ld\n", sparse_read(&global_stats.quit));
+	seq_printf(m, "zc wait   : %ld\n", sparse_read(&global_stats.zcwt));
 #ifdef PFQ_USE_EXTENDED_PROC
 	seq_printf(m, "SCHEDULE:\n");
 	seq_printf(m, "poll      : %ld\n", sparse_read(&global_stats.poll));
@@ -175,6 +245,9 @@ static int pfq_proc_memory(struct seq_file *m, void *v)
 	seq_printf(m, "error shared   : %ld\n", sparse_read(&memory_stats.err_shared));
 	seq_printf(m, "error cloned   : %ld\n", sparse_read(&memory_stats.err_cloned));
 	seq_printf(m, "error memory   : %ld\n", sparse_read(&memory_stats.err_memory));
+	seq_printf(m, "tx-cache hit   : %ld\n", sparse_read(&memory_stats.tx_hit));
+	seq_printf(m, "tx-cache miss  : %ld\n", sparse_read(&memory_stats.tx_miss));
+	seq_printf(m, "tx-cache busy  : %ld\n", sparse_read(&memory_stats.tx_busy));
 	return 0;
 }
 
@@ -214,6 +287,11 @@ static int pfq_proc_comp_open(struct inode *inode, struct file *file)
 	return single_open(file, pfq_proc_comp, PDE_DATA(inode));
 }
 
+static int pfq_proc_sockets_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pfq_proc_sockets, PDE_DATA(inode));
+}
+
 static int pfq_proc_stats_open(struct inode *inode, struct file *file)
 {
 	return single_open(file, pfq_proc_stats, PDE_DATA(inode));
@@ -245,6 +323,14 @@ static const struct file_operations pfq_proc_groups_fops = {
  	.release = single_release,
 };
 
+static const struct file_operations pfq_proc_sockets_fops = {
+ 	.owner   = THIS_MODULE,
+ 	.open    = pfq_proc_sockets_open,
+ 	.read    = seq_read,
+ 	.llseek  = seq_lseek,
+ 	.release = single_release,
+};
+
 static const struct file_operations pfq_proc_comp_fops = {
  	.owner   = THIS_MODULE,
  	.open    = pfq_proc_comp_open,
@@ -264,6 +350,7 @@ int pfq_proc_init(void)
 	proc_create(proc_computations, 	0644, pfq_proc_dir, &pfq_proc_comp_fops);
 	proc_create(proc_groups,       	0644, pfq_proc_dir, &pfq_proc_groups_fops);
 	proc_create(proc_stats,		0644, pfq_proc_dir, &pfq_proc_stats_fops);
+	proc_create(proc_sockets,	0644, pfq_proc_dir, &pfq_proc_sockets_fops);
 #ifdef PFQ_USE_EXTENDED_PROC
 	proc_create(proc_memory,	0644, pfq_proc_dir, &pfq_proc_memory_fops);
 #endif
@@ -277,6 +364,7 @@ int pfq_proc_fini(void)
 	remove_proc_entry(proc_computations, pfq_proc_dir);
 	remove_proc_entry(proc_groups, 	     pfq_proc_dir);
 	remove_proc_entry(proc_stats, 	     pfq_proc_dir);
+	remove_proc_entry(proc_sockets,      pfq_proc_dir);
 #ifdef PFQ_USE_EXTENDED_PROC
 	remove_proc_entry(proc_memory, 	     pfq_proc_dir);
 #endif
@@ -29,6 +29,11 @@
 #include <linux/printk.h>
 #include <linux/kthread.h>
 #include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/netdevice.h>
+#include <linux/prefetch.h>
+#include <linux/highmem.h>
+#include <linux/skbuff.h>
 #include <linux/pf_q.h>
 
 #include <pf_q-shared-queue.h>
@@ -39,114 +44,565 @@
 #include <pf_q-sock.h>
 #include <pf_q-global.h>
 #include <pf_q-memory.h>
+#include <pf_q-devmap.h>
+#include <pf_q-group.h>
 #include <pf_q-GC.h>
+#include <pf_q-transmit.h>
 
 
 static inline
-void *pfq_skb_copy_from_linear_data(const struct sk_buff *skb, void *to, size_t len)
+void *pfq_skb_copy_from_linear_data(const struct sk_buff *skb, void *to, size_t len, size_t room)
 {
-	if (len < 64 && (len + skb_tailroom(skb) >= 64))
+	if (len < 64 && room >= 64 && (len + skb_tailroom(skb) >= 64))
 		return memcpy(to, skb->data, 64);
 	return memcpy(to, skb->data, len);
 }
 
 
 static inline
-char *mpsc_slot_ptr(struct pfq_rx_opt *ro, struct pfq_rx_queue *qd, size_t qindex, size_t slot)
+char *mpsc_slot_ptr(struct pfq_rx_opt *ro, size_t ring, size_t qindex, size_t offset)
 {
-	return (char *)(ro->base_addr) + ( (qindex&1) ? ro->queue_size : 0 + slot) * ro->slot_size;
+	return (char *)(ro->base_addr) + ring * pfq_rx_ring_mem(ro)
+		+ ((qindex & 1) ? ro->queue_size * ro->slot_size : 0) + offset;
 }
 
 
-size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
-		              struct pfq_skbuff_batch *skbs,
-		              unsigned long long mask,
-		              int burst_len,
-		              int gid)
+/*
+ * Header-split layout: a region of n slots holds a dense array of n headers
+ * followed by the payload arena, with slot_size - sizeof(pfq_pkthdr) bytes per packet.
+ */
+
+static inline
+size_t mpsc_hdr_stride(struct pfq_rx_opt *ro)
 {
-	struct pfq_rx_queue *rx_queue = pfq_get_rx_queue(ro);
-	int data, qlen, qindex;
-	struct sk_buff *skb;
+	return ro->layout == Q_RX_LAYOUT_SPLIT ? sizeof(struct pfq_pkthdr) : ro->slot_size;
+}
 
-	size_t n, sent = 0;
-	char *this_slot;
 
-	if (unlikely(rx_queue == NULL))
+static inline
+char *mpsc_payload_ptr(struct pfq_rx_opt *ro, char *region, size_t slots, size_t index, volatile struct pfq_pkthdr *hdr)
+{
+	if (ro->layout == Q_RX_LAYOUT_SPLIT)
+		return region + slots * sizeof(struct pfq_pkthdr) + index * (ro->slot_size - sizeof(struct pfq_pkthdr));
+	return (char *)(hdr+1);
+}
+
+
+/*
+ * Prefetch for write count slots (header and payload) starting at index,
+ * in a region of the given number of slots. Used to keep the stores of the
+ * copy loop prefetch_distance slots ahead. Not for varlen slots.
+ */
+
+static inline
+void mpsc_prefetch_slots(struct pfq_rx_opt *ro, char *region, size_t slots, size_t index, size_t count, bool wrap)
+{
+	for(; count > 0; count--, index++)
+	{
+		char *hdr;
+
+		if (index >= slots) {
+			if (!wrap)
+				return;
+			index -= slots;
+		}
+
+		hdr = region + index * mpsc_hdr_stride(ro);
+
+		prefetchw(hdr);
+		prefetchw(mpsc_payload_ptr(ro, region, slots, index, (struct pfq_pkthdr *)hdr));
+	}
+}
+
+
+static inline
+size_t mpsc_varlen_slot_size(struct pfq_rx_opt *ro, struct sk_buff *skb)
+{
+	return Q_MPDB_QUEUE_SLOT_SIZE(min_t(size_t, skb->len, ro->caplen));
+}
+
+
+/*
+ * Reserve room for a burst of variable-length slots.
+ * Only the slots that fit in the queue are reserved (no overshoot),
+ * so that the offset in the data word is always the end of the committed area.
+ */
+
+static
+int mpsc_varlen_reserve(struct pfq_rx_opt *ro, struct pfq_rx_queue *rx_queue,
+			struct pfq_skbuff_batch *skbs, unsigned long long mask,
+			unsigned long long *data)
+{
+	const size_t capacity = ro->queue_size * ro->slot_size;
+	unsigned long long old, new;
+
+	do {
+		unsigned long long tmp = mask;
+		struct sk_buff *skb;
+		size_t offset, n;
+		int len = 0;
+
+		old = atomic64_read((atomic64_t *)&rx_queue->data);
+		offset = Q_SHARED_QUEUE_OFF(old);
+
+		for_each_skbuff_bitmask(skbs, tmp, skb, n)
+		{
+			size_t size = mpsc_varlen_slot_size(ro, skb);
+			if (offset + size > capacity ||
+			    Q_SHARED_QUEUE_LEN(old) + len == 0x00ffffffu)
+				break;
+			offset += size;
+			len++;
+		}
+
+		if (len == 0)
+			return 0;
+
+		new = old + ((unsigned long long)len << 32) + (offset - Q_SHARED_QUEUE_OFF(old));
+	}
+	while (atomic64_cmpxchg((atomic64_t *)&rx_queue->data, old, new) != old);
+
+	*data = old;
+	return Q_SHARED_QUEUE_LEN(new) - Q_SHARED_QUEUE_LEN(old);
+}
+
+
+/*
+ * Copy of a nonlinear skb without frag_list (e.g. GRO aggregates): the linear
+ * head, then the page frags straight into the slot, one page at a time.
+ */
+
+static inline
+void pfq_skb_copy_frags(const struct sk_buff *skb, char *to, size_t len)
+{
+	size_t head = min_t(size_t, skb_headlen(skb), len);
+	int i;
+
+	memcpy(to, skb->data, head);
+	to  += head;
+	len -= head;
+
+	for(i = 0; len && i < skb_shinfo(skb)->nr_frags; i++)
+	{
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		size_t size = min_t(size_t, skb_frag_size(frag), len);
+		struct page *page = skb_frag_page(frag) + (frag->page_offset >> PAGE_SHIFT);
+		size_t off = frag->page_offset & ~PAGE_MASK;
+
+		len -= size;
+
+		while (size)
+		{
+			size_t n = min_t(size_t, size, PAGE_SIZE - off);
+			u8 *vaddr = kmap_atomic(page);
+
+			memcpy(to, vaddr + off, n);
+			kunmap_atomic(vaddr);
+
+			to   += n;
+			size -= n;
+			off   = 0;
+			page++;
+		}
+	}
+}
+
+
+/*
+ * Copy the packet and fill the slot header, except the commit.
+ * Return the number of bytes copied, or -1 on failure.
+ */
+
+static inline
+int mpsc_fill_slot(struct pfq_rx_opt *ro, volatile struct pfq_pkthdr *hdr, char *pkt,
+		   struct sk_buff *skb, size_t room, int gid)
+{
+	size_t bytes = min_t(size_t, skb->len, ro->caplen);
+
+	/* copy bytes of packet */
+
+	if (skb_is_nonlinear(skb))
+	{
+		if (!skb_has_frag_list(skb)) {
+			pfq_skb_copy_frags(skb, pkt, bytes);
+		}
+		else if (skb_copy_bits(skb, 0, pkt, bytes) != 0) {
+			printk(KERN_WARNING "[PFQ] BUG! skb_copy_bits failed (bytes=%zu, skb_len=%d mac_len=%d)!\n",
+					    bytes, skb->len, skb->mac_len);
+			return -1;
+		}
+	}
+	else {
+		pfq_skb_copy_from_linear_data(skb, pkt, bytes, room);
+	}
+
+	/* copy mark from pfq_cb (annotation) */
+
+	hdr->data = PFQ_CB(skb)->mark;
+
+	/* setup the header */
+
+	switch(ro->tstamp)
+	{
+	case Q_TSTAMP_SOFTWARE:
+	case Q_TSTAMP_BATCH: {
+		struct timespec ts;
+		skb_get_timestampns(skb, &ts);
+		hdr->tstamp.tv.sec  = (uint32_t)ts.tv_sec;
+		hdr->tstamp.tv.nsec = (uint32_t)ts.tv_nsec;
+	} break;
+
+	case Q_TSTAMP_HARDWARE: {
+
+		/* raw hardware clock, full nanosecond precision (0 if the device did not stamp) */
+
+		u64 ns = ktime_to_ns(skb_hwtstamps(skb)->hwtstamp);
+		u32 rem;
+
+		hdr->tstamp.tv.sec  = (uint32_t)div_u64_rem(ns, NSEC_PER_SEC, &rem);
+		hdr->tstamp.tv.nsec = rem;
+	} break;
+	}
+
+	hdr->if_index    = skb->dev->ifindex & 0xff;
+	hdr->gid         = gid;
+
+	hdr->len         = (uint16_t)skb->len;
+	hdr->caplen 	 = (uint16_t)bytes;
+	hdr->un.vlan_tci = skb->vlan_tci & ~VLAN_TAG_PRESENT;
+	hdr->hw_queue    = (uint8_t)(skb_get_rx_queue(skb) & 0xff);
+
+	return (int)bytes;
+}
+
+
+static inline
+void mpsc_wakeup(struct pfq_rx_opt *ro)
+{
+	if (ro->wakeup_busy_poll)
+		return;
+
+	if (waitqueue_active(&ro->waitqueue)) {
+#ifdef PFQ_USE_EXTENDED_PROC
+		sparse_inc(&global_stats.wake);
+#endif
+		wake_up_interruptible(&ro->waitqueue);
+	}
+}
+
+
+/*
+ * Wakeup policy: the reader is woken up when the queue reaches the watermark;
+ * below it, the latency timer (if any) bounds the time the packets wait.
+ */
+
+static inline
+void mpsc_wakeup_policy(struct pfq_rx_opt *ro, size_t qlen, size_t sent)
+{
+	if (qlen < ro->wakeup_watermark && qlen + sent >= ro->wakeup_watermark) {
+		mpsc_wakeup(ro);
+		return;
+	}
+
+	if (ro->wakeup_timeout && !ro->wakeup_busy_poll &&
+	    !test_bit(0, &ro->wakeup_timer_armed) &&
+	    !test_and_set_bit(0, &ro->wakeup_timer_armed))
+		hrtimer_start(&ro->wakeup_timer, ns_to_ktime((u64)ro->wakeup_timeout * 1000), HRTIMER_MODE_REL);
+}
+
+
+/*
+ * Continuous ring: the memory of the double buffer is used as a single ring
+ * of 2 * queue_size slots. The data word of the header is the free-running
+ * producer index, the reader releases slots by advancing the consumer index.
+ * The commit of a slot is the lap of the ring (+1) it has been written in.
+ */
+
+static
+size_t mpsc_ring_reserve(struct pfq_rx_queue *rx_queue, size_t capacity, size_t len,
+			 unsigned long long *head, size_t *used)
+{
+	unsigned long long old;
+
+	do {
+		old   = atomic64_read((atomic64_t *)&rx_queue->data);
+		*used = (size_t)(old - ACCESS_ONCE(rx_queue->cons));
+		if (*used >= capacity)
+			return 0;
+		if (len > capacity - *used)
+			len = capacity - *used;
+	}
+	/* cmpxchg is a full barrier: slots are not written before the consumer index is read */
+	while (atomic64_cmpxchg((atomic64_t *)&rx_queue->data, old, old + len) != old);
+
+	*head = old;
+	return len;
+}
+
+
+/*
+ * A ring per possible cpu: each ring has a single producer (the receive path
+ * runs in softirq, one instance per cpu, as for the per-cpu GC), so the
+ * producer index is owned by the cpu and published with a plain store.
+ */
+
+static inline
+bool spsc_ring(struct pfq_rx_opt *ro)
+{
+	return ro->num_rings >= nr_cpu_ids;
+}
+
+
+static
+size_t spsc_ring_reserve(struct pfq_rx_queue *rx_queue, size_t capacity, size_t len,
+			 unsigned long long *head, size_t *used)
+{
+	*head = (unsigned long long)atomic64_read((atomic64_t *)&rx_queue->data);
+	*used = (size_t)(*head - ACCESS_ONCE(rx_queue->cons));
+	if (*used >= capacity)
 		return 0;
+	if (len > capacity - *used)
+		len = capacity - *used;
 
-	data = atomic_read((atomic_t *)&rx_queue->data);
+	/* slots are not written before the consumer index is read */
 
-        if (Q_SHARED_QUEUE_LEN(data) > ro->queue_size)
+	smp_mb();
+	return len;
+}
+
+
+/*
+ * Batch commit: the slots carry their own ready flag (commit = lap + 1) and the
+ * published index is moved forward over the ready slots, in order, by any producer.
+ * Nobody waits for the others: whoever completes the oldest pending burst also
+ * publishes the bursts completed after it.
+ */
+
+static
+void mpsc_ring_publish(struct pfq_rx_opt *ro, struct pfq_rx_queue *rx_queue, char *base, size_t capacity)
+{
+	unsigned long long commit, next, end;
+
+	/* the ready flags of this producer are visible before the scan */
+
+	smp_mb();
+
+	do {
+		size_t pos, lap;
+
+		commit = (unsigned long long)atomic64_read((atomic64_t *)&rx_queue->commit);
+		end    = (unsigned long long)atomic64_read((atomic64_t *)&rx_queue->data);
+
+		pos = (size_t)(commit % capacity);
+		lap = (size_t)(commit / capacity);
+
+		for(next = commit; next != end; next++)
+		{
+			volatile struct pfq_pkthdr *hdr = (struct pfq_pkthdr *)(base + pos * mpsc_hdr_stride(ro));
+
+			if (hdr->commit != (uint8_t)(lap + 1))
+				break;
+
+			if (++pos == capacity) {
+				pos = 0;
+				lap++;
+			}
+		}
+
+		if (next == commit)
+			return;
+	}
+	/* cmpxchg is a full barrier: the slots are published after their flags are read */
+	while (atomic64_cmpxchg((atomic64_t *)&rx_queue->commit, commit, next) != commit);
+}
+
+
+static
+size_t pfq_ring_enqueue_batch(struct pfq_rx_opt *ro,
+			      struct pfq_rx_queue *rx_queue,
+			      size_t ring,
+			      struct pfq_skbuff_batch *skbs,
+			      unsigned long long mask,
+			      int burst_len,
+			      int gid)
+{
+	const size_t capacity = ro->queue_size * 2;
+	const bool spsc = spsc_ring(ro);
+	unsigned long long head;
+	struct sk_buff *skb;
+	size_t n, pos, lap, used, len, sent = 0;
+	char *base;
+
+	len = spsc ? spsc_ring_reserve(rx_queue, capacity, burst_len, &head, &used)
+		   : mpsc_ring_reserve(rx_queue, capacity, burst_len, &head, &used);
+	if (len == 0) {
+		mpsc_wakeup(ro);
 		return 0;
+	}
 
-	data = atomic_add_return(burst_len, (atomic_t *)&rx_queue->data);
+	base = (char *)(ro->base_addr) + ring * pfq_rx_ring_mem(ro);
+	pos  = (size_t)(head % capacity);
+	lap  = (size_t)(head / capacity);
 
-	qlen      = Q_SHARED_QUEUE_LEN(data) - burst_len;
-	qindex    = Q_SHARED_QUEUE_INDEX(data);
-        this_slot = mpsc_slot_ptr(ro, rx_queue, qindex, qlen);
+	mpsc_prefetch_slots(ro, base, capacity, pos, min_t(size_t, len, prefetch_distance), true);
 
 	for_each_skbuff_bitmask(skbs, mask, skb, n)
 	{
 		volatile struct pfq_pkthdr *hdr;
-		size_t bytes, slot_index;
-		char *pkt;
 
-		bytes = min_t(size_t, skb->len, ro->caplen);
-		slot_index = qlen + sent;
+		if (sent == len)
+			break;
 
-		hdr = (struct pfq_pkthdr *)this_slot;
-		pkt = (char *)(hdr+1);
+		if (prefetch_distance && sent + prefetch_distance < len)
+			mpsc_prefetch_slots(ro, base, capacity, pos + prefetch_distance, 1, true);
 
-		if (slot_index > ro->queue_size) {
+		hdr = (struct pfq_pkthdr *)(base + pos * mpsc_hdr_stride(ro));
 
-			if (waitqueue_active(&ro->waitqueue)) {
-#ifdef PFQ_USE_EXTENDED_PROC
- 				sparse_inc(&global_stats.wake);
-#endif
-				wake_up_interruptible(&ro->waitqueue);
-			}
+		/* a reserved slot must be committed anyway, not to stall the reader */
 
-			return sent;
+		if (mpsc_fill_slot(ro, hdr, mpsc_payload_ptr(ro, base, capacity, pos, hdr), skb,
+				   ro->slot_size - sizeof(struct pfq_pkthdr), gid) < 0)
+			hdr->caplen = 0;
+
+		/* commit the slot (release semantic), unless the whole burst is flagged below */
+
+		if (!ro->batch_commit && !spsc) {
+			smp_wmb();
+			hdr->commit = (uint8_t)(lap + 1);
 		}
 
-		/* copy bytes of packet */
+		sent++;
 
-#ifdef PFQ_USE_SKB_LINEARIZE
-		if (unlikely(skb_is_nonlinear(skb)))
-#else
-		if (skb_is_nonlinear(skb))
-#endif
+		if (++pos == capacity) {
+			pos = 0;
+			lap++;
+		}
+	}
+
+	/* batch commit (or single producer): flag the burst after a single barrier, then publish it */
+
+	if (ro->batch_commit || spsc) {
+
+		smp_wmb();
+
+		pos = (size_t)(head % capacity);
+		lap = (size_t)(head / capacity);
+
+		for(n = 0; n < sent; n++)
 		{
-			if (skb_copy_bits(skb, 0, pkt, bytes) != 0) {
-				printk(KERN_WARNING "[PFQ] BUG! skb_copy_bits failed (bytes=%zu, skb_len=%d mac_len=%d)!\n",
-							    bytes, skb->len, skb->mac_len);
-				return 0;
+			((volatile struct pfq_pkthdr *)(base + pos * mpsc_hdr_stride(ro)))->commit = (uint8_t)(lap + 1);
+
+			if (++pos == capacity) {
+				pos = 0;
+				lap++;
 			}
 		}
-		else {
-			pfq_skb_copy_from_linear_data(skb, pkt, bytes);
+
+		if (spsc) {
+			smp_wmb();
+			atomic64_set((atomic64_t *)&rx_queue->data, (long long)(head + sent));
+			if (ro->batch_commit)
+				atomic64_set((atomic64_t *)&rx_queue->commit, (long long)(head + sent));
 		}
+		else
+			mpsc_ring_publish(ro, rx_queue, base, capacity);
+	}
+
+	/* wake up the reader if the ring is full, otherwise apply the wakeup policy */
 
-                /* copy mark from pfq_cb (annotation) */
+	if (len < (size_t)burst_len)
+		mpsc_wakeup(ro);
+	else
+		mpsc_wakeup_policy(ro, used, sent);
 
-                hdr->data = PFQ_CB(skb)->mark;
+	return sent;
+}
 
-		/* setup the header */
 
-		if (ro->tstamp != 0) {
-			struct timespec ts;
-			skb_get_timestampns(skb, &ts);
-			hdr->tstamp.tv.sec  = (uint32_t)ts.tv_sec;
-			hdr->tstamp.tv.nsec = (uint32_t)ts.tv_nsec;
+size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
+		              struct pfq_skbuff_batch *skbs,
+		              unsigned long long mask,
+		              int burst_len,
+		              int cpu,
+		              int gid)
+{
+	struct pfq_rx_queue *rx_queue = pfq_get_rx_queue(ro);
+	unsigned long long data;
+	size_t qlen, qindex, ring;
+	struct sk_buff *skb;
+
+	size_t n, sent = 0;
+	char *this_slot, *region;
+
+	if (unlikely(rx_queue == NULL))
+		return 0;
+
+	/* with multiple rings each cpu produces in its own ring */
+
+	ring = ro->num_rings > 1 ? (size_t)cpu % ro->num_rings : 0;
+	rx_queue += ring;
+
+	if (ro->mode == Q_RX_MODE_CONTINUOUS)
+		return pfq_ring_enqueue_batch(ro, rx_queue, ring, skbs, mask, burst_len, gid);
+
+	if (ro->varlen) {
+
+		/* in varlen mode the reserved slots are taken from the head of the burst */
+
+		burst_len = mpsc_varlen_reserve(ro, rx_queue, skbs, mask, &data);
+		if (burst_len == 0) {
+			mpsc_wakeup(ro);
+			return 0;
 		}
 
-		hdr->if_index    = skb->dev->ifindex & 0xff;
-		hdr->gid         = gid;
+		qlen      = Q_SHARED_QUEUE_LEN(data);
+		qindex    = Q_SHARED_QUEUE_INDEX(data);
+		this_slot = mpsc_slot_ptr(ro, ring, qindex, Q_SHARED_QUEUE_OFF(data));
+	}
+	else {
+		data = atomic64_read((atomic64_t *)&rx_queue->data);
+
+		if (Q_SHARED_QUEUE_LEN(data) > ro->queue_size)
+			return 0;
+
+		data = atomic64_add_return((long long)burst_len << 32, (atomic64_t *)&rx_queue->data);
+
+		qlen      = Q_SHARED_QUEUE_LEN(data) - burst_len;
+		qindex    = Q_SHARED_QUEUE_INDEX(data);
+		this_slot = mpsc_slot_ptr(ro, ring, qindex, qlen * mpsc_hdr_stride(ro));
+	}
+
+	region = mpsc_slot_ptr(ro, ring, qindex, 0);
+
+	if (ro->varlen)
+		prefetchw(this_slot);
+	else
+		mpsc_prefetch_slots(ro, region, ro->queue_size, qlen, min_t(size_t, burst_len, prefetch_distance), false);
+
+	for_each_skbuff_bitmask(skbs, mask, skb, n)
+	{
+		volatile struct pfq_pkthdr *hdr;
+		size_t slot_index = qlen + sent;
+		int bytes;
+
+		hdr = (struct pfq_pkthdr *)this_slot;
+
+		if (sent == burst_len)
+			break;
+
+		if (!ro->varlen && prefetch_distance && sent + prefetch_distance < burst_len)
+			mpsc_prefetch_slots(ro, region, ro->queue_size, slot_index + prefetch_distance, 1, false);
 
-		hdr->len         = (uint16_t)skb->len;
-		hdr->caplen 	 = (uint16_t)bytes;
-		hdr->un.vlan_tci = skb->vlan_tci & ~VLAN_TAG_PRESENT;
-		hdr->hw_queue    = (uint8_t)(skb_get_rx_queue(skb) & 0xff);
+		if (!ro->varlen && slot_index >= ro->queue_size) {
+			mpsc_wakeup(ro);
+			return sent;
+		}
+
+		bytes = mpsc_fill_slot(ro, hdr, mpsc_payload_ptr(ro, region, ro->queue_size, slot_index, hdr), skb,
+				       ro->varlen ? ALIGN(min_t(size_t, skb->len, ro->caplen), 8)
+						  : ro->slot_size - sizeof(struct pfq_pkthdr), gid);
+		if (bytes < 0)
+			return 0;
 
 		/* commit the slot (release semantic) */
 
@@ -154,23 +610,65 @@ size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 
 		hdr->commit = (uint8_t)qindex;
 
-		if ((slot_index & 8191) == 0 &&
-				waitqueue_active(&ro->waitqueue)) {
-#ifdef PFQ_USE_EXTENDED_PROC
- 			sparse_inc(&global_stats.wake);
-#endif
-		        wake_up_interruptible(&ro->waitqueue);
-		}
-
 		sent++;
 
-		this_slot += ro->slot_size;
+		this_slot += ro->varlen ? Q_MPDB_QUEUE_SLOT_SIZE(bytes) : mpsc_hdr_stride(ro);
 	}
 
+	mpsc_wakeup_policy(ro, qlen, sent);
 	return sent;
 }
 
 
+/*
+ * Node of the device bound to the socket: the first Tx binding, or else
+ * the first device bound to one of the groups joined by the socket.
+ */
+
+static int
+pfq_bound_device_node(struct pfq_sock *so)
+{
+	unsigned long groups = pfq_get_groups(so->id);
+	struct net_device *dev;
+	int n, node = NUMA_NO_NODE;
+
+	rcu_read_lock();
+
+	for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+	{
+		int if_index = so->tx_opt.queue[n].if_index;
+		if (if_index != -1 && (dev = dev_get_by_index_rcu(sock_net(&so->sk), if_index))) {
+			node = dev_to_node(&dev->dev);
+			goto done;
+		}
+	}
+
+	for_each_netdev_rcu(sock_net(&so->sk), dev)
+	{
+		for(n = 0; n < Q_MAX_HW_QUEUE; n++)
+		{
+			if (__pfq_devmap_get_groups(dev->ifindex, n) & groups) {
+				node = dev_to_node(&dev->dev);
+				goto done;
+			}
+		}
+	}
+done:
+	rcu_read_unlock();
+	return node;
+}
+
+
+static int
+pfq_shared_memory_node(struct pfq_sock *so)
+{
+	if (so->shmem_node == Q_NODE_DEVICE)
+		return pfq_bound_device_node(so);
+
+	return so->shmem_node == Q_NODE_ANY ? NUMA_NO_NODE : so->shmem_node;
+}
+
+
 int
 pfq_shared_queue_enable(struct pfq_sock *so, unsigned long user_addr)
 {
@@ -181,12 +679,24 @@ pfq_shared_queue_enable(struct pfq_sock *so, unsigned long user_addr)
 
 		/* alloc queue memory */
 
+		int node = pfq_shared_memory_node(so);
+
 		if (user_addr) {
-			if (pfq_hugepage_map(&so->shmem, user_addr, pfq_shared_memory_size(so)) < 0)
+			if (so->shmem_hugepages == Q_HUGEPAGES_REQUIRE) {
+				printk(KERN_INFO "[PFQ|%d] kernel hugepages required: user memory not allowed!\n", so->id);
+				return -EINVAL;
+			}
+			if (pfq_hugepage_map(&so->shmem, user_addr, pfq_shared_memory_size(so), node) < 0)
 				return -ENOMEM;
 		}
+		else if (so->shmem_hugepages != Q_HUGEPAGES_OFF &&
+			 pfq_hugepage_alloc(&so->shmem, pfq_shared_memory_size(so), node) == 0) {
+			/* kernel hugepages */
+		}
 		else {
-			if (pfq_shared_memory_alloc(&so->shmem, pfq_shared_memory_size(so)) < 0)
+			if (so->shmem_hugepages == Q_HUGEPAGES_REQUIRE)
+				return -ENOMEM;
+			if (pfq_shared_memory_alloc(&so->shmem, pfq_shared_memory_size(so), node) < 0)
 				return -ENOMEM;
 		}
 
@@ -196,50 +706,61 @@ pfq_shared_queue_enable(struct pfq_sock *so, unsigned long user_addr)
 
 		queue = (struct pfq_shared_queue *)so->shmem.addr;
 
-		/* initialize rx queue header */
+		/* initialize rx rings headers */
 
-		queue->rx.data      = (1L << 24);
-		queue->rx.size      = so->rx_opt.queue_size;
-		queue->rx.slot_size = so->rx_opt.slot_size;
+		for(n = 0; n < so->rx_opt.num_rings; n++)
+		{
+			queue->rx[n].data      = so->rx_opt.mode == Q_RX_MODE_CONTINUOUS ? 0 : Q_SHARED_QUEUE_DATA(1, 0, 0);
+			queue->rx[n].cons      = 0;
+			queue->rx[n].commit    = 0;
+			queue->rx[n].size      = so->rx_opt.queue_size;
+			queue->rx[n].slot_size = so->rx_opt.slot_size;
+			queue->rx[n].varlen    = so->rx_opt.varlen;
+			queue->rx[n].mode      = so->rx_opt.mode;
+			queue->rx[n].layout    = so->rx_opt.layout;
+		}
 
 		for(n = 0; n < Q_MAX_TX_QUEUES; n++)
 		{
 			queue->tx[n].prod      = 0;
 			queue->tx[n].cons      = 0;
-			queue->tx[n].size      = pfq_queue_spsc_mem(so)/2;
+			queue->tx[n].size      = n < so->tx_opt.num_reserved ? pfq_queue_spsc_mem(so)/2 : 0;
                         queue->tx[n].ptr       = NULL;
                         queue->tx[n].index     = -1;
 
-			so->tx_opt.queue[n].base_addr = so->shmem.addr + sizeof(struct pfq_shared_queue)
-							+ pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * n;
+			so->tx_opt.queue[n].base_addr = n < so->tx_opt.num_reserved ?
+							so->shmem.addr + Q_SHARED_QUEUE_HDR_SIZE(so->rx_opt.num_rings)
+							+ pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * n : NULL;
 		}
 
 		/* update the queues base_addr */
 
-		so->rx_opt.base_addr = so->shmem.addr + sizeof(struct pfq_shared_queue);
+		so->rx_opt.base_addr = so->shmem.addr + Q_SHARED_QUEUE_HDR_SIZE(so->rx_opt.num_rings);
 
 		/* commit both the queues */
 
 		smp_wmb();
 
-		atomic_long_set(&so->rx_opt.queue_hdr, (long)&queue->rx);
+		atomic_long_set(&so->rx_opt.queue_hdr, (long)&queue->rx[0]);
 
-		for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+		for(n = 0; n < so->tx_opt.num_reserved; n++)
 		{
 			atomic_long_set(&so->tx_opt.queue[n].queue_hdr, (long)&queue->tx[n]);
 		}
 
-		pr_devel("[PFQ|%d] Rx queue: len=%zu slot_size=%zu caplen=%zu, mem=%zu bytes\n", so->id,
+		pr_devel("[PFQ|%d] Rx queue: len=%zu slot_size=%zu%s caplen=%zu, mem=%zu bytes (%zu rings)\n", so->id,
 				so->rx_opt.queue_size,
 				so->rx_opt.slot_size,
+				so->rx_opt.varlen ? " (varlen)" : "",
 				so->rx_opt.caplen,
-				pfq_queue_mpsc_mem(so));
+				pfq_queue_mpsc_mem(so),
+				so->rx_opt.num_rings);
 
-		pr_devel("[PFQ|%d] Tx queue: len=%zu slot_size=%zu maxlen=%d, mem=%zu bytes (%d queues)\n", so->id,
+		pr_devel("[PFQ|%d] Tx queue: len=%zu slot_size=%zu maxlen=%d, mem=%zu bytes (%zu queues)\n", so->id,
 				so->tx_opt.queue_size,
 				so->tx_opt.slot_size,
 				max_len,
-				pfq_queue_spsc_mem(so) * Q_MAX_TX_QUEUES, Q_MAX_TX_QUEUES);
+				pfq_queue_spsc_mem(so) * so->tx_opt.num_reserved, so->tx_opt.num_reserved);
 	}
 
 	return 0;
@@ -260,7 +781,16 @@ pfq_shared_queue_disable(struct pfq_sock *so)
 			atomic_long_set(&so->tx_opt.queue[n].queue_hdr, 0);
 		}
 
-		msleep(Q_GRACE_PERIOD);
+		/* wait for the Rx path (RCU readers); Tx threads are already stopped */
+
+		synchronize_rcu();
+
+		/* the zero-copy Tx skbs refer to the pages (and to this socket) */
+
+		pfq_tx_zcopy_drain(&so->tx_opt);
+
+		hrtimer_cancel(&so->rx_opt.wakeup_timer);
+		clear_bit(0, &so->rx_opt.wakeup_timer_armed);
 
 		pfq_shared_memory_free(&so->shmem);
 
@@ -41,12 +41,18 @@ extern size_t pfq_mpsc_enqueue_batch(struct pfq_rx_opt *ro,
 		                     struct pfq_skbuff_batch *skbs,
 		                     unsigned long long skbs_mask,
 		                     int burst_len,
+		                     int cpu,
 		                     int gid);
 
 
+static inline size_t pfq_rx_ring_mem(struct pfq_rx_opt *ro)
+{
+        return ro->queue_size * ro->slot_size * 2;
+}
+
 static inline size_t pfq_queue_mpsc_mem(struct pfq_sock *so)
 {
-        return so->rx_opt.queue_size * so->rx_opt.slot_size * 2;
+        return pfq_rx_ring_mem(&so->rx_opt) * so->rx_opt.num_rings;
 }
 
 static inline size_t pfq_queue_spsc_mem(struct pfq_sock *so)
@@ -59,9 +65,13 @@ static inline
 size_t pfq_mpsc_queue_len(struct pfq_sock *p)
 {
 	struct pfq_shared_queue *q = pfq_get_shared_queue(p);
+	size_t n, len = 0;
 	if (!q)
 		return 0;
-        return Q_SHARED_QUEUE_LEN(q->rx.data);
+	for(n = 0; n < p->rx_opt.num_rings; n++)
+		len += p->rx_opt.mode == Q_RX_MODE_CONTINUOUS ? (size_t)((p->rx_opt.batch_commit ? q->rx[n].commit : q->rx[n].data) - q->rx[n].cons)
+							      : Q_SHARED_QUEUE_LEN(q->rx[n].data);
+        return len;
 }
 
 
@@ -71,7 +81,7 @@ int pfq_mpsc_queue_index(struct pfq_sock *p)
 	struct pfq_shared_queue *q = pfq_get_shared_queue(p);
 	if (!q)
 		return 0;
-        return Q_SHARED_QUEUE_INDEX(q->rx.data) & 1;
+        return Q_SHARED_QUEUE_INDEX(q->rx[0].data) & 1;
 }
 
 
@@ -31,22 +31,44 @@
 #include <pf_q-shared-queue.h>
 
 
+#define HUGEPAGE_SIZE  (2*1024*1024)
+#define HUGEPAGE_ORDER (get_order(HUGEPAGE_SIZE))
+
+
 static int
-pfq_memory_map(struct vm_area_struct *vma, unsigned long size, char *ptr, unsigned int flags, enum pfq_shmem_kind kind)
+pfq_memory_map(struct vm_area_struct *vma, unsigned long size, struct pfq_shmem_descr *shmem, unsigned int flags)
 {
 	// unsigned long addr = vma->vm_start;
 
         vma->vm_flags |= flags;
 
-	switch(kind)
+	switch(shmem->kind)
 	{
 	case pfq_shmem_virt: {
-		if (remap_vmalloc_range(vma, ptr, 0) != 0) {
+		if (remap_vmalloc_range(vma, shmem->addr, 0) != 0) {
 			printk(KERN_WARNING "[PFQ] remap_vmalloc_range error.\n");
 			return -EAGAIN;
 		}
 	} break;
 
+	case pfq_shmem_huge: {
+
+		/* each hugepage is physically contiguous: one pfn range per page */
+
+		unsigned long off;
+
+		for(off = 0; off < size; off += HUGEPAGE_SIZE)
+		{
+			struct page *page = shmem->hugepages[off >> PAGE_SHIFT];
+
+			if (remap_pfn_range(vma, vma->vm_start + off, page_to_pfn(page),
+					    min_t(unsigned long, HUGEPAGE_SIZE, size - off), vma->vm_page_prot) != 0) {
+				printk(KERN_WARNING "[PFQ] remap_pfn_range error.\n");
+				return -EAGAIN;
+			}
+		}
+	} break;
+
 	//case pfq_shmem_phys: {
 	//	if (remap_pfn_range(vma, addr, virt_to_phys(ptr) >> PAGE_SHIFT, vma->vm_end - vma->vm_start, PAGE_SHARED) != 0) {
 	//		printk(KERN_WARNING "[PFQ] remap_vmalloc_range error.\n");
@@ -79,7 +101,7 @@ pfq_mmap(struct file *file, struct socket *sock, struct vm_area_struct *vma)
                 return -EINVAL;
         }
 
-        if((ret = pfq_memory_map(vma, size, so->shmem.addr, VM_LOCKED, so->shmem.kind)) < 0)
+        if((ret = pfq_memory_map(vma, size, &so->shmem, VM_LOCKED)) < 0)
                 return ret;
 
         return 0;
@@ -87,7 +109,7 @@ pfq_mmap(struct file *file, struct socket *sock, struct vm_area_struct *vma)
 
 
 int
-pfq_hugepage_map(struct pfq_shmem_descr *shmem, unsigned long addr, size_t size)
+pfq_hugepage_map(struct pfq_shmem_descr *shmem, unsigned long addr, size_t size, int node)
 {
 	int nid;
 
@@ -106,8 +128,13 @@ pfq_hugepage_map(struct pfq_shmem_descr *shmem, unsigned long addr, size_t size)
 		return -EPERM;
 	}
 
+	/* user pages are already in place: the node is where the first one landed */
+
 	nid = page_to_nid(shmem->hugepages[0]);
 
+	if (node != NUMA_NO_NODE && node != nid)
+		printk(KERN_WARNING "[PFQ] user memory on node %d (requested node %d)!\n", nid, node);
+
 	shmem->addr = vm_map_ram(shmem->hugepages, shmem->npages, nid, PAGE_KERNEL);
 	if (!shmem->addr) {
 		printk(KERN_INFO "[PFQ] mapping memory failure.\n");
@@ -116,6 +143,7 @@ pfq_hugepage_map(struct pfq_shmem_descr *shmem, unsigned long addr, size_t size)
 
 	shmem->kind = pfq_shmem_user;
         shmem->size = size;
+        shmem->node = nid;
 
 	pr_devel("[PFQ] total mapped memory: %zu bytes.\n", size);
 	return 0;
@@ -153,18 +181,107 @@ pfq_hugepage_unmap(struct pfq_shmem_descr *shmem)
 
 
 int
-pfq_shared_memory_alloc(struct pfq_shmem_descr *shmem, size_t mem_size)
+pfq_hugepage_alloc(struct pfq_shmem_descr *shmem, size_t size, int node)
+{
+	size_t n, nhuge = size / HUGEPAGE_SIZE, per_huge = HUGEPAGE_SIZE / PAGE_SIZE;
+
+	pr_devel("[PFQ] allocating kernel hugepages (node %d)...\n", node);
+
+	shmem->npages = nhuge * per_huge;
+	shmem->hugepages = vmalloc(shmem->npages * sizeof(struct page *));
+	if (!shmem->hugepages)
+		return -ENOMEM;
+
+	for(n = 0; n < nhuge; n++)
+	{
+		struct page *page = alloc_pages_node(node == NUMA_NO_NODE ? numa_node_id() : node,
+						     GFP_KERNEL | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+						     HUGEPAGE_ORDER);
+		size_t i;
+
+		if (!page) {
+			printk(KERN_INFO "[PFQ] could not allocate hugepage %zu/%zu!\n", n, nhuge);
+			goto err;
+		}
+
+		for(i = 0; i < per_huge; i++)
+			shmem->hugepages[n * per_huge + i] = page + i;
+	}
+
+	shmem->addr = vmap(shmem->hugepages, shmem->npages, VM_MAP, PAGE_KERNEL);
+	if (!shmem->addr) {
+		printk(KERN_INFO "[PFQ] mapping memory failure.\n");
+		goto err;
+	}
+
+	shmem->kind = pfq_shmem_huge;
+	shmem->size = size;
+	shmem->node = page_to_nid(shmem->hugepages[0]);
+
+	pr_devel("[PFQ] total hugepage memory: %zu bytes (%zu hugepages).\n", size, nhuge);
+	return 0;
+err:
+	while (n-- > 0)
+		__free_pages(shmem->hugepages[n * per_huge], HUGEPAGE_ORDER);
+
+	vfree(shmem->hugepages);
+	shmem->hugepages = NULL;
+	shmem->npages = 0;
+	return -ENOMEM;
+}
+
+
+void
+pfq_hugepage_free(struct pfq_shmem_descr *shmem)
+{
+	size_t n, per_huge = HUGEPAGE_SIZE / PAGE_SIZE;
+
+	vunmap(shmem->addr);
+
+	for(n = 0; n < shmem->npages; n += per_huge)
+		__free_pages(shmem->hugepages[n], HUGEPAGE_ORDER);
+
+	vfree(shmem->hugepages);
+
+	shmem->hugepages = NULL;
+	shmem->npages = 0;
+}
+
+
+static void *
+pfq_vmalloc_user_node(size_t size, int node)
+{
+	struct vm_struct *area;
+	void *ret;
+
+	if (node == NUMA_NO_NODE)
+		return vmalloc_user(size);
+
+	/* as vmalloc_user, on the given node */
+
+	ret = vzalloc_node(size, node);
+	if (ret) {
+		area = find_vm_area(ret);
+		area->flags |= VM_USERMAP;
+	}
+	return ret;
+}
+
+
+int
+pfq_shared_memory_alloc(struct pfq_shmem_descr *shmem, size_t mem_size, int node)
 {
 	size_t tot_mem = PAGE_ALIGN(mem_size);
 
-	pr_devel("[PFQ] allocating shared memory...\n");
+	pr_devel("[PFQ] allocating shared memory (node %d)...\n", node);
 
-        shmem->addr = vmalloc_user(tot_mem);
+        shmem->addr = pfq_vmalloc_user_node(tot_mem, node);
         shmem->size = tot_mem;
 	shmem->kind = pfq_shmem_virt;
+	shmem->node = node;
 
 	if (shmem->addr == NULL) {
-		printk(KERN_WARNING "[PFQ] shared memory alloc: out of memory (vmalloc %zu bytes)!", tot_mem);
+		printk(KERN_WARNING "[PFQ] shared memory alloc: out of memory (vmalloc %zu bytes, node %d)!", tot_mem, node);
 		return -ENOMEM;
 	}
 
@@ -182,10 +299,12 @@ pfq_shared_memory_free(struct pfq_shmem_descr *shmem)
 		{
 		case pfq_shmem_virt: vfree(shmem->addr); break;
 		case pfq_shmem_user: pfq_hugepage_unmap(shmem); break;
+		case pfq_shmem_huge: pfq_hugepage_free(shmem); break;
 		}
 
 		shmem->addr = NULL;
 		shmem->size = 0;
+		shmem->node = NUMA_NO_NODE;
 
 		pr_devel("[PFQ] shared memory freed.\n");
 	}
@@ -194,13 +313,11 @@ pfq_shared_memory_free(struct pfq_shmem_descr *shmem)
 
 size_t pfq_total_queue_mem(struct pfq_sock *so)
 {
-        return sizeof(struct pfq_shared_queue) + pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * Q_MAX_TX_QUEUES;
+        return Q_SHARED_QUEUE_HDR_SIZE(so->rx_opt.num_rings) + pfq_queue_mpsc_mem(so) + pfq_queue_spsc_mem(so) * so->tx_opt.num_reserved;
 }
 
 
 
-#define HUGEPAGE_SIZE  (2*1024*1024)
-
 size_t pfq_shared_memory_size(struct pfq_sock *so)
 {
 	size_t tot_mem = pfq_total_queue_mem(so);
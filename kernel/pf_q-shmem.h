@@ -31,7 +31,8 @@ struct pfq_sock;
 
 enum pfq_shmem_kind {
 	pfq_shmem_virt,
-	pfq_shmem_user
+	pfq_shmem_user,
+	pfq_shmem_huge          /* hugepages allocated by the kernel */
 };
 
 
@@ -43,6 +44,8 @@ struct pfq_shmem_descr
 
 	struct page** 		hugepages;
 	size_t 			npages;
+
+	int 			node;   /* NUMA node of the memory, or NUMA_NO_NODE */
 };
 
 
@@ -51,12 +54,15 @@ size_t pfq_total_queue_mem(struct pfq_sock *so);
 
 int pfq_mmap(struct file *file, struct socket *sock, struct vm_area_struct *vma);
 
-int pfq_shared_memory_alloc(struct pfq_shmem_descr *shmem, size_t size);
+int pfq_shared_memory_alloc(struct pfq_shmem_descr *shmem, size_t size, int node);
 void pfq_shared_memory_free(struct pfq_shmem_descr *shmem);
 size_t pfq_shared_memory_size(struct pfq_sock *so);
 
-int pfq_hugepage_map(struct pfq_shmem_descr *shmem, unsigned long addr, size_t size);
+int pfq_hugepage_map(struct pfq_shmem_descr *shmem, unsigned long addr, size_t size, int node);
 int pfq_hugepage_unmap(struct pfq_shmem_descr *shmem);
 
+int pfq_hugepage_alloc(struct pfq_shmem_descr *shmem, size_t size, int node);
+void pfq_hugepage_free(struct pfq_shmem_descr *shmem);
+
 
 #endif /* PF_Q_SHMEM_H */
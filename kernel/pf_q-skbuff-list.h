@@ -25,6 +25,8 @@
 #define PF_Q_SKBUFF_LIST_H
 
 #include <linux/skbuff.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
 
 
 #define PFQ_SK_BUFF_LIST_SIZE 16384
@@ -119,5 +121,99 @@ struct sk_buff *pfq_sk_buff_peek_tail(struct pfq_sk_buff_list *list)
 }
 
 
+/*
+ * Tx cache of a device: skbs are parked right after the transmission, while
+ * the driver may still hold them, and reused in order once released.
+ */
+
+struct pfq_sk_buff_cache
+{
+	struct sk_buff ** node;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+
+	int ifindex;		/* device of the cache, 0 if unused */
+	unsigned int size;	/* data size of the skbs */
+};
+
+
+static inline
+int pfq_sk_buff_cache_init(struct pfq_sk_buff_cache *cache, size_t len)
+{
+	len = roundup_pow_of_two(max_t(size_t, len, 1));
+
+	cache->node = kzalloc(sizeof(struct sk_buff *) * len, GFP_KERNEL);
+	if (cache->node == NULL) {
+		printk(KERN_INFO "[PFQ] pfq_sk_buff_cache_init: out of memory!\n");
+		return -ENOMEM;
+	}
+
+	cache->mask = len - 1;
+	cache->head = 0;
+	cache->tail = 0;
+	cache->ifindex = 0;
+	cache->size = 0;
+	return 0;
+}
+
+
+static inline
+size_t pfq_sk_buff_cache_len(struct pfq_sk_buff_cache *cache)
+{
+	return cache->head - cache->tail;
+}
+
+
+static inline
+int pfq_sk_buff_cache_purge(struct pfq_sk_buff_cache *cache)
+{
+	int n = 0;
+
+	for(; cache->tail != cache->head; n++)
+	{
+		kfree_skb(cache->node[cache->tail++ & cache->mask]);
+	}
+
+	cache->ifindex = 0;
+	cache->size = 0;
+	return n;
+}
+
+
+static inline
+void pfq_sk_buff_cache_free(struct pfq_sk_buff_cache *cache)
+{
+	if (cache->node) {
+		pfq_sk_buff_cache_purge(cache);
+		kfree(cache->node);
+		cache->node = NULL;
+	}
+}
+
+
+static inline
+bool pfq_sk_buff_cache_park(struct pfq_sk_buff_cache *cache, struct sk_buff *skb)
+{
+	if (pfq_sk_buff_cache_len(cache) > cache->mask)
+		return false;
+	cache->node[cache->head++ & cache->mask] = skb;
+	return true;
+}
+
+
+static inline
+struct sk_buff *pfq_sk_buff_cache_peek(struct pfq_sk_buff_cache *cache)
+{
+	return cache->tail != cache->head ? cache->node[cache->tail & cache->mask] : NULL;
+}
+
+
+static inline
+struct sk_buff *pfq_sk_buff_cache_dequeue(struct pfq_sk_buff_cache *cache)
+{
+	return cache->node[cache->tail++ & cache->mask];
+}
+
 
 #endif /* PF_Q_SKBUFF_LIST_H */
@@ -28,14 +28,35 @@
 #include <linux/types.h>
 
 #include <pf_q-sock.h>
+#include <pf_q-global.h>
 
 
 /* vector of pointers to pfq_sock */
 
 static atomic_t      pfq_sock_count;
+static atomic_t      pfq_sock_tstamp_count;     /* sockets with software timestamps */
+static atomic_t      pfq_sock_tstamp_batch_count;
 
 atomic_long_t pfq_sock_vector[Q_MAX_ID];
 
+atomic_t      pfq_sock_mask_words = ATOMIC_INIT(1);
+
+
+/* latency timer: wake up the reader when the watermark is not reached in time */
+
+enum hrtimer_restart
+pfq_rx_wakeup_timer(struct hrtimer *timer)
+{
+        struct pfq_rx_opt *ro = container_of(timer, struct pfq_rx_opt, wakeup_timer);
+
+        clear_bit(0, &ro->wakeup_timer_armed);
+
+        if (waitqueue_active(&ro->waitqueue))
+                wake_up_interruptible(&ro->waitqueue);
+
+        return HRTIMER_NORESTART;
+}
+
 
 int pfq_get_free_id(struct pfq_sock * so)
 {
@@ -43,6 +64,14 @@ int pfq_get_free_id(struct pfq_sock * so)
         for(; n < Q_MAX_ID; n++)
         {
                 if (!atomic_long_cmpxchg(pfq_sock_vector + n, 0, (long)so)) {
+                        int words = n / BITS_PER_LONG + 1, old;
+
+                        /* raise the words of the socket masks in use (never lowered) */
+
+                        while ((old = atomic_read(&pfq_sock_mask_words)) < words &&
+                               atomic_cmpxchg(&pfq_sock_mask_words, old, words) != old)
+                                ;
+
                         atomic_inc(&pfq_sock_count);
                         return n;
                 }
@@ -56,6 +85,58 @@ int pfq_get_sock_count(void)
 }
 
 
+static atomic_t *
+pfq_sock_tstamp_counter(int tstamp)
+{
+        switch(tstamp)
+        {
+        case Q_TSTAMP_SOFTWARE: return &pfq_sock_tstamp_count;
+        case Q_TSTAMP_BATCH:    return &pfq_sock_tstamp_batch_count;
+        }
+        return NULL;
+}
+
+
+void pfq_sock_tstamp_update(int old_tstamp, int new_tstamp)
+{
+        atomic_t *old_count = pfq_sock_tstamp_counter(old_tstamp);
+        atomic_t *new_count = pfq_sock_tstamp_counter(new_tstamp);
+
+        if (old_count == new_count)
+                return;
+        if (old_count)
+                atomic_dec(old_count);
+        if (new_count)
+                atomic_inc(new_count);
+}
+
+
+int pfq_get_sock_tstamp_count(void)
+{
+        return atomic_read(&pfq_sock_tstamp_count);
+}
+
+
+int pfq_get_sock_tstamp_batch_count(void)
+{
+        return atomic_read(&pfq_sock_tstamp_batch_count);
+}
+
+
+/*
+ * Worst-case error of the timestamps of a socket (usec): batch stamps are
+ * taken when the batch is processed, at most flush_timeout after the first
+ * packet is held (plus the latency of the flush softirq).
+ */
+
+int pfq_sock_tstamp_error(struct pfq_sock const *so)
+{
+        if (so->rx_opt.tstamp != Q_TSTAMP_BATCH || batch_len <= 1)
+                return 0;
+        return flush_timeout;
+}
+
+
 struct pfq_sock *
 pfq_get_sock_by_id(int id)
 {
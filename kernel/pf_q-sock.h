@@ -25,7 +25,10 @@
 #define PF_Q_SOCK_H
 
 #include <linux/kernel.h>
+#include <linux/version.h>
 #include <linux/poll.h>
+#include <linux/skbuff.h>
+#include <linux/hrtimer.h>
 #include <linux/pf_q.h>
 
 #include <net/sock.h>
@@ -37,6 +40,8 @@
 
 extern atomic_long_t pfq_sock_vector[Q_MAX_ID];
 
+extern enum hrtimer_restart pfq_rx_wakeup_timer(struct hrtimer *timer);
+
 
 struct pfq_rx_opt
 {
@@ -44,11 +49,23 @@ struct pfq_rx_opt
 	void 		       *base_addr;
 
 	int    			tstamp;
+	int 			varlen;
+	int 			mode;
+	int 			batch_commit;
+	int 			layout;
 
 	size_t 			caplen;
 
 	size_t 			queue_size;
 	size_t 			slot_size;
+	size_t 			num_rings;
+
+	size_t 			wakeup_watermark;
+	unsigned int 		wakeup_timeout;
+	int 			wakeup_busy_poll;
+
+	unsigned long 		wakeup_timer_armed;
+	struct hrtimer 		wakeup_timer;
 
 	wait_queue_head_t 	waitqueue;
 
@@ -57,6 +74,8 @@ struct pfq_rx_opt
 } ____cacheline_aligned_in_smp;
 
 
+/* return the header of the first Rx ring; ring n is at pfq_get_rx_queue(ro) + n */
+
 static inline
 struct pfq_rx_queue *
 pfq_get_rx_queue(struct pfq_rx_opt *that)
@@ -77,12 +96,29 @@ void pfq_rx_opt_init(struct pfq_rx_opt *that, size_t caplen)
         /* disable tiemstamping by default */
         that->tstamp = false;
 
+        /* fixed-size slots by default */
+        that->varlen = Q_SLOTS_FIXED;
+        that->mode = Q_RX_MODE_DOUBLE_BUFFER;
+        that->batch_commit = false;
+        that->layout = Q_RX_LAYOUT_INLINE;
+
         /* set q_slots and q_caplen default values */
 
         that->caplen = caplen;
 
         that->queue_size = 0;
         that->slot_size = 0;
+        that->num_rings = 1;
+
+        /* wake up the reader on the first packet, no latency timer */
+
+        that->wakeup_watermark = Q_WAKEUP_WATERMARK_DEFAULT;
+        that->wakeup_timeout = Q_WAKEUP_TIMEOUT_OFF;
+        that->wakeup_busy_poll = false;
+
+        that->wakeup_timer_armed = 0;
+        hrtimer_init(&that->wakeup_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        that->wakeup_timer.function = pfq_rx_wakeup_timer;
 
         /* initialize waitqueue */
 
@@ -96,6 +132,31 @@ void pfq_rx_opt_init(struct pfq_rx_opt *that, size_t caplen)
 }
 
 
+/* token-bucket shaper, as a GCRA: tat is the theoretical arrival time (nsec) */
+
+struct pfq_tx_shaper
+{
+	/* rate set by Q_SO_SET_TX_RATE, applied by the Tx path at the start of a flush */
+
+	spinlock_t		lock;
+	uint64_t		rate_pps;
+	uint64_t		rate_bps;
+	unsigned int		rate_burst;
+	int			update;
+
+	/* owned by the Tx path */
+
+	uint64_t		pps;
+	uint64_t		bps;
+	uint64_t		pkt_ns;		/* cost of a packet at pps */
+	uint64_t		pkt_tol;	/* burst tolerance at pps */
+	uint64_t		byte_tol;	/* burst tolerance at bps (max_len frames) */
+	uint64_t		tat_pps;
+	uint64_t		tat_bps;
+	unsigned int		burst;
+};
+
+
 struct pfq_tx_queue_info
 {
 	atomic_long_t 		queue_hdr;
@@ -106,16 +167,34 @@ struct pfq_tx_queue_info
 	int 			cpu;
 
 	struct task_struct     *task;
+
+	struct pfq_tx_shaper	shaper;
+
+	/* zero-copy skbs in flight, for each half of the double buffer
+	 * (on kernels >= 4.14 they are the references held on the ubuf_info) */
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0))
+	atomic_t 		zcopy_pending[2];
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+	struct ubuf_info 	zcopy_ubuf[2];
+#endif
 };
 
 
+extern void pfq_tx_zcopy_init(struct pfq_tx_queue_info *txi);
+
+
 struct pfq_tx_opt
 {
 	uint64_t 		counter;
 
+	int 			zerocopy;
+
 	size_t  		queue_size;
 	size_t  		slot_size;
         size_t 	       	 	num_queues;
+        size_t 	       	 	num_reserved;   /* queues with shared memory (bound before enable) */
 
 	struct pfq_tx_queue_info queue[Q_MAX_TX_QUEUES];
 
@@ -139,10 +218,12 @@ void pfq_tx_opt_init(struct pfq_tx_opt *that, size_t maxlen)
         int n;
 
         that->counter = 0;
+        that->zerocopy = false;
 
         that->queue_size = 0;
         that->slot_size  = Q_SPSC_QUEUE_SLOT_SIZE(maxlen);
 	that->num_queues = 0;
+	that->num_reserved = 0;
 
 	for(n = 0; n < Q_MAX_TX_QUEUES; ++n)
 	{
@@ -153,6 +234,11 @@ void pfq_tx_opt_init(struct pfq_tx_opt *that, size_t maxlen)
 		that->queue[n].hw_queue  = -1;
 		that->queue[n].cpu       = -1;
 		that->queue[n].task 	 = NULL;
+
+		memset(&that->queue[n].shaper, 0, sizeof(struct pfq_tx_shaper));
+		spin_lock_init(&that->queue[n].shaper.lock);
+
+		pfq_tx_zcopy_init(&that->queue[n]);
        	}
 
         sparse_set(&that->stats.sent, 0);
@@ -171,6 +257,8 @@ struct pfq_sock
         int 		    	egress_queue;
 
 	struct pfq_shmem_descr  shmem;
+	int 			shmem_node;     /* requested node: Q_NODE_ANY, Q_NODE_DEVICE or a node id */
+	int 			shmem_hugepages;/* Q_HUGEPAGES_AUTO, Q_HUGEPAGES_OFF or Q_HUGEPAGES_REQUIRE */
 
         struct pfq_rx_opt   	rx_opt;
         struct pfq_tx_opt   	tx_opt;
@@ -194,6 +282,10 @@ pfq_sk(struct sock *sk)
 
 
 int    pfq_get_sock_count(void);
+void   pfq_sock_tstamp_update(int old_tstamp, int new_tstamp);
+int    pfq_get_sock_tstamp_count(void);
+int    pfq_get_sock_tstamp_batch_count(void);
+int    pfq_sock_tstamp_error(struct pfq_sock const *so);
 int    pfq_get_free_id(struct pfq_sock * so);
 struct pfq_sock * pfq_get_sock_by_id(int id);
 void   pfq_release_sock_id(int id);
@@ -0,0 +1,183 @@
+/***************************************************************
+ *
+ * (C) 2011-14 Nicola Bonelli <nicola@pfq.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#ifndef PF_Q_SOCKMASK_H
+#define PF_Q_SOCKMASK_H
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/string.h>
+#include <asm/atomic.h>
+
+#include <pf_q-macro.h>
+#include <pf_q-bitops.h>
+
+/* set of socket ids, Q_MAX_ID bits wide */
+
+#define Q_SOCK_MASK_WORDS 	Q_BITMAP_WORDS(Q_MAX_ID)
+
+typedef struct
+{
+	unsigned long word[Q_SOCK_MASK_WORDS];
+
+} pfq_sock_mask_t;
+
+
+typedef struct
+{
+	atomic_long_t word[Q_SOCK_MASK_WORDS];
+
+} pfq_atomic_sock_mask_t;
+
+
+/*
+ * Words of the masks in use: the high-water mark of the socket ids (see
+ * pfq_get_free_id). It never decreases, hence a bit is always set in a word
+ * below the current value, and the words above it are zero.
+ */
+
+extern atomic_t pfq_sock_mask_words;
+
+static inline
+size_t pfq_sock_mask_nwords(void)
+{
+	return (size_t)atomic_read(&pfq_sock_mask_words);
+}
+
+
+#define pfq_sock_mask_foreach(m, id, ...) \
+	pfq_bitmap_foreach((m)->word, pfq_sock_mask_nwords(), id, __VA_ARGS__)
+
+
+/* zero the whole mask: the words in use may grow before it is read */
+
+static inline
+void pfq_sock_mask_zero(pfq_sock_mask_t *m)
+{
+	size_t n;
+	for(n = 0; n < Q_SOCK_MASK_WORDS; n++)
+		m->word[n] = 0;
+}
+
+
+static inline
+bool pfq_sock_mask_empty(pfq_sock_mask_t const *m)
+{
+	size_t n, words = pfq_sock_mask_nwords();
+
+	if (likely(words == 1))
+		return m->word[0] == 0;
+
+	for(n = 0; n < words; n++)
+		if (m->word[n])
+			return false;
+	return true;
+}
+
+
+static inline
+bool pfq_sock_mask_equal(pfq_sock_mask_t const *a, pfq_sock_mask_t const *b)
+{
+	size_t n, words = pfq_sock_mask_nwords();
+
+	if (likely(words == 1))
+		return a->word[0] == b->word[0];
+
+	for(n = 0; n < words; n++)
+		if (a->word[n] != b->word[n])
+			return false;
+	return true;
+}
+
+
+static inline
+void pfq_sock_mask_set(pfq_sock_mask_t *m, int id)
+{
+	m->word[id / BITS_PER_LONG] |= 1UL << (id % BITS_PER_LONG);
+}
+
+
+static inline
+bool pfq_sock_mask_test(pfq_sock_mask_t const *m, int id)
+{
+	return m->word[id / BITS_PER_LONG] & (1UL << (id % BITS_PER_LONG));
+}
+
+
+static inline
+void pfq_sock_mask_or(pfq_sock_mask_t *dst, pfq_sock_mask_t const *src)
+{
+	size_t n, words = pfq_sock_mask_nwords();
+
+	if (likely(words == 1)) {
+		dst->word[0] |= src->word[0];
+		return;
+	}
+
+	for(n = 0; n < words; n++)
+		dst->word[n] |= src->word[n];
+}
+
+
+/* atomic masks: read word by word, updated under group_sem */
+
+static inline
+void pfq_sock_mask_or_atomic(pfq_sock_mask_t *dst, pfq_atomic_sock_mask_t *src)
+{
+	size_t n, words = pfq_sock_mask_nwords();
+
+	if (likely(words == 1)) {
+		dst->word[0] |= atomic_long_read(&src->word[0]);
+		return;
+	}
+
+	for(n = 0; n < words; n++)
+		dst->word[n] |= atomic_long_read(&src->word[n]);
+}
+
+
+static inline
+void pfq_atomic_sock_mask_zero(pfq_atomic_sock_mask_t *m)
+{
+	size_t n;
+	for(n = 0; n < Q_SOCK_MASK_WORDS; n++)
+		atomic_long_set(&m->word[n], 0);
+}
+
+
+static inline
+void pfq_atomic_sock_mask_assign(pfq_atomic_sock_mask_t *m, int id, bool value)
+{
+	atomic_long_t *w = &m->word[id / BITS_PER_LONG];
+	unsigned long tmp = atomic_long_read(w);
+
+	if (value)
+		tmp |= 1UL << (id % BITS_PER_LONG);
+	else
+		tmp &= ~(1UL << (id % BITS_PER_LONG));
+
+	atomic_long_set(w, tmp);
+}
+
+
+#endif /* PF_Q_SOCKMASK_H */
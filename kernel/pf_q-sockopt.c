@@ -148,6 +148,90 @@ int pfq_getsockopt(struct socket *sock,
                         return -EFAULT;
         } break;
 
+        case Q_SO_GET_RX_VARLEN:
+        {
+                if (len != sizeof(so->rx_opt.varlen))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.varlen, sizeof(so->rx_opt.varlen)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_RINGS:
+        {
+                if (len != sizeof(so->rx_opt.num_rings))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.num_rings, sizeof(so->rx_opt.num_rings)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_MODE:
+        {
+                if (len != sizeof(so->rx_opt.mode))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.mode, sizeof(so->rx_opt.mode)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_SHMEM_NODE:
+        {
+                /* the actual node once the socket is enabled, the requested one otherwise */
+
+                int node = so->shmem.addr ? so->shmem.node : so->shmem_node;
+
+                if (len != sizeof(node))
+                        return -EINVAL;
+                if (copy_to_user(optval, &node, sizeof(node)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_SHMEM_HUGEPAGES:
+        {
+                if (len != sizeof(so->shmem_hugepages))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->shmem_hugepages, sizeof(so->shmem_hugepages)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_LAYOUT:
+        {
+                if (len != sizeof(so->rx_opt.layout))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.layout, sizeof(so->rx_opt.layout)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_BATCH_COMMIT:
+        {
+                if (len != sizeof(so->rx_opt.batch_commit))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.batch_commit, sizeof(so->rx_opt.batch_commit)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_WAKEUP_WATERMARK:
+        {
+                if (len != sizeof(so->rx_opt.wakeup_watermark))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.wakeup_watermark, sizeof(so->rx_opt.wakeup_watermark)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_WAKEUP_TIMEOUT:
+        {
+                if (len != sizeof(so->rx_opt.wakeup_timeout))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.wakeup_timeout, sizeof(so->rx_opt.wakeup_timeout)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_RX_WAKEUP_BUSY_POLL:
+        {
+                if (len != sizeof(so->rx_opt.wakeup_busy_poll))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->rx_opt.wakeup_busy_poll, sizeof(so->rx_opt.wakeup_busy_poll)))
+                        return -EFAULT;
+        } break;
+
         case Q_SO_GET_SHMEM_SIZE:
         {
         	size_t size = pfq_shared_memory_size(so);
@@ -183,6 +267,57 @@ int pfq_getsockopt(struct socket *sock,
                         return -EFAULT;
         } break;
 
+        case Q_SO_GET_RX_TSTAMP_ERROR:
+        {
+                int err = pfq_sock_tstamp_error(so);
+
+                if (len != sizeof(err))
+                        return -EINVAL;
+                if (copy_to_user(optval, &err, sizeof(err)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_TX_QUEUES:
+        {
+                int num = (int)so->tx_opt.num_queues;
+
+                if (len != sizeof(num))
+                        return -EINVAL;
+                if (copy_to_user(optval, &num, sizeof(num)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_TX_ZEROCOPY:
+        {
+                if (len != sizeof(so->tx_opt.zerocopy))
+                        return -EINVAL;
+                if (copy_to_user(optval, &so->tx_opt.zerocopy, sizeof(so->tx_opt.zerocopy)))
+                        return -EFAULT;
+        } break;
+
+        case Q_SO_GET_TX_RATE:
+        {
+                struct pfq_tx_rate rate;
+
+                if (len != sizeof(rate))
+                        return -EINVAL;
+                if (copy_from_user(&rate, optval, sizeof(rate)))
+                        return -EFAULT;
+
+                if (rate.queue == Q_ANY_QUEUE)
+                        rate.queue = 0;
+
+                if (rate.queue < 0 || rate.queue >= Q_MAX_TX_QUEUES) {
+                        printk(KERN_INFO "[PFQ|%d] Tx rate: bad queue %d!\n", so->id, rate.queue);
+                        return -EINVAL;
+                }
+
+                pfq_tx_shaper_get(&so->tx_opt.queue[rate.queue].shaper, &rate);
+
+                if (copy_to_user(optval, &rate, sizeof(rate)))
+                        return -EFAULT;
+        } break;
+
         case Q_SO_GET_TX_SLOTS:
         {
                 if (len != sizeof(so->tx_opt.queue_size))
@@ -456,10 +591,46 @@ int pfq_setsockopt(struct socket *sock,
                 if (copy_from_user(&tstamp, optval, optlen))
                         return -EFAULT;
 
-                tstamp = tstamp ? 1 : 0;
-                so->rx_opt.tstamp = tstamp;
+                if (tstamp < Q_TSTAMP_OFF || tstamp > Q_TSTAMP_BATCH) {
+                        printk(KERN_INFO "[PFQ|%d] timestamp: bad source (%d)!\n", so->id, tstamp);
+                        return -EINVAL;
+                }
+
+                /* swap the source atomically, so that concurrent setsockopt calls
+                 * move the global consumer counters exactly once per transition */
+
+                pfq_sock_tstamp_update(xchg(&so->rx_opt.tstamp, tstamp), tstamp);
+
+                pr_devel("[PFQ|%d] timestamp source: %d.\n", so->id, tstamp);
+        } break;
+
+        case Q_SO_SET_RX_VARLEN:
+        {
+                int varlen;
+                if (optlen != sizeof(so->rx_opt.varlen))
+                        return -EINVAL;
+
+                if (copy_from_user(&varlen, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] varlen: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (varlen && so->rx_opt.layout == Q_RX_LAYOUT_SPLIT) {
+                        printk(KERN_INFO "[PFQ|%d] varlen: not supported with the header-split layout!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (varlen && so->rx_opt.mode == Q_RX_MODE_CONTINUOUS) {
+                        printk(KERN_INFO "[PFQ|%d] varlen: not supported in continuous mode!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->rx_opt.varlen = varlen ? Q_SLOTS_VARLEN : Q_SLOTS_FIXED;
 
-                pr_devel("[PFQ|%d] timestamp enabled.\n", so->id);
+                pr_devel("[PFQ|%d] varlen slots %s.\n", so->id, so->rx_opt.varlen ? "enabled" : "disabled");
         } break;
 
         case Q_SO_SET_RX_CAPLEN:
@@ -483,6 +654,271 @@ int pfq_setsockopt(struct socket *sock,
                                 so->id, so->rx_opt.caplen, so->rx_opt.slot_size);
         } break;
 
+        case Q_SO_SET_RX_RINGS:
+        {
+                typeof(so->rx_opt.num_rings) rings;
+
+                if (optlen != sizeof(rings))
+                        return -EINVAL;
+                if (copy_from_user(&rings, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] Rx rings: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (rings == 0 || rings > Q_MAX_RX_RINGS) {
+                        printk(KERN_INFO "[PFQ|%d] invalid Rx rings=%zu (max %d)\n", so->id, rings, Q_MAX_RX_RINGS);
+                        return -EPERM;
+                }
+
+                so->rx_opt.num_rings = rings;
+
+                pr_devel("[PFQ|%d] Rx rings=%zu\n", so->id, so->rx_opt.num_rings);
+        } break;
+
+        case Q_SO_SET_RX_MODE:
+        {
+                int mode;
+                if (optlen != sizeof(so->rx_opt.mode))
+                        return -EINVAL;
+
+                if (copy_from_user(&mode, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] Rx mode: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (mode != Q_RX_MODE_DOUBLE_BUFFER && mode != Q_RX_MODE_CONTINUOUS) {
+                        printk(KERN_INFO "[PFQ|%d] invalid Rx mode=%d\n", so->id, mode);
+                        return -EPERM;
+                }
+
+                if (mode == Q_RX_MODE_CONTINUOUS && so->rx_opt.varlen) {
+                        printk(KERN_INFO "[PFQ|%d] Rx mode: continuous ring with varlen slots not supported!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (mode != Q_RX_MODE_CONTINUOUS && so->rx_opt.batch_commit) {
+                        printk(KERN_INFO "[PFQ|%d] Rx mode: batch commit requires the continuous ring!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->rx_opt.mode = mode;
+
+                pr_devel("[PFQ|%d] Rx mode=%d\n", so->id, so->rx_opt.mode);
+        } break;
+
+        case Q_SO_SET_SHMEM_NODE:
+        {
+                int node;
+
+                if (optlen != sizeof(node))
+                        return -EINVAL;
+                if (copy_from_user(&node, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] shmem node: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (node != Q_NODE_ANY && node != Q_NODE_DEVICE &&
+                    (node < 0 || node >= MAX_NUMNODES || !node_online(node))) {
+                        printk(KERN_INFO "[PFQ|%d] invalid shmem node=%d\n", so->id, node);
+                        return -EPERM;
+                }
+
+                so->shmem_node = node;
+
+                pr_devel("[PFQ|%d] shmem node=%d\n", so->id, so->shmem_node);
+        } break;
+
+        case Q_SO_SET_SHMEM_HUGEPAGES:
+        {
+                int policy;
+
+                if (optlen != sizeof(policy))
+                        return -EINVAL;
+                if (copy_from_user(&policy, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] shmem hugepages: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (policy != Q_HUGEPAGES_AUTO &&
+                    policy != Q_HUGEPAGES_OFF &&
+                    policy != Q_HUGEPAGES_REQUIRE) {
+                        printk(KERN_INFO "[PFQ|%d] invalid shmem hugepages=%d\n", so->id, policy);
+                        return -EPERM;
+                }
+
+                so->shmem_hugepages = policy;
+
+                pr_devel("[PFQ|%d] shmem hugepages=%d\n", so->id, so->shmem_hugepages);
+        } break;
+
+        case Q_SO_SET_TX_ZEROCOPY:
+        {
+                int zerocopy;
+
+                if (optlen != sizeof(so->tx_opt.zerocopy))
+                        return -EINVAL;
+                if (copy_from_user(&zerocopy, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] Tx zero-copy: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (zerocopy && !pfq_tx_zcopy_supported()) {
+                        printk(KERN_INFO "[PFQ|%d] Tx zero-copy: not supported by this kernel!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->tx_opt.zerocopy = zerocopy ? 1 : 0;
+
+                pr_devel("[PFQ|%d] Tx zero-copy: %d\n", so->id, so->tx_opt.zerocopy);
+        } break;
+
+        case Q_SO_SET_TX_RATE:
+        {
+                struct pfq_tx_rate rate;
+                int n;
+
+                if (optlen != sizeof(rate))
+                        return -EINVAL;
+                if (copy_from_user(&rate, optval, optlen))
+                        return -EFAULT;
+
+                if (rate.queue != Q_ANY_QUEUE && (rate.queue < 0 || rate.queue >= Q_MAX_TX_QUEUES)) {
+                        printk(KERN_INFO "[PFQ|%d] Tx rate: bad queue %d!\n", so->id, rate.queue);
+                        return -EINVAL;
+                }
+
+                for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+                {
+                        if (rate.queue == Q_ANY_QUEUE || rate.queue == n)
+                                pfq_tx_shaper_set(&so->tx_opt.queue[n].shaper, rate.pps, rate.bps, rate.burst);
+                }
+
+                pr_devel("[PFQ|%d] Tx rate: queue=%d pps=%llu bps=%llu burst=%u\n", so->id, rate.queue,
+                         (unsigned long long)rate.pps, (unsigned long long)rate.bps, rate.burst);
+        } break;
+
+        case Q_SO_SET_RX_LAYOUT:
+        {
+                int layout;
+
+                if (optlen != sizeof(layout))
+                        return -EINVAL;
+                if (copy_from_user(&layout, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] Rx layout: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (layout != Q_RX_LAYOUT_INLINE && layout != Q_RX_LAYOUT_SPLIT) {
+                        printk(KERN_INFO "[PFQ|%d] invalid Rx layout=%d\n", so->id, layout);
+                        return -EPERM;
+                }
+
+                if (layout == Q_RX_LAYOUT_SPLIT && so->rx_opt.varlen) {
+                        printk(KERN_INFO "[PFQ|%d] Rx layout: header-split with varlen slots not supported!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->rx_opt.layout = layout;
+
+                pr_devel("[PFQ|%d] Rx layout=%d\n", so->id, so->rx_opt.layout);
+        } break;
+
+        case Q_SO_SET_RX_BATCH_COMMIT:
+        {
+                int batch_commit;
+
+                if (optlen != sizeof(batch_commit))
+                        return -EINVAL;
+                if (copy_from_user(&batch_commit, optval, optlen))
+                        return -EFAULT;
+
+                if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] batch commit: socket already enabled!\n", so->id);
+                        return -EPERM;
+                }
+
+                if (batch_commit && so->rx_opt.mode != Q_RX_MODE_CONTINUOUS) {
+                        printk(KERN_INFO "[PFQ|%d] batch commit: continuous Rx mode required!\n", so->id);
+                        return -EPERM;
+                }
+
+                so->rx_opt.batch_commit = batch_commit ? true : false;
+
+                pr_devel("[PFQ|%d] batch commit %s.\n", so->id, so->rx_opt.batch_commit ? "enabled" : "disabled");
+        } break;
+
+        case Q_SO_SET_RX_WAKEUP_WATERMARK:
+        {
+                typeof(so->rx_opt.wakeup_watermark) watermark;
+
+                if (optlen != sizeof(watermark))
+                        return -EINVAL;
+                if (copy_from_user(&watermark, optval, optlen))
+                        return -EFAULT;
+
+                if (watermark == 0) {
+                        printk(KERN_INFO "[PFQ|%d] invalid wakeup watermark=%zu\n", so->id, watermark);
+                        return -EPERM;
+                }
+
+                /* the policy can be tuned while the socket is running */
+
+                so->rx_opt.wakeup_watermark = watermark;
+
+                pr_devel("[PFQ|%d] wakeup watermark=%zu\n", so->id, so->rx_opt.wakeup_watermark);
+        } break;
+
+        case Q_SO_SET_RX_WAKEUP_TIMEOUT:
+        {
+                typeof(so->rx_opt.wakeup_timeout) timeout;
+
+                if (optlen != sizeof(timeout))
+                        return -EINVAL;
+                if (copy_from_user(&timeout, optval, optlen))
+                        return -EFAULT;
+
+                if (timeout > Q_WAKEUP_TIMEOUT_MAX) {
+                        printk(KERN_INFO "[PFQ|%d] invalid wakeup timeout=%u usec (max %d)\n", so->id, timeout, Q_WAKEUP_TIMEOUT_MAX);
+                        return -EPERM;
+                }
+
+                so->rx_opt.wakeup_timeout = timeout;
+
+                pr_devel("[PFQ|%d] wakeup timeout=%u usec\n", so->id, so->rx_opt.wakeup_timeout);
+        } break;
+
+        case Q_SO_SET_RX_WAKEUP_BUSY_POLL:
+        {
+                int busy_poll;
+
+                if (optlen != sizeof(busy_poll))
+                        return -EINVAL;
+                if (copy_from_user(&busy_poll, optval, optlen))
+                        return -EFAULT;
+
+                so->rx_opt.wakeup_busy_poll = busy_poll ? true : false;
+
+                pr_devel("[PFQ|%d] wakeup busy-poll %s\n", so->id, so->rx_opt.wakeup_busy_poll ? "enabled" : "disabled");
+        } break;
+
         case Q_SO_SET_RX_SLOTS:
         {
                 typeof(so->rx_opt.queue_size) slots;
@@ -556,22 +992,22 @@ int pfq_setsockopt(struct socket *sock,
 
                 if (fprog.fcode.len > 0) {  /* set the filter */
 
-                        struct sk_filter *filter;
-
-			if (fprog.fcode.len == 1) { /* check for dummey BPF_CLASS == BPF_RET */
-
-                       	 	if (BPF_CLASS(fprog.fcode.filter[0].code) == BPF_RET) {
-                                	pr_devel("[PFQ|%d] fprog: BPF_RET optimized out!\n", so->id);
-                                	return 0;
-				}
-			}
+                        struct pfq_bpf *filter;
 
-                        filter = pfq_alloc_sk_filter(&fprog.fcode);
+                        filter = pfq_bpf_get(&fprog.fcode);
                         if (filter == NULL) {
                                 printk(KERN_INFO "[PFQ|%d] fprog error: alloc_sk_filter for gid=%d\n", so->id, fprog.gid);
                                 return -EINVAL;
                         }
 
+			if (filter->kind == pfq_bpf_accept) { /* accept all: no filter */
+
+                                pfq_bpf_put(filter);
+                                __pfq_set_group_filter(fprog.gid, NULL);
+                                pr_devel("[PFQ|%d] fprog: gid=%d accept all optimized out!\n", so->id, fprog.gid);
+                                return 0;
+			}
+
                         __pfq_set_group_filter(fprog.gid, filter);
 
                         pr_devel("[PFQ|%d] fprog: gid=%d (fprog len %d bytes)\n", so->id, fprog.gid, fprog.fcode.len);
@@ -656,6 +1092,14 @@ int pfq_setsockopt(struct socket *sock,
 			return -EPERM;
 		}
 
+		/* once enabled, only the queues reserved at enable time can be bound */
+
+		if (so->shmem.addr && so->tx_opt.num_queues >= so->tx_opt.num_reserved) {
+                        printk(KERN_INFO "[PFQ|%d] Tx bind: no memory reserved for queue %zu (bind before enable)!\n",
+                        	so->id, so->tx_opt.num_queues);
+			return -EPERM;
+		}
+
                 rcu_read_lock();
                 if (!dev_get_by_index_rcu(sock_net(&so->sk), info.if_index)) {
                         rcu_read_unlock();
@@ -682,6 +1126,9 @@ int pfq_setsockopt(struct socket *sock,
 
 		so->tx_opt.num_queues++;
 
+		if (!so->shmem.addr)
+			so->tx_opt.num_reserved = so->tx_opt.num_queues;
+
                 pr_devel("[PFQ|%d] Tx[%zu] bind: if_index=%d hw_queue=%d cpu=%d\n", so->id, i,
                 		so->tx_opt.queue[i].if_index, so->tx_opt.queue[i].hw_queue, info.cpu);
 
@@ -691,6 +1138,11 @@ int pfq_setsockopt(struct socket *sock,
         {
         	size_t n;
 
+		if (so->shmem.addr) {
+                        printk(KERN_INFO "[PFQ|%d] Tx unbind: socket enabled!\n", so->id);
+			return -EPERM;
+		}
+
          	for(n = 0; n < Q_MAX_TX_QUEUES; ++n)
 		{
 			so->tx_opt.queue[n].if_index = -1;
@@ -698,6 +1150,9 @@ int pfq_setsockopt(struct socket *sock,
 			so->tx_opt.queue[n].cpu      = -1;
 		}
 
+		so->tx_opt.num_queues = 0;
+		so->tx_opt.num_reserved = 0;
+
         } break;
 
         case Q_SO_TX_FLUSH:
@@ -711,12 +1166,12 @@ int pfq_setsockopt(struct socket *sock,
         	if (copy_from_user(&queue, optval, optlen))
         		return -EFAULT;
 
-		if (pfq_get_tx_queue(&so->tx_opt, 0) == NULL) {
+		if (!so->shmem.addr) {
 			printk(KERN_INFO "[PFQ|%d] Tx queue flush: socket not enabled!\n", so->id);
 			return -EPERM;
 		}
 
-		if (queue < -1 || (queue > 0 && queue >= so->tx_opt.num_queues)) {
+		if (queue < -1 || (queue >= 0 && queue >= so->tx_opt.num_queues)) {
 			printk(KERN_INFO "[PFQ|%d] Tx queue flush: bad queue %d (num_queue=%zu)!\n", so->id, queue, so->tx_opt.num_queues);
 			return -EPERM;
 		}
@@ -728,7 +1183,15 @@ int pfq_setsockopt(struct socket *sock,
 
 		for(n = 0; n < so->tx_opt.num_queues; n++)
 		{
-			if (pfq_queue_flush(so, n) != 0) {
+			int ret = pfq_queue_flush(so, n);
+
+			/* -EAGAIN: zero-copy skbs of the previous flush still in flight */
+
+			if (ret == -EAGAIN) {
+				if (!err)
+					err = ret;
+			}
+			else if (ret != 0) {
 				printk(KERN_INFO "[PFQ|%d] Tx[%zu] queue flush: flush error (if_index=%d)!\n", so->id, n, so->tx_opt.queue[n].if_index);
 				err = -EPERM;
 			}
@@ -753,7 +1216,7 @@ int pfq_setsockopt(struct socket *sock,
 
 			size_t started = 0;
 
-			if (pfq_get_tx_queue(&so->tx_opt, 0) == NULL) {
+			if (!so->shmem.addr) {
 				printk(KERN_INFO "[PFQ|%d] Tx queue flush: socket not enabled!\n", so->id);
 				return -EPERM;
 			}
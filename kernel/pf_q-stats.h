@@ -73,11 +73,13 @@ struct pfq_global_stats
 {
 	sparse_counter_t recv; 	    	/* received by PFQ */
 	sparse_counter_t lost; 	    	/* lost during capture, due to PFQ problem (e.g. memory problem) */
+	sparse_counter_t drop; 	    	/* dropped on entry, no group listening to the device/queue */
         sparse_counter_t sent;  	/* transmitted from user-space */
         sparse_counter_t frwd;  	/* forwarded to devices */
         sparse_counter_t kern;  	/* passed to kernel */
         sparse_counter_t disc;  	/* discarded due to driver congestion */
         sparse_counter_t quit; 		/* quit due to PFQ problem (e.g. memory problems) */
+        sparse_counter_t zcwt; 		/* Tx flushes given up, zero-copy skbs still in flight */
 
         sparse_counter_t poll; 		/* number of poll */
         sparse_counter_t wake; 		/* number of wakeup */
@@ -88,11 +90,13 @@ void pfq_global_stats_reset(struct pfq_global_stats *stats)
 {
 	sparse_set(&stats->recv, 0);
 	sparse_set(&stats->lost, 0);
+	sparse_set(&stats->drop, 0);
 	sparse_set(&stats->sent, 0);
 	sparse_set(&stats->frwd, 0);
 	sparse_set(&stats->kern, 0);
 	sparse_set(&stats->disc, 0);
 	sparse_set(&stats->quit, 0);
+	sparse_set(&stats->zcwt, 0);
 
 	sparse_set(&stats->poll, 0);
 	sparse_set(&stats->wake, 0);
@@ -110,6 +114,9 @@ struct pfq_memory_stats
 	sparse_counter_t err_shared;
 	sparse_counter_t err_cloned;
 	sparse_counter_t err_memory;
+	sparse_counter_t tx_hit;
+	sparse_counter_t tx_miss;
+	sparse_counter_t tx_busy;
 };
 
 
@@ -125,6 +132,9 @@ void pfq_memory_stats_reset(struct pfq_memory_stats *stats)
         sparse_set(&stats->err_shared, 0);
         sparse_set(&stats->err_cloned, 0);
         sparse_set(&stats->err_memory, 0);
+        sparse_set(&stats->tx_hit, 0);
+        sparse_set(&stats->tx_miss, 0);
+        sparse_set(&stats->tx_busy, 0);
 }
 
 
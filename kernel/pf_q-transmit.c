@@ -30,6 +30,10 @@
 #include <linux/version.h>
 #include <linux/sched.h>
 #include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
 
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
@@ -122,10 +126,10 @@ batch_drain(struct pfq_skbuff_batch *skbs, struct local_data *local, struct net_
 
 	sent = pfq_batch_xmit(skbs, dev, hw_queue);
 
-	/* free the transmitted skb... */
+	/* release the transmitted skb (to the Tx cache of the device)... */
 
 	for_each_skbuff_upto(sent, skbs, skb, i)
-		pfq_kfree_skb_pool(skb, &local->tx_pool);
+		pfq_kfree_skb_tx(skb, dev, max_len);
 
 	/* ... discard them from the batch */
 
@@ -140,6 +144,189 @@ batch_drain(struct pfq_skbuff_batch *skbs, struct local_data *local, struct net_
 }
 
 
+/*
+ * Zero-copy Tx: the payload of a frame is attached to the skb as frags of the
+ * shared memory pages; only the first Q_TX_ZCOPY_HEAD bytes are copied.
+ * Completions are counted for each half of the double buffer, and a half is
+ * not handed back to user-space until its skbs are all released.
+ *
+ * On kernels >= 4.14 the stack takes and drops references on the ubuf_info
+ * itself (e.g. when a zero-copy skb is cloned or segmented), invoking the
+ * callback once per reference: the skbs in flight are then the references
+ * held on top of the initial one.
+ */
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0))
+static void
+pfq_tx_zcopy_complete(struct ubuf_info *ubuf, bool success)
+{
+	refcount_dec(&ubuf->refcnt);
+}
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+static void
+pfq_tx_zcopy_complete(struct ubuf_info *ubuf, bool success)
+{
+	atomic_dec((atomic_t *)ubuf->ctx);
+}
+#endif
+
+
+static inline int
+pfq_tx_zcopy_pending(struct pfq_tx_queue_info *txi, int half)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0))
+	return (int)refcount_read(&txi->zcopy_ubuf[half].refcnt) - 1;
+#else
+	return atomic_read(&txi->zcopy_pending[half]);
+#endif
+}
+
+
+void
+pfq_tx_zcopy_init(struct pfq_tx_queue_info *txi)
+{
+	int h;
+
+	for(h = 0; h < 2; h++)
+	{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0))
+		memset(&txi->zcopy_ubuf[h], 0, sizeof(txi->zcopy_ubuf[h]));
+		txi->zcopy_ubuf[h].callback = pfq_tx_zcopy_complete;
+		txi->zcopy_ubuf[h].desc     = h;
+		refcount_set(&txi->zcopy_ubuf[h].refcnt, 1);
+#else
+		atomic_set(&txi->zcopy_pending[h], 0);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+		txi->zcopy_ubuf[h].callback = pfq_tx_zcopy_complete;
+		txi->zcopy_ubuf[h].ctx      = &txi->zcopy_pending[h];
+		txi->zcopy_ubuf[h].desc     = h;
+#endif
+#endif
+	}
+}
+
+
+bool
+pfq_tx_zcopy_supported(void)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+/* wait for the completion of all the zero-copy skbs in flight (user-context) */
+
+void
+pfq_tx_zcopy_drain(struct pfq_tx_opt *to)
+{
+	size_t n, wait = 0;
+	int h;
+
+	for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+	{
+		for(h = 0; h < 2; h++)
+		{
+			while (pfq_tx_zcopy_pending(&to->queue[n], h))
+			{
+				if (++wait % 1000 == 0)
+					printk(KERN_INFO "[PFQ] Tx[%zu] zero-copy: waiting for %d skb completions...\n",
+					       n, pfq_tx_zcopy_pending(&to->queue[n], h));
+				msleep(1);
+			}
+		}
+	}
+}
+
+
+/*
+ * wait until the given half of the Tx queue has no zero-copy skb in flight:
+ * both callers run in process context, so the wait sleeps, and it is bounded
+ * to Q_TX_ZCOPY_WAIT_USEC; on timeout the flush is given up with -EAGAIN
+ * (counted as zc wait in /proc/net/pfq/stats) and retried by the next one.
+ */
+
+#define Q_TX_ZCOPY_WAIT_USEC	1000
+
+static inline
+bool pfq_tx_zcopy_wait(struct pfq_tx_queue_info *txi, int half, int cpu)
+{
+	int usec = 0;
+
+	while (pfq_tx_zcopy_pending(txi, half))
+	{
+		if (usec >= Q_TX_ZCOPY_WAIT_USEC || giveup_tx(cpu))
+			return false;
+
+		usleep_range(10, 20);
+		usec += 10;
+	}
+	return true;
+}
+
+
+static inline
+bool pfq_tx_zcopy_eligible(struct net_device *dev, const char *data, size_t len)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+	if (len <= Q_TX_ZCOPY_HEAD || !(dev->features & NETIF_F_SG))
+		return false;
+#ifdef CONFIG_HIGHMEM
+	if (!(dev->features & NETIF_F_HIGHDMA))
+		return false;
+#endif
+	data += Q_TX_ZCOPY_HEAD;
+	len  -= Q_TX_ZCOPY_HEAD;
+
+	return DIV_ROUND_UP(offset_in_page(data) + len, PAGE_SIZE) <= MAX_SKB_FRAGS;
+#else
+	return false;
+#endif
+}
+
+
+/* attach the payload past the head (already copied) as page frags */
+
+static inline
+void pfq_tx_zcopy_attach(struct sk_buff *skb, struct pfq_tx_queue_info *txi, int half, const char *data, size_t len)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+	int nr = 0;
+
+	data += Q_TX_ZCOPY_HEAD;
+	len  -= Q_TX_ZCOPY_HEAD;
+
+	while (len)
+	{
+		struct page *page = vmalloc_to_page(data);
+		size_t off  = offset_in_page(data);
+		size_t size = min_t(size_t, len, PAGE_SIZE - off);
+
+		get_page(page);
+		skb_fill_page_desc(skb, nr++, page, off, size);
+
+		skb->len      += size;
+		skb->data_len += size;
+		skb->truesize += size;
+
+		data += size;
+		len  -= size;
+	}
+
+	skb_shinfo(skb)->destructor_arg = &txi->zcopy_ubuf[half];
+	skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0))
+	refcount_inc(&txi->zcopy_ubuf[half].refcnt);
+#else
+	atomic_inc(&txi->zcopy_pending[half]);
+#endif
+#endif
+}
+
+
 static inline
 bool keep_trying(int *retry, int sent, int cpu, bool aggressive)
 {
@@ -164,18 +351,137 @@ bool tx_required(struct pfq_skbuff_batch *q, ktime_t now, uint64_t ts)
 	return len == batch_len || ((len > 0) && (ts > ktime_to_ns(now))); 
 }
 
+/*
+ * Tx shaping: a token bucket per queue, implemented as a GCRA. Each packet leaves
+ * no earlier than its own timestamp and no earlier than the theoretical arrival
+ * time of the bucket minus the burst tolerance; the pacing below does the wait.
+ */
+
+static inline
+uint64_t tx_shaper_cost(uint64_t bps, size_t len)
+{
+	return div64_u64((uint64_t)len * 8 * NSEC_PER_SEC, bps);
+}
+
+
+/*
+ * The rate is only recorded here: the shaper state belongs to the Tx path
+ * (the Tx kthread, or the flushing thread), which applies it at the start of
+ * the next flush (tx_shaper_update).
+ */
+
+void pfq_tx_shaper_set(struct pfq_tx_shaper *sh, uint64_t pps, uint64_t bps, unsigned int burst)
+{
+	spin_lock(&sh->lock);
+
+	sh->rate_pps   = pps;
+	sh->rate_bps   = bps;
+	sh->rate_burst = burst ? burst : 1;
+	sh->update     = 1;
+
+	spin_unlock(&sh->lock);
+}
+
+
+void pfq_tx_shaper_get(struct pfq_tx_shaper *sh, struct pfq_tx_rate *rate)
+{
+	spin_lock(&sh->lock);
+
+	rate->pps   = sh->rate_pps;
+	rate->bps   = sh->rate_bps;
+	rate->burst = sh->rate_burst;
+
+	spin_unlock(&sh->lock);
+}
+
+
+static inline
+void tx_shaper_update(struct pfq_tx_shaper *sh)
+{
+	uint64_t pps, bps;
+	unsigned int burst;
+
+	if (likely(!ACCESS_ONCE(sh->update)))
+		return;
+
+	spin_lock(&sh->lock);
+
+	pps   = sh->rate_pps;
+	bps   = sh->rate_bps;
+	burst = sh->rate_burst;
+	sh->update = 0;
+
+	spin_unlock(&sh->lock);
+
+	sh->pps      = pps;
+	sh->bps      = bps;
+	sh->burst    = burst;
+	sh->pkt_ns   = pps ? div64_u64(NSEC_PER_SEC, pps) : 0;
+	sh->pkt_tol  = (burst - 1) * sh->pkt_ns;
+	sh->byte_tol = bps ? (burst - 1) * tx_shaper_cost(bps, max_len) : 0;
+	sh->tat_pps  = 0;
+	sh->tat_bps  = 0;
+}
+
+
+static inline
+bool tx_shaper_active(struct pfq_tx_shaper const *sh)
+{
+	return sh->pps || sh->bps;
+}
+
+
+static inline
+uint64_t tx_shape(struct pfq_tx_shaper *sh, uint64_t ts, uint64_t now, size_t len)
+{
+	uint64_t pps = sh->pps, bps = sh->bps, start;
+
+	if (pps && sh->tat_pps > ts + sh->pkt_tol)
+		ts = sh->tat_pps - sh->pkt_tol;
+
+	if (bps && sh->tat_bps > ts + sh->byte_tol)
+		ts = sh->tat_bps - sh->byte_tol;
+
+	start = max(ts, now);
+
+	if (pps)
+		sh->tat_pps = max(sh->tat_pps, start) + sh->pkt_ns;
+	if (bps)
+		sh->tat_bps = max(sh->tat_bps, start) + tx_shaper_cost(bps, len);
+
+	return ts;
+}
+
+
+/*
+ * Tx pacing: sleep on an hrtimer until tx_spin_usec before the deadline, then
+ * spin. The sleep is interrupted by kthread_stop or a signal (see giveup_tx).
+ */
+
 static inline
 ktime_t wait_until(uint64_t ts, int cpu)
 {
-	ktime_t now;
-	do
+	s64 spin = (s64)tx_spin_usec * NSEC_PER_USEC;
+	ktime_t now = ktime_get_real();
+
+	while (ktime_to_ns(now) < ts)
 	{
+		s64 delta = ts - ktime_to_ns(now);
+
+		if (giveup_tx(cpu))
+			return now;
+
+		if (delta > spin) {
+			ktime_t expires = ns_to_ktime(delta - spin);
+
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+		}
+		else
+			pfq_relax();
+
         	now = ktime_get_real();
-        	if (giveup_tx(cpu))
-        		return now;
 	}
-	while (ktime_to_ns(now) < ts 
-	       	&& (pfq_relax(), true));
 
 	return now;
 }
@@ -191,9 +497,11 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 
 	struct pfq_pkthdr_tx * hdr;
 	struct local_data *local;
+	struct sk_buff *skb;
 	size_t len, tot_sent = 0;
 	unsigned int n, retry, index;
        	int last_batch_len, hw_queue;
+	bool zcopy;
 
 	char *ptr, *begin, *end;
         ktime_t now; uint64_t last_ts;
@@ -208,6 +516,17 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 
 	txq = __pfq_pick_tx(dev, &hw_queue);
 
+	/* the half handed to user-space by the swap must have no zero-copy skb in flight */
+
+	if (!pfq_tx_zcopy_wait(&to->queue[idx], (__atomic_load_n(&soft_txq->cons, __ATOMIC_RELAXED) + 1) & 1, cpu)) {
+		sparse_inc(&global_stats.zcwt);
+		return -EAGAIN;
+	}
+
+	/* apply the rate set since the last flush */
+
+	tx_shaper_update(&to->queue[idx].shaper);
+
 	/* swap the soft Tx queue */
 
 	if (cpu != Q_NO_KTHREAD) {
@@ -249,12 +568,20 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 	
 	for(n = 0; ptr < end && hdr->len != 0; n++, hdr = (struct pfq_pkthdr_tx *)ptr)
 	{
-		struct sk_buff *skb;
-
-		/* get tstamp of this packet */
+		/* get tstamp of this packet, delayed by the shaper if any */
 
 		last_ts = hdr->nsec;
 
+		if (tx_shaper_active(&to->queue[idx].shaper))
+			last_ts = tx_shape(&to->queue[idx].shaper, last_ts, ktime_to_ns(now),
+					   min_t(size_t, hdr->len, max_len));
+
+		/* refresh the clock for a packet in the future: all the packets whose deadline
+		 * has passed go in the same batch */
+
+		if (last_ts > ktime_to_ns(now))
+			now = ktime_get_real();
+
 		/* if the batch is full (or the packet is in the future), transmit the batch */
 
 		if (tx_required(SKBUFF_BATCH_ADDR(skbs), now, last_ts)) {
@@ -277,9 +604,14 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 		if (last_ts > ktime_to_ns(now)) 
 			now = wait_until(last_ts, cpu);
 
-		/* allocate a packet */
+	 	len = min_t(size_t, hdr->len, max_len);
+
+		zcopy = to->zerocopy && pfq_tx_zcopy_eligible(dev, (const char *)(hdr+1), len);
 
-	 	skb = pfq_tx_alloc_skb(max_len, GFP_KERNEL, node);
+		/* allocate a packet (only the head for zero-copy, which is never cached) */
+
+	 	skb = zcopy ? __pfq_tx_alloc_skb(dev, Q_TX_ZCOPY_HEAD, GFP_KERNEL, node)
+			    : pfq_tx_alloc_skb(dev, max_len, GFP_KERNEL, node);
 	 	if (unlikely(skb == NULL)) {
 	 		printk(KERN_INFO "[PFQ] Tx could not allocate an skb!\n");
 	 		break;
@@ -287,20 +619,22 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 
 	 	/* fill the skb */
 
-	 	len = min_t(size_t, hdr->len, max_len);
-
 	 	skb_reset_tail_pointer(skb);
 	 	skb->dev = dev;
 	 	skb->len = 0;
-	 	__skb_put(skb, len);
+	 	__skb_put(skb, zcopy ? Q_TX_ZCOPY_HEAD : len);
 
 	 	skb_get(skb);
 
 		skb_set_queue_mapping(skb, hw_queue);
 
-	 	/* copy bytes in the socket buffer */
+	 	/* copy bytes in the socket buffer, or attach the pages of the queue */
 
-		if (skb_is_nonlinear(skb))
+		if (zcopy) {
+			skb_copy_to_linear_data(skb, hdr+1, Q_TX_ZCOPY_HEAD);
+			pfq_tx_zcopy_attach(skb, &to->queue[idx], index & 1, (const char *)(hdr+1), len);
+		}
+		else if (skb_is_nonlinear(skb))
 	 		skb_store_bits(skb, 0, hdr+1, len);
                 else
 			skb_copy_to_linear_data(skb, hdr+1, len < 64 ? 64 : len);
@@ -331,6 +665,14 @@ __pfq_queue_xmit(size_t idx, struct pfq_tx_opt *to, struct net_device *dev, int
 		{
 			__sparse_add(&to->stats.disc, last_batch_len, cpu);
 			__sparse_add(&global_stats.disc, last_batch_len, cpu);
+
+			/* release the unsent skbs (and their zero-copy completions) */
+
+			for_each_skbuff(SKBUFF_BATCH_ADDR(skbs), skb, n)
+			{
+				kfree_skb(skb);
+				pfq_kfree_skb_tx(skb, dev, max_len);
+			}
 			break;
 		}
 	}
@@ -362,6 +704,7 @@ int
 pfq_queue_flush(struct pfq_sock *so, int index)
 {
 	struct net_device *dev;
+	int ret;
 
 	if (so->tx_opt.queue[index].task) {
 		return 0;
@@ -373,9 +716,9 @@ pfq_queue_flush(struct pfq_sock *so, int index)
 		return -EPERM;
 	}
 
-	pfq_queue_xmit(index, &so->tx_opt, dev);
+	ret = pfq_queue_xmit(index, &so->tx_opt, dev);
 	dev_put(dev);
-	return 0;
+	return ret < 0 ? ret : 0;
 }
 
 
@@ -587,51 +930,48 @@ pfq_lazy_xmit_exec(struct gc_data *gc, struct gc_fwd_targets const *t)
 	for(n = 0; n < t->num; n++)
 	{
 		dev = t->dev[n];
-		k = 0; txq = NULL;
+		k = 0;
 
-		/* scan the list of skbs, and forward them in batch fashion */
+		/* the first packet for this dev determines the hw queue: one lock for the whole list */
 
-		for(i = 0; i < gc->pool.len; i++)
-		{
-			struct gc_log *log;
-                        size_t j, num;
+		i = find_first_bit(t->pkts[n], gc->pool.len);
+		if (i >= gc->pool.len)
+			continue;
 
-			/* select the packet */
+		skb = gc->pool.queue[i].skb;
+		queue = skb->queue_mapping;
+		txq = pfq_pick_tx(dev, skb, &queue);
 
-                        log = &gc->log[i];
-
-			num = gc_count_dev_in_log(dev, log);
-			if (num == 0)
-				continue;
+		__netif_tx_lock_bh(txq);
 
-			skb = gc->pool.queue[i].skb;
+		/* forward the list of skbs of this dev in batch fashion */
 
-			/* the first packet for this dev determines the hw queue */
+		for_each_set_bit(i, t->pkts[n], gc->pool.len)
+		{
+			struct gc_log *log = &gc->log[i];
+                        size_t j, num;
 
-			if (!txq) {
-				queue = skb->queue_mapping;
-				txq = pfq_pick_tx(dev, skb, &queue);
+			num = test_bit(i, t->multi) ? gc_count_dev_in_log(dev, log) : 1;
 
-				__netif_tx_lock_bh(txq);
-			}
+			skb = gc->pool.queue[i].skb;
 
-			/* forward this skb `num` times */
+			/* forward this skb `num` times: xmit_more is cleared on the last skb of the list */
 
                         for (j = 0; j < num; j++)
 			{
 				const int xmit_more = ++k != t->cnt[n];
+				struct sk_buff *nskb;
 
-				skb = log->xmit_todo-- > 1 ? skb_clone(skb, GFP_ATOMIC) : skb_get(skb);
-				if (skb) {
-					if (__pfq_xmit(skb, dev, txq, xmit_more) == NETDEV_TX_OK)
+				nskb = log->xmit_todo-- > 1 ? skb_clone(skb, GFP_ATOMIC) : skb_get(skb);
+				if (nskb) {
+					if (__pfq_xmit(nskb, dev, txq, xmit_more) == NETDEV_TX_OK)
 		   				sent++;
 				}
 			}
 
 		}
 
-		if (txq)
-			__netif_tx_unlock_bh(txq);
+		__netif_tx_unlock_bh(txq);
 	}
 
 	return sent;
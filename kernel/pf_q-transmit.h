@@ -49,6 +49,12 @@ pfq_queue_xmit(size_t index, struct pfq_tx_opt *to, struct net_device *dev)
 
 extern int pfq_queue_flush(struct pfq_sock *so, int index);
 
+extern bool pfq_tx_zcopy_supported(void);
+extern void pfq_tx_zcopy_drain(struct pfq_tx_opt *to);
+
+extern void pfq_tx_shaper_set(struct pfq_tx_shaper *sh, uint64_t pps, uint64_t bps, unsigned int burst);
+extern void pfq_tx_shaper_get(struct pfq_tx_shaper *sh, struct pfq_tx_rate *rate);
+
 
 extern int pfq_batch_xmit(struct pfq_skbuff_batch *skbs, struct net_device *dev, int queue_index);
 extern int pfq_batch_xmit_by_mask(struct pfq_skbuff_batch *skbs, unsigned long long skbs_mask, struct net_device *dev, int queue_index);
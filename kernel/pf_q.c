@@ -41,6 +41,7 @@
 #include <linux/vmalloc.h>
 #include <linux/percpu.h>
 #include <linux/bug.h>
+#include <linux/prefetch.h>
 
 #include <net/sock.h>
 #ifdef CONFIG_INET
@@ -94,9 +95,14 @@ module_param(max_len,         int, 0644);
 module_param(max_queue_slots, int, 0644);
 
 module_param(batch_len,       int, 0644);
+module_param(flush_timeout,   int, 0644);
+module_param(rx_engine,       int, 0644);
+module_param(prefetch_distance, int, 0644);
 
 module_param(skb_pool_size,   int, 0644);
 module_param(vl_untag,        int, 0644);
+module_param(gro_split,       int, 0644);
+module_param(tx_spin_usec,    int, 0644);
 
 MODULE_PARM_DESC(direct_capture," Direct capture packets: (0 default)");
 
@@ -109,13 +115,18 @@ MODULE_PARM_DESC(max_len, " Maximum transmission length (default=1514 bytes)");
 MODULE_PARM_DESC(max_queue_slots, " Max Queue slots (default=226144)");
 
 MODULE_PARM_DESC(batch_len, 	" Batch queue length");
+MODULE_PARM_DESC(flush_timeout, " Max hold time of a batch, in usec (default=1000)");
+MODULE_PARM_DESC(rx_engine,     " Rx dispatch engine: 0 group-major, 1 packet-major (default=0); packet-major flushes a socket early when it receives from more than 4 groups in a batch");
+MODULE_PARM_DESC(prefetch_distance, " Packets and Rx slots prefetched ahead, 0 disables (default=4)");
 MODULE_PARM_DESC(tx_max_retry,  " Transmission max retry (default=1024)");
+MODULE_PARM_DESC(tx_spin_usec,  " Tx pacing: sleep until tx_spin_usec before a packet deadline, then spin (default=50)");
 
 MODULE_PARM_DESC(vl_untag,  " Enable vlan untagging (default=0)");
+MODULE_PARM_DESC(gro_split, " Split GRO/TSO aggregates into wire segments (default=0)");
 
 #ifndef PFQ_USE_SKB_RECYCLE
 #pragma message "[PFQ] *** using kernel skb allocator ***"
-MODULE_PARM_DESC(skb_pool_size,   " Socket buffer pool size (default=1024)");
+MODULE_PARM_DESC(skb_pool_size,   " Socket buffer pool size, and Tx skb cache size per device (default=1024)");
 #endif
 
 #ifdef PFQ_USE_EXTENDED_PROC
@@ -134,13 +145,12 @@ static DEFINE_SEMAPHORE(sock_sem);
 /* send this packet to selected sockets */
 
 static inline
-void mask_to_sock_queue(unsigned long n, unsigned long mask, unsigned long long *sock_queue)
+void mask_to_sock_queue(unsigned long n, pfq_sock_mask_t const *mask, unsigned long long *sock_queue)
 {
-	unsigned long bit;
-       	pfq_bitwise_foreach(mask, bit,
+	int index;
+       	pfq_sock_mask_foreach(mask, index,
 	{
-	        int index = pfq_ctz(bit);
-                sock_queue[index] |= 1UL << n;
+                sock_queue[index] |= 1ULL << n;
         })
 }
 
@@ -199,119 +209,200 @@ void send_to_kernel(struct sk_buff *skb)
 }
 
 
-static int
-pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
-{
- 	unsigned long long sock_queue[Q_SKBUFF_SHORT_BATCH];
-        unsigned long group_mask, socket_mask;
+/*
+ * Software prefetch of the packet data, prefetch_distance packets ahead
+ * of the one evaluated (the skb structs are hot after the batch setup).
+ */
 
-	struct local_data * local;
-        struct gc_data *gcollector;
+static inline
+void pfq_prefetch_data(struct gc_queue_buff *pool, size_t n, size_t len)
+{
+	if (prefetch_distance && n < len)
+		prefetch(pool->queue[n].skb->data);
+}
 
- 	struct gc_fwd_targets targets;
-
-        long unsigned n, bit, lb;
-        struct pfq_monad monad;
-	struct gc_buff buff;
-	size_t this_batch_len;
-        int cpu;
 
+static inline
+size_t pfq_copy_to_endpoint(struct local_data *local, struct pfq_sock *so, struct gc_queue_buff *pool,
+			    unsigned long long mask, int cpu, int gid)
+{
 #ifdef PFQ_RX_PROFILE
-	cycles_t start, stop;
-#endif
-
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
-	BUILD_BUG_ON_MSG(Q_SKBUFF_SHORT_BATCH > (sizeof(sock_queue[0]) << 3), "skbuff batch overflow");
+	cycles_t start = get_cycles();
+	size_t ret = copy_to_endpoint_buffs(so, pool, mask, cpu, gid);
+	local->rx_prof.copy += get_cycles() - start;
+	return ret;
+#else
+	return copy_to_endpoint_buffs(so, pool, mask, cpu, gid);
 #endif
+}
 
 
-	/* if no socket is open drop the packet */
+/*
+ * Run the BPF of a group on the n-th packet of the batch: the verdict
+ * of a filter shared among groups is computed once per packet.
+ */
 
-        if (pfq_get_sock_count() == 0) {
-        	kfree_skb(skb);
-               	return 0;
+static inline
+bool pfq_run_group_filter(struct local_data *local, struct pfq_bpf const *bpf, struct sk_buff *skb, size_t n)
+{
+	if (pfq_bpf_shared(bpf)) {
+		if (local->bpf_verdict[n].bpf != bpf) {
+			local->bpf_verdict[n].bpf  = bpf;
+			local->bpf_verdict[n].pass = pfq_bpf_run(bpf, skb);
+		}
+		return local->bpf_verdict[n].pass;
 	}
 
-	/* if required, timestamp the packet now */
+	return pfq_bpf_run(bpf, skb);
+}
 
-        if (skb->tstamp.tv64 == 0)
-                __net_timestamp(skb);
 
-        /* if vlan header is present, remove it */
+/*
+ * Run the filters and the functional program of a group on a packet.
+ * On return sock_mask holds the sockets of the group that receive it.
+ * A buff with a NULL skb means the packet is not referenced (filtered out).
+ */
 
-        if (vl_untag && skb->protocol == cpu_to_be16(ETH_P_8021Q)) {
-                skb = pfq_vlan_untag(skb);
-                if (unlikely(!skb)) {
-			sparse_inc(&global_stats.lost);
-                        return -1;
-		}
-        }
+static inline struct gc_buff
+pfq_run_group(struct local_data *local, struct pfq_group *this_group, int gid, struct gc_buff buff, size_t n,
+	      bool bf_filter_enabled, bool vlan_filter_enabled, struct pfq_monad *monad,
+	      pfq_sock_mask_t *sock_mask, int cpu)
+{
+	struct pfq_computation_tree *prg;
 
-        skb_reset_mac_len(skb);
+	/* increment recv counter for this group */
 
-        /* push the mac header: reset skb->data to the beginning of the packet */
+	__sparse_inc(&this_group->stats.recv, cpu);
 
-        if (likely(skb->pkt_type != PACKET_OUTGOING)) {
-            skb_push(skb, skb->mac_len);
-        }
-
-	/* get garbage collector */
 
-	cpu = get_cpu();
-	local = per_cpu_ptr(cpu_data, cpu);
+	/* check for bp filter */
 
-	gcollector = &local->gc;
+	if (bf_filter_enabled) {
 
-	/* set the ownership of this skb to the garbage collector */
+		struct pfq_bpf *bpf = rcu_dereference(this_group->bp_filter);
 
-	buff = gc_make_buff(gcollector, skb);
-	if (buff.skb == NULL) {
-		if (printk_ratelimit())
-			printk(KERN_INFO "[PFQ] GC: memory exhausted!\n");
-		__sparse_inc(&global_stats.lost, cpu);
-		pfq_kfree_skb_pool(skb, &local->rx_pool);
-        	put_cpu();
-		return 0;
+		if (bpf && !pfq_run_group_filter(local, bpf, buff.skb, n))
+		{
+			__sparse_inc(&this_group->stats.drop, cpu);
+			buff.skb = NULL;
+			return buff;
+		}
 	}
 
-        PFQ_CB(buff.skb)->direct = direct;
+	/* check vlan filter */
 
-        if ((gc_size(gcollector) < batch_len) &&
-             (ktime_to_ns(ktime_sub(skb_get_ktime(buff.skb), local->last_ts)) < 1000000) )
-        {
-        	put_cpu();
-                return 0;
+	if (vlan_filter_enabled) {
+
+		if (!__pfq_check_group_vlan_filter(gid, buff.skb->vlan_tci & ~VLAN_TAG_PRESENT)) {
+			__sparse_inc(&this_group->stats.drop, cpu);
+			buff.skb = NULL;
+			return buff;
+		}
 	}
 
-	this_batch_len = gc_size(gcollector);
+	/* check where a functional program is available for this group */
 
-	__sparse_add(&global_stats.recv, this_batch_len, cpu);
+	prg = rcu_dereference(this_group->comp);
+	if (prg) {
 
-	local->last_ts = skb_get_ktime(buff.skb);
+		pfq_sock_mask_t eligible_mask;
+		unsigned long cbit;
+		size_t to_kernel = PFQ_CB(buff.skb)->log->to_kernel;
+		size_t num_fwd   = PFQ_CB(buff.skb)->log->num_devs;
 
-	/* cleanup sock_queue... */
+		/* setup monad for this computation */
 
-        memset(sock_queue, 0, sizeof(sock_queue));
+		monad->fanout.class_mask = Q_CLASS_DEFAULT;
+		monad->fanout.type       = fanout_copy;
+		monad->state  		 = 0;
+		monad->group 		 = this_group;
 
- 	group_mask = 0;
+		/* run the functional program */
 
-#ifdef PFQ_RX_PROFILE
-	start = get_cycles();
-#endif
+		buff = pfq_run(prg, buff).value;
 
-        /* setup all the skbs collected */
+		if (buff.skb == NULL) {
+			__sparse_inc(&this_group->stats.drop, cpu);
+			return buff;
+		}
 
-	for_each_skbuff(SKBUFF_BATCH_ADDR(gcollector->pool), skb, n)
-        {
-		unsigned long local_group_mask = __pfq_devmap_get_groups(skb->dev->ifindex, skb_get_rx_queue(skb));
+		/* update stats */
+
+		__sparse_add(&this_group->stats.frwd, PFQ_CB(buff.skb)->log->num_devs - num_fwd, cpu);
+		__sparse_add(&this_group->stats.kern, PFQ_CB(buff.skb)->log->to_kernel - to_kernel, cpu);
+
+		/* skip the packet? (still referenced) */
+
+		if (is_drop(monad->fanout)) {
+			__sparse_inc(&this_group->stats.drop, cpu);
+			return buff;
+		}
+
+		/* compute the eligible mask of sockets enabled for this packet... */
+
+		pfq_sock_mask_zero(&eligible_mask);
+
+		pfq_bitwise_foreach(monad->fanout.class_mask, cbit,
+		{
+			int class = pfq_ctz(cbit);
+			pfq_sock_mask_or_atomic(&eligible_mask, &this_group->sock_mask[class]);
+		})
+
+
+		if (is_steering(monad->fanout)) {
+
+			/* cache the number of sockets in the mask */
+
+			if (!pfq_sock_mask_equal(&eligible_mask, &local->eligible_mask)) {
+
+				int id;
 
-		group_mask |= local_group_mask;
+				local->eligible_mask = eligible_mask;
+				local->sock_cnt = 0;
 
-		PFQ_CB(skb)->group_mask = local_group_mask;
-		PFQ_CB(skb)->monad      = &monad;
+				pfq_sock_mask_foreach(&eligible_mask, id,
+				{
+					local->sock_id[local->sock_cnt++] = id;
+				})
+			}
+
+			if (likely(local->sock_cnt)) {
+				unsigned int h = monad->fanout.hash ^ (monad->fanout.hash >> 8) ^ (monad->fanout.hash >> 16);
+				pfq_sock_mask_set(sock_mask, local->sock_id[pfq_fold(h, local->sock_cnt)]);
+			}
+		}
+		else {  /* clone or continue ... */
+
+			pfq_sock_mask_or(sock_mask, &eligible_mask);
+		}
+	}
+	else {
+		pfq_sock_mask_or_atomic(sock_mask, &this_group->sock_mask[0]);
 	}
 
-        /* process all groups enabled for this batch of packets */
+	return buff;
+}
+
+
+/*
+ * Group-major dispatch: each group walks the whole batch and
+ * its packets are copied to the sockets of the group.
+ */
+
+static void
+pfq_dispatch_by_group(struct local_data *local, unsigned long group_mask,
+		      size_t this_batch_len, struct pfq_monad *monad, int cpu)
+{
+ 	unsigned long long *sock_queue = local->sock_queue;
+        pfq_sock_mask_t socket_mask, batch_socket_mask;
+        struct gc_data *gcollector = &local->gc;
+        long unsigned n, bit;
+	struct gc_buff buff;
+	int i;
+
+	/* sock_queue is clean: only the entries of batch_socket_mask are reset at the end */
+
+	pfq_sock_mask_zero(&batch_socket_mask);
 
 	pfq_bitwise_foreach(group_mask, bit,
 	{
@@ -319,158 +410,267 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 		struct pfq_group * this_group = pfq_get_group(gid);
 
-		bool bf_filter_enabled = atomic_long_read(&this_group->bp_filter);
+		bool bf_filter_enabled = rcu_access_pointer(this_group->bp_filter) != NULL;
 		bool vlan_filter_enabled = __pfq_vlan_filters_enabled(gid);
 		struct gc_queue_buff refs = { len:0 };
 
-		socket_mask = 0;
+		pfq_sock_mask_zero(&socket_mask);
 
 		for_each_gcbuff(&gcollector->pool, buff, n)
 		{
-			struct pfq_computation_tree *prg;
-			unsigned long sock_mask = 0;
+			pfq_sock_mask_t sock_mask;
 
 			/* stop processing packets in GC ? */
 
 			if (n == this_batch_len)
 				break;
 
+			pfq_prefetch_data(&gcollector->pool, n + prefetch_distance, this_batch_len);
+
 			/* skip this packet for this group ? */
 
 			if ((PFQ_CB(buff.skb)->group_mask & bit) == 0)
 				continue;
 
-			/* increment recv counter for this group */
+			pfq_sock_mask_zero(&sock_mask);
 
-			__sparse_inc(&this_group->stats.recv, cpu);
+			buff = pfq_run_group(local, this_group, gid, buff, n, bf_filter_enabled, vlan_filter_enabled,
+					     monad, &sock_mask, cpu);
+			if (buff.skb == NULL)
+				continue;
 
+			/* save a reference of the current packet */
 
-			/* check for bp filter */
+			refs.queue[refs.len++] = buff;
 
-			if (bf_filter_enabled) {
+			mask_to_sock_queue(n, &sock_mask, sock_queue);
 
-				struct sk_filter *bpf = (struct sk_filter *)atomic_long_read(&this_group->bp_filter);
+			pfq_sock_mask_or(&socket_mask, &sock_mask);
+		}
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0))
-				if (bpf && !sk_run_filter(buff.skb, bpf->insns))
-#else
-				if (bpf && !SK_RUN_FILTER(bpf, buff.skb))
-#endif
-                        	{
-					__sparse_inc(&this_group->stats.drop, cpu);
-					continue;
-				}
-			}
+		/* copy payload of packets to endpoints... */
 
-			/* check vlan filter */
+		pfq_sock_mask_foreach(&socket_mask, i,
+		{
+			struct pfq_sock * so = pfq_get_sock_by_id(i);
 
-			if (vlan_filter_enabled) {
+			pfq_copy_to_endpoint(local, so, &refs, sock_queue[i], cpu, gid);
+		})
 
-				if (!__pfq_check_group_vlan_filter(gid, buff.skb->vlan_tci & ~VLAN_TAG_PRESENT)) {
-					__sparse_inc(&this_group->stats.drop, cpu);
-					continue;
-				}
-			}
+		pfq_sock_mask_or(&batch_socket_mask, &socket_mask);
+	})
 
-			/* check where a functional program is available for this group */
+	/* reset the sock_queue entries used by this batch */
 
-			prg = (struct pfq_computation_tree *)atomic_long_read(&this_group->comp);
-			if (prg) {
+	pfq_sock_mask_foreach(&batch_socket_mask, i,
+	{
+		sock_queue[i] = 0;
+	})
+}
 
-				unsigned long cbit, eligible_mask = 0;
-				size_t to_kernel = PFQ_CB(buff.skb)->log->to_kernel;
-				size_t num_fwd   = PFQ_CB(buff.skb)->log->num_devs;
 
-				/* setup monad for this computation */
+/*
+ * Packet-major dispatch: each packet is evaluated by all its groups
+ * while its headers are hot, and the per-socket queues are built in a
+ * single pass over the batch. Packets are enqueued by the GC pool index,
+ * pending per (socket, gid) so that each enqueue carries a single gid; a
+ * socket receiving from more than Q_RX_SOCK_GIDS groups in the same batch
+ * is flushed early.
+ */
 
-				monad.fanout.class_mask = Q_CLASS_DEFAULT;
-				monad.fanout.type       = fanout_copy;
-				monad.state  		= 0;
-				monad.group 		= this_group;
+static void
+pfq_sock_pending_flush(struct local_data *local, int id, struct gc_queue_buff *pool, int cpu)
+{
+	struct pfq_sock * so = pfq_get_sock_by_id(id);
+	int k;
 
-				/* run the functional program */
+	for(k = 0; k < Q_RX_SOCK_GIDS && local->sock_pending[id][k].queue; k++)
+	{
+		pfq_copy_to_endpoint(local, so, pool, local->sock_pending[id][k].queue, cpu, local->sock_pending[id][k].gid);
+		local->sock_pending[id][k].queue = 0;
+	}
+}
 
-				buff = pfq_run(prg, buff).value;
 
-				/* save a reference of the current packet */
+static inline void
+pfq_sock_pending_add(struct local_data *local, int id, int gid, unsigned long index,
+		     struct gc_queue_buff *pool, int cpu)
+{
+	int k;
 
-				if (buff.skb == NULL) {
-                                	__sparse_inc(&this_group->stats.drop, cpu);
-					continue;
-				}
+	/* the slots in use are contiguous: the first empty one ends the search */
 
-				refs.queue[refs.len++] = buff;
+	for(k = 0; k < Q_RX_SOCK_GIDS && local->sock_pending[id][k].queue; k++)
+	{
+		if (local->sock_pending[id][k].gid == gid) {
+			local->sock_pending[id][k].queue |= 1ULL << index;
+			return;
+		}
+	}
 
-				/* update stats */
+	if (unlikely(k == Q_RX_SOCK_GIDS)) {
+		pfq_sock_pending_flush(local, id, pool, cpu);
+		k = 0;
+	}
 
-                                __sparse_add(&this_group->stats.frwd, PFQ_CB(buff.skb)->log->num_devs - num_fwd, cpu);
-                                __sparse_add(&this_group->stats.kern, PFQ_CB(buff.skb)->log->to_kernel - to_kernel, cpu);
+	local->sock_pending[id][k].gid = gid;
+	local->sock_pending[id][k].queue = 1ULL << index;
+}
 
-				/* skip the packet? */
 
-				if (is_drop(monad.fanout)) {
-                                	__sparse_inc(&this_group->stats.drop, cpu);
-                                	continue;
-				}
+static void
+pfq_dispatch_by_packet(struct local_data *local, size_t this_batch_len,
+		       struct pfq_monad *monad, int cpu)
+{
+        pfq_sock_mask_t batch_socket_mask;
+        struct gc_queue_buff *pool = &local->gc.pool;
+        long unsigned n, bit;
+	struct gc_buff buff;
+	int i;
 
-				/* compute the eligible mask of sockets enabled for this packet... */
+	pfq_sock_mask_zero(&batch_socket_mask);
 
-				pfq_bitwise_foreach(monad.fanout.class_mask, cbit,
-				{
-					int class = pfq_ctz(cbit);
-					eligible_mask |= atomic_long_read(&this_group->sock_mask[class]);
-				})
+	for_each_gcbuff(pool, buff, n)
+	{
+		/* stop processing packets in GC ? */
 
+		if (n == this_batch_len)
+			break;
 
-				if (is_steering(monad.fanout)) {
+		pfq_prefetch_data(pool, n + prefetch_distance, this_batch_len);
 
-					/* cache the number of sockets in the mask */
+		pfq_bitwise_foreach(PFQ_CB(buff.skb)->group_mask, bit,
+		{
+			int gid = pfq_ctz(bit);
+
+			struct pfq_group * this_group = pfq_get_group(gid);
+			pfq_sock_mask_t sock_mask;
+			struct gc_buff out;
+			unsigned long index = n;
+			int id;
+
+			pfq_sock_mask_zero(&sock_mask);
 
-					if (eligible_mask != local->eligible_mask) {
+			out = pfq_run_group(local, this_group, gid, buff, n,
+					    rcu_access_pointer(this_group->bp_filter) != NULL,
+					    __pfq_vlan_filters_enabled(gid),
+					    monad, &sock_mask, cpu);
 
-						unsigned long ebit;
+			if (out.skb == NULL || pfq_sock_mask_empty(&sock_mask))
+				continue;
 
-						local->eligible_mask = eligible_mask;
-						local->sock_cnt = 0;
+			/* the program returned a copy: look for it in the GC pool */
 
-						pfq_bitwise_foreach(eligible_mask, ebit,
-						{
-							local->sock_mask[local->sock_cnt++] = ebit;
-						})
-					}
+			if (unlikely(out.skb != buff.skb)) {
 
-					if (likely(local->sock_cnt)) {
-						unsigned int h = monad.fanout.hash ^ (monad.fanout.hash >> 8) ^ (monad.fanout.hash >> 16);
-						sock_mask |= local->sock_mask[pfq_fold(h, local->sock_cnt)];
-					}
+				for(index = this_batch_len; index < pool->len; index++)
+				{
+					if (pool->queue[index].skb == out.skb)
+						break;
 				}
-				else {  /* clone or continue ... */
 
-					sock_mask |= eligible_mask;
+				if (index == pool->len || index >= Q_SKBUFF_SHORT_BATCH) {
+					__sparse_inc(&this_group->stats.drop, cpu);
+					continue;
 				}
 			}
-			else { /* save a reference to the current packet */
 
-				refs.queue[refs.len++] = buff;
-				sock_mask |= atomic_long_read(&this_group->sock_mask[0]);
-			}
+			pfq_sock_mask_foreach(&sock_mask, id,
+			{
+				pfq_sock_pending_add(local, id, gid, index, pool, cpu);
+			})
 
-			mask_to_sock_queue(n, sock_mask, sock_queue);
+			pfq_sock_mask_or(&batch_socket_mask, &sock_mask);
+		})
+	}
 
-			socket_mask |= sock_mask;
-		}
+	/* copy payload of packets to endpoints... */
 
-		/* copy payload of packets to endpoints... */
+	pfq_sock_mask_foreach(&batch_socket_mask, i,
+	{
+		pfq_sock_pending_flush(local, i, pool, cpu);
+	})
+}
 
-		pfq_bitwise_foreach(socket_mask, lb,
-		{
-			int i = pfq_ctz(lb);
-			struct pfq_sock * so = pfq_get_sock_by_id(i);
 
-			copy_to_endpoint_buffs(so, &refs, sock_queue[i], cpu, gid);
-		})
-	})
+static void
+pfq_receive_batch(struct local_data *local, int cpu)
+{
+        struct gc_data *gcollector = &local->gc;
+ 	struct gc_fwd_targets targets;
+        unsigned long group_mask;
+        struct pfq_monad monad;
+	struct sk_buff *skb;
+	size_t this_batch_len;
+        long unsigned n;
+	bool batch_tstamp;
+	ktime_t now = ktime_set(0, 0);
+
+#ifdef PFQ_RX_PROFILE
+	cycles_t start, setup, dispatch, stop, copy;
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+	BUILD_BUG_ON_MSG(Q_SKBUFF_SHORT_BATCH > (sizeof(local->sock_queue[0]) << 3), "skbuff batch overflow");
+#endif
+
+	this_batch_len = gc_size(gcollector);
+
+	__sparse_add(&global_stats.recv, this_batch_len, cpu);
+
+ 	group_mask = 0;
+
+#ifdef PFQ_RX_PROFILE
+	start = get_cycles();
+#endif
+
+	/* batch timestamp: a single clock read for the packets not stamped on receive */
+
+	batch_tstamp = pfq_get_sock_tstamp_batch_count() != 0;
+	if (batch_tstamp)
+		now = ktime_get_real();
+
+        /* setup all the skbs collected */
+
+	for_each_skbuff(SKBUFF_BATCH_ADDR(gcollector->pool), skb, n)
+        {
+		/* the group mask is set by pfq_receive */
+
+		group_mask |= PFQ_CB(skb)->group_mask;
+
+		PFQ_CB(skb)->monad = &monad;
+
+		if (batch_tstamp && skb->tstamp.tv64 == 0)
+			skb->tstamp = now;
 
+		local->bpf_verdict[n].bpf = NULL;
+
+		/* start the prefetch pipeline */
+
+		if (n < prefetch_distance)
+			prefetch(skb->data);
+	}
+
+#ifdef PFQ_RX_PROFILE
+	setup = get_cycles();
+	copy  = local->rx_prof.copy;
+#endif
+
+        /* process all groups enabled for this batch of packets: group programs,
+         * filters and socket queues are RCU protected */
+
+	rcu_read_lock();
+
+	if (rx_engine == Q_RX_ENGINE_PACKET)
+		pfq_dispatch_by_packet(local, this_batch_len, &monad, cpu);
+	else
+		pfq_dispatch_by_group(local, group_mask, this_batch_len, &monad, cpu);
+
+	rcu_read_unlock();
+
+#ifdef PFQ_RX_PROFILE
+	dispatch = get_cycles();
+#endif
 
 	/* forward skbs to kernel */
 
@@ -521,17 +721,204 @@ pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
 
 	gc_reset(gcollector);
 
-	put_cpu();
-
 #ifdef PFQ_RX_PROFILE
 	stop = get_cycles();
 
-	if (printk_ratelimit())
-		printk(KERN_INFO "[PFQ] Rx profile: %llu_tsc.\n", (stop-start)/batch_len);
+	local->rx_prof.setup   += setup - start;
+	local->rx_prof.eval    += (dispatch - setup) - (local->rx_prof.copy - copy);
+	local->rx_prof.fwd     += stop - dispatch;
+	local->rx_prof.packets += this_batch_len;
+
+	if (printk_ratelimit()) {
+		size_t packets = local->rx_prof.packets;
+
+		printk(KERN_INFO "[PFQ] Rx profile (tsc/pkt): setup=%llu eval=%llu copy=%llu fwd=%llu (prefetch_distance=%d)\n",
+		       (unsigned long long)local->rx_prof.setup/packets,
+		       (unsigned long long)local->rx_prof.eval/packets,
+		       (unsigned long long)local->rx_prof.copy/packets,
+		       (unsigned long long)local->rx_prof.fwd/packets, prefetch_distance);
+
+		memset(&local->rx_prof, 0, sizeof(local->rx_prof));
+	}
 #endif
+}
+
+
+/* enqueue a packet (data at the mac header) into the GC of this cpu, and process the batch */
+
+static int
+pfq_receive_enqueue(struct sk_buff *skb, int direct, unsigned long group_mask)
+{
+	struct local_data * local;
+        struct gc_data *gcollector;
+	struct gc_buff buff;
+        int cpu;
+
+	/* get garbage collector */
+
+	cpu = get_cpu();
+	local = per_cpu_ptr(cpu_data, cpu);
+
+	gcollector = &local->gc;
+
+	/* set the ownership of this skb to the garbage collector */
+
+	buff = gc_make_buff(gcollector, skb);
+	if (buff.skb == NULL) {
+		if (printk_ratelimit())
+			printk(KERN_INFO "[PFQ] GC: memory exhausted!\n");
+		__sparse_inc(&global_stats.lost, cpu);
+		pfq_kfree_skb_pool(skb, &local->rx_pool);
+        	put_cpu();
+		return 0;
+	}
+
+        PFQ_CB(buff.skb)->direct     = direct;
+        PFQ_CB(buff.skb)->group_mask = group_mask;
+
+	/* without a timestamp the hold time is bounded by the flush timer only */
+
+        if ((gc_size(gcollector) < batch_len) &&
+            (buff.skb->tstamp.tv64 == 0 ||
+             ktime_to_ns(ktime_sub(skb_get_ktime(buff.skb), local->last_ts)) < flush_timeout * 1000LL) )
+        {
+		/* bound the hold time when no other packet follows (see pfq_receive_flush) */
+
+		if (!hrtimer_active(&local->flush_timer))
+			hrtimer_start(&local->flush_timer, ns_to_ktime(flush_timeout * 1000LL), HRTIMER_MODE_REL_PINNED);
+
+        	put_cpu();
+                return 0;
+	}
+
+	local->last_ts = skb_get_ktime(buff.skb);
+
+	pfq_receive_batch(local, cpu);
+
+	put_cpu();
         return 0;
 }
 
+
+/*
+ * Software segmentation of an aggregate (data at the mac header): each segment
+ * is captured as the packet seen on the wire. On failure the aggregate is kept.
+ */
+
+static int
+pfq_receive_segments(struct sk_buff *skb, int direct, unsigned long group_mask)
+{
+	struct sk_buff *segs;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+	segs = __skb_gso_segment(skb, 0, false);
+#else
+	segs = skb_gso_segment(skb, 0);
+#endif
+	if (IS_ERR_OR_NULL(segs)) {
+		if (IS_ERR(segs) && printk_ratelimit())
+			printk(KERN_INFO "[PFQ] gro_split: skb_gso_segment error (%ld)!\n", PTR_ERR(segs));
+		return pfq_receive_enqueue(skb, direct, group_mask);
+	}
+
+	consume_skb(skb);
+
+	while (segs)
+	{
+		struct sk_buff *next = segs->next;
+
+		segs->next = NULL;
+		pfq_receive_enqueue(segs, direct, group_mask);
+		segs = next;
+	}
+
+	return 0;
+}
+
+
+static int
+pfq_receive(struct napi_struct *napi, struct sk_buff * skb, int direct)
+{
+        unsigned long group_mask;
+
+	/* if no socket is open drop the packet */
+
+        if (pfq_get_sock_count() == 0) {
+        	kfree_skb(skb);
+               	return 0;
+	}
+
+	/* if no group listens to this device/queue drop the packet, before any work */
+
+	if (!__pfq_devmap_monitor_get(skb->dev->ifindex)) {
+		sparse_inc(&global_stats.drop);
+        	kfree_skb(skb);
+               	return 0;
+	}
+
+	group_mask = __pfq_devmap_get_groups(skb->dev->ifindex, skb_get_rx_queue(skb));
+	if (group_mask == 0) {
+		sparse_inc(&global_stats.drop);
+        	kfree_skb(skb);
+               	return 0;
+	}
+
+	/* if required by some socket, timestamp the packet now */
+
+        if (skb->tstamp.tv64 == 0 && pfq_get_sock_tstamp_count())
+                __net_timestamp(skb);
+
+        /* if vlan header is present, remove it */
+
+        if (vl_untag && skb->protocol == cpu_to_be16(ETH_P_8021Q)) {
+                skb = pfq_vlan_untag(skb);
+                if (unlikely(!skb)) {
+			sparse_inc(&global_stats.lost);
+                        return -1;
+		}
+        }
+
+        skb_reset_mac_len(skb);
+
+        /* push the mac header: reset skb->data to the beginning of the packet */
+
+        if (likely(skb->pkt_type != PACKET_OUTGOING)) {
+            skb_push(skb, skb->mac_len);
+        }
+
+	/* split GRO/TSO aggregates back into their wire segments */
+
+	if (gro_split && skb_is_gso(skb))
+		return pfq_receive_segments(skb, direct, group_mask);
+
+	return pfq_receive_enqueue(skb, direct, group_mask);
+}
+
+
+/*
+ * Process the packets held by the GC of this cpu, if any. Called at the end
+ * of a NAPI poll (pfq_napi_complete) and by the per-cpu flush timer, so that
+ * the tail of a burst is never held longer than flush_timeout.
+ */
+
+void
+pfq_receive_flush(void)
+{
+	struct local_data * local;
+	int cpu;
+
+	cpu = get_cpu();
+	local = per_cpu_ptr(cpu_data, cpu);
+
+	if (gc_size(&local->gc)) {
+		local->last_ts = ktime_get_real();
+		pfq_receive_batch(local, cpu);
+	}
+
+	put_cpu();
+}
+
+
 /* simple packet HANDLER */
 
 static int
@@ -648,6 +1035,10 @@ pfq_create(
 
         so->shmem.hugepages = NULL;
         so->shmem.npages = 0;
+        so->shmem.node = NUMA_NO_NODE;
+
+        so->shmem_node = Q_NODE_ANY;
+        so->shmem_hugepages = Q_HUGEPAGES_AUTO;
 
         down(&sock_sem);
 
@@ -700,8 +1091,14 @@ pfq_release(struct socket *sock)
         pfq_leave_all_groups(so->id);
         pfq_release_sock_id(so->id);
 
+        pfq_sock_tstamp_update(xchg(&so->rx_opt.tstamp, Q_TSTAMP_OFF), Q_TSTAMP_OFF);
+
+        /* wait for the Rx readers still referring to this socket */
+
         if (so->shmem.addr)
                 pfq_shared_queue_disable(so);
+        else
+                synchronize_rcu();
 
         down(&sock_sem);
 
@@ -740,12 +1137,12 @@ pfq_poll(struct file *file, struct socket *sock, poll_table * wait)
 
 	poll_wait(file, &so->rx_opt.waitqueue, wait);
 
-        if(!pfq_get_rx_queue(&so->rx_opt))
-                return mask;
+        rcu_read_lock();
 
-        if (pfq_mpsc_queue_len(so) > 0)
+        if (pfq_get_rx_queue(&so->rx_opt) && pfq_mpsc_queue_len(so) > 0)
                 mask |= POLLIN | POLLRDNORM;
 
+        rcu_read_unlock();
         return mask;
 }
 
@@ -872,6 +1269,26 @@ static int __init pfq_init_module(void)
                 return -EFAULT;
         }
 
+        if (flush_timeout < 0 || flush_timeout > 1000000) {
+                printk(KERN_INFO "[PFQ] flush_timeout=%d not allowed: valid range [0,1000000]!\n", flush_timeout);
+                return -EFAULT;
+        }
+
+        if (rx_engine != Q_RX_ENGINE_GROUP && rx_engine != Q_RX_ENGINE_PACKET) {
+                printk(KERN_INFO "[PFQ] rx_engine=%d not allowed: valid values 0 (group-major), 1 (packet-major)!\n", rx_engine);
+                return -EFAULT;
+        }
+
+        if (prefetch_distance < 0 || prefetch_distance > Q_SKBUFF_SHORT_BATCH) {
+                printk(KERN_INFO "[PFQ] prefetch_distance=%d not allowed: valid range [0,%zu]!\n", prefetch_distance, Q_SKBUFF_SHORT_BATCH);
+                return -EFAULT;
+        }
+
+        if (tx_spin_usec < 0 || tx_spin_usec > 1000000) {
+                printk(KERN_INFO "[PFQ] tx_spin_usec=%d not allowed: valid range [0,1000000]!\n", tx_spin_usec);
+                return -EFAULT;
+        }
+
 	if (skb_pool_size > PFQ_SK_BUFF_LIST_SIZE) {
                 printk(KERN_INFO "[PFQ] skb_pool_size=%d not allowed: valid range [0,%d]!\n", skb_pool_size, PFQ_SK_BUFF_LIST_SIZE);
 		return -EFAULT;
@@ -934,6 +1351,12 @@ static void __exit pfq_exit_module(void)
         /* wait grace period */
         msleep(Q_GRACE_PERIOD);
 
+        /* release the group programs and filters retired */
+        pfq_group_barrier();
+
+        /* stop the per-cpu flush timers */
+        pfq_percpu_fini();
+
         /* purge both GC and recycles queues */
         total += pfq_percpu_flush();
 
@@ -972,7 +1395,9 @@ int pfq_normalize_skb(struct sk_buff *skb)
 	skb_reset_transport_header(skb);
 
 #ifdef PFQ_USE_SKB_LINEARIZE
-	if(skb_linearize(skb) < 0) {
+	/* GRO aggregates are not linearized: their frags are copied straight into the slots */
+
+	if(!skb_is_gso(skb) && skb_linearize(skb) < 0) {
 		__kfree_skb(skb);
 		return -1;
 	}
@@ -1013,6 +1438,42 @@ pfq_netif_rx(struct sk_buff *skb)
 }
 
 
+/* end of a NAPI poll: flush the batch of this cpu */
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0))
+bool
+pfq_napi_complete(struct napi_struct *napi)
+{
+	pfq_receive_flush();
+	return napi_complete(napi);
+}
+#else
+void
+pfq_napi_complete(struct napi_struct *napi)
+{
+	pfq_receive_flush();
+	napi_complete(napi);
+}
+#endif
+
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0))
+bool
+pfq_napi_complete_done(struct napi_struct *napi, int work_done)
+{
+	pfq_receive_flush();
+	return napi_complete_done(napi, work_done);
+}
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0))
+void
+pfq_napi_complete_done(struct napi_struct *napi, int work_done)
+{
+	pfq_receive_flush();
+	napi_complete_done(napi, work_done);
+}
+#endif
+
+
 static gro_result_t
 pfq_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
@@ -1032,6 +1493,10 @@ pfq_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 EXPORT_SYMBOL_GPL(pfq_netif_rx);
 EXPORT_SYMBOL_GPL(pfq_netif_receive_skb);
 EXPORT_SYMBOL_GPL(pfq_gro_receive);
+EXPORT_SYMBOL_GPL(pfq_napi_complete);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0))
+EXPORT_SYMBOL_GPL(pfq_napi_complete_done);
+#endif
 
 EXPORT_SYMBOL_GPL(pfq_symtable_register_functions);
 EXPORT_SYMBOL_GPL(pfq_symtable_unregister_functions);
@@ -39,6 +39,7 @@
 
 #include <tuple>
 #include <memory>
+#include <array>
 #include <vector>
 #include <type_traits>
 #include <algorithm>
@@ -134,6 +135,35 @@ namespace pfq {
 
     //////////////////////////////////////////////////////////////////////
 
+    //! Wait strategy used by read() when the Rx queue is empty.
+    /*!
+     * The reader spins (pause) for the spin interval, then yields the cpu for the
+     * yield interval and eventually, if block is set, sleeps in ppoll for the rest
+     * of the timeout. The default strategy returns immediately.
+     */
+
+    struct wait_strategy
+    {
+        std::chrono::nanoseconds spin;
+        std::chrono::nanoseconds yield;
+        bool block;
+    };
+
+    //! Time spent in each phase of the wait strategy, and the number of waits ended there.
+
+    struct wait_stats
+    {
+        std::chrono::nanoseconds spin_time;
+        std::chrono::nanoseconds yield_time;
+        std::chrono::nanoseconds block_time;
+
+        size_t spin;
+        size_t yield;
+        size_t block;
+    };
+
+    //////////////////////////////////////////////////////////////////////
+
     //! PFQ: the socket
     /*!
      * This class is the main interface to the PFQ kernel module.
@@ -150,6 +180,7 @@ namespace pfq {
 
             void * shm_addr;
             size_t shm_size;
+            int    shm_hugepages;
 
             void * tx_queue_addr;
             size_t tx_queue_size;
@@ -159,6 +190,11 @@ namespace pfq {
 
             size_t rx_slots;
             size_t rx_slot_size;
+            size_t rx_rings;
+            bool   rx_varlen;
+            int    rx_mode;
+            bool   rx_batch_commit;
+            int    rx_layout;
 
             size_t tx_slots;
             size_t tx_slot_size;
@@ -167,6 +203,12 @@ namespace pfq {
             size_t tx_num_bind;
 
             bool   tx_async;
+
+            std::array<queue::ring, Q_MAX_RX_RINGS> rx_ring;
+            std::array<size_t, Q_MAX_RX_RINGS> rx_pending;
+
+            pfq::wait_strategy rx_wait;
+            pfq::wait_stats rx_wait_stats;
         };
 
         int fd_;
@@ -388,6 +430,156 @@ namespace pfq {
 
     private:
 
+        //! Return the producer index of a continuous ring (the published one, with batch commit).
+
+        unsigned long long
+        ring_head(size_t ring) const
+        {
+            auto q = static_cast<struct pfq_shared_queue *>(data_->shm_addr);
+            return data_->rx_batch_commit ? q->rx[ring].commit : q->rx[ring].data;
+        }
+
+        //! Return the number of packets not yet returned by read.
+
+        size_t
+        rx_available() const
+        {
+            auto q = static_cast<struct pfq_shared_queue *>(data_->shm_addr);
+            size_t len = 0;
+
+            for(size_t n = 0; n < data_->rx_rings; n++)
+                len += data_->rx_mode == Q_RX_MODE_CONTINUOUS ? static_cast<size_t>(ring_head(n) - q->rx[n].cons) - data_->rx_pending[n]
+                                                               : Q_SHARED_QUEUE_LEN(q->rx[n].data);
+            return len;
+        }
+
+        //! Spin (or yield) until packets are available or the end of the phase.
+
+        bool
+        wait_phase(std::chrono::steady_clock::time_point &now, std::chrono::steady_clock::time_point end, bool yield) const
+        {
+            while (now < end)
+            {
+                if (rx_available())
+                    return true;
+
+                if (yield)
+                    std::this_thread::yield();
+                else
+                    pfq_cpu_relax();
+
+                now = std::chrono::steady_clock::now();
+            }
+            return false;
+        }
+
+        //! Wait for packets according to the wait strategy (timeout in microseconds, -1 -> infinite).
+
+        void
+        wait(long int microseconds)
+        {
+            using namespace std::chrono;
+
+            auto const & ws = data_->rx_wait;
+            auto & stats = data_->rx_wait_stats;
+
+            if (microseconds == 0)
+                return;
+
+            auto timeout = microseconds < 0 ? nanoseconds::max() : duration_cast<nanoseconds>(std::chrono::microseconds(microseconds));
+            auto start = steady_clock::now(), mark = start, now = start;
+
+            if (ws.spin.count() > 0) {
+                bool ready = wait_phase(now, start + std::min(timeout, ws.spin), false);
+                stats.spin_time += duration_cast<nanoseconds>(now - mark);
+                if (ready) {
+                    stats.spin++;
+                    return;
+                }
+                mark = now;
+            }
+
+            if (ws.yield.count() > 0) {
+                bool ready = wait_phase(now, start + std::min(timeout, ws.spin + ws.yield), true);
+                stats.yield_time += duration_cast<nanoseconds>(now - mark);
+                if (ready) {
+                    stats.yield++;
+                    return;
+                }
+                mark = now;
+            }
+
+            if (ws.block && now - start < timeout) {
+                this->poll(microseconds < 0 ? -1 : static_cast<long int>(duration_cast<std::chrono::microseconds>(timeout - (now - start)).count()));
+                stats.block_time += duration_cast<nanoseconds>(steady_clock::now() - mark);
+                stats.block++;
+            }
+        }
+
+        //! Swap the double buffer of the given Rx ring and return its queue descriptor.
+
+        queue
+        read_ring(size_t ring, size_t index)
+        {
+            auto q = static_cast<struct pfq_shared_queue *>(data_->shm_addr);
+
+            if (data_->rx_mode == Q_RX_MODE_CONTINUOUS)
+            {
+                auto capacity = data_->rx_slots * 2;
+
+                // release the slots returned by the previous read...
+
+                auto cons = q->rx[ring].cons + data_->rx_pending[ring];
+
+                smp_mb();
+
+                q->rx[ring].cons = cons;
+
+                // return the contiguous slots available up to the end of the ring
+
+                auto pos = static_cast<size_t>(cons % capacity);
+                auto len = std::min(static_cast<size_t>(ring_head(ring) - cons), capacity - pos);
+
+                smp_rmb();
+
+                data_->rx_pending[ring] = len;
+
+                return fixed_queue(static_cast<char *>(data_->rx_queue_addr) + ring * 2 * data_->rx_queue_size,
+                                   capacity, pos, len, (cons / capacity + 1) & 0xff);
+            }
+
+            // reset the next buffer...
+
+            auto data = __sync_lock_test_and_set(&q->rx[ring].data, Q_SHARED_QUEUE_DATA(index+1, 0, 0));
+
+            auto addr = static_cast<char *>(data_->rx_queue_addr) + (ring * 2 + (index & 1)) * data_->rx_queue_size;
+
+            // with variable-length slots the kernel never overshoots the queue
+
+            if (data_->rx_varlen)
+                return queue(addr, 0, Q_SHARED_QUEUE_LEN(data), index, Q_SHARED_QUEUE_OFF(data));
+
+            auto queue_len = std::min(static_cast<size_t>(Q_SHARED_QUEUE_LEN(data)), data_->rx_slots);
+
+            return fixed_queue(addr, data_->rx_slots, 0, queue_len, index);
+        }
+
+        //! Return the queue of fixed-size slots starting at the given position of a region of slots.
+
+        queue
+        fixed_queue(char *region, size_t slots, size_t pos, size_t len, size_t index) const
+        {
+            if (data_->rx_layout == Q_RX_LAYOUT_SPLIT)
+            {
+                auto payload_size = data_->rx_slot_size - sizeof(pfq_pkthdr);
+
+                return queue(region + pos * sizeof(pfq_pkthdr), len, index,
+                             region + slots * sizeof(pfq_pkthdr) + pos * payload_size, payload_size);
+            }
+
+            return queue(region + pos * data_->rx_slot_size, data_->rx_slot_size, len, index);
+        }
+
         pfq_data * data()
         {
             if (data_)
@@ -418,17 +610,27 @@ namespace pfq {
                                         -1,
                                         nullptr,
                                         0,
+                                        Q_HUGEPAGES_AUTO,
                                         nullptr,
                                         0,
                                         nullptr,
                                         0,
                                         0,
                                         0,
+                                        1,
+                                        false,
+                                        Q_RX_MODE_DOUBLE_BUFFER,
+                                        false,
+                                        Q_RX_LAYOUT_INLINE,
                                         0,
                                         0,
                                         0,
                                         0,
-                                        true
+                                        true,
+                                        {},
+                                        {},
+                                        {},
+                                        {}
                                      });
 
             // get id
@@ -512,7 +714,10 @@ namespace pfq {
             if (::getsockopt(fd_, PF_Q, Q_SO_GET_SHMEM_SIZE, &tot_mem, &size) == -1)
                 throw pfq_error(errno, "PFQ: queue memory error");
 
-            hd_ = ::open(("/dev/hugepages/pfq." + std::to_string(fd_)).c_str(),  O_CREAT | O_RDWR, 0755);
+            // hugetlbfs is not used when kernel hugepages are required
+
+            hd_ = data()->shm_hugepages == Q_HUGEPAGES_REQUIRE ? -1 :
+                    ::open(("/dev/hugepages/pfq." + std::to_string(fd_)).c_str(),  O_CREAT | O_RDWR, 0755);
             if (hd_ != -1)
                 data()->shm_addr = ::mmap(nullptr, tot_mem, PROT_READ|PROT_WRITE, MAP_SHARED, hd_, 0);
 
@@ -539,11 +744,13 @@ namespace pfq {
 
             data()->shm_size = tot_mem;
 
-            data()->rx_queue_addr = static_cast<char *>(data()->shm_addr) + sizeof(pfq_shared_queue);
+            data()->rx_queue_addr = static_cast<char *>(data()->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(data()->rx_rings);
             data()->rx_queue_size = data()->rx_slots * data()->rx_slot_size;
 
-            data()->tx_queue_addr = static_cast<char *>(data()->shm_addr) + sizeof(pfq_shared_queue) + data()->rx_queue_size * 2;
+            data()->tx_queue_addr = static_cast<char *>(data()->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(data()->rx_rings) + data()->rx_queue_size * 2 * data()->rx_rings;
             data()->tx_queue_size = data()->tx_slots * data()->tx_slot_size;
+
+            data()->rx_pending.fill(0);
         }
 
         //! Disable the socket.
@@ -610,6 +817,308 @@ namespace pfq {
            return ret;
         }
 
+        //! Set the timestamp source of the packets.
+        /*!
+         * Q_TSTAMP_OFF: no timestamp (the kernel does not read the clock).
+         * Q_TSTAMP_SOFTWARE: kernel time on receive.
+         * Q_TSTAMP_HARDWARE: raw hardware stamp of the device, 0 if not available.
+         * Q_TSTAMP_BATCH: kernel time read once per batch (see timestamp_error).
+         */
+
+        void
+        timestamp_source(int source)
+        {
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_TSTAMP, &source, sizeof(source)) == -1)
+                throw pfq_error(errno, "PFQ: set timestamp source");
+        }
+
+        //! Return the timestamp source of the packets.
+
+        int
+        timestamp_source() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_TSTAMP, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get timestamp source");
+           return ret;
+        }
+
+        //! Return the worst-case error of the timestamps, in usec.
+        /*!
+         * Non-zero for Q_TSTAMP_BATCH when packets are batched: the max hold
+         * time of a batch (flush_timeout module parameter).
+         */
+
+        int
+        timestamp_error() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_TSTAMP_ERROR, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get timestamp error");
+           return ret;
+        }
+
+        //! Enable variable-length slots for the Rx queue.
+        /*!
+         * Each slot takes sizeof(pfq_pkthdr) + align<8>(caplen) bytes, where caplen is
+         * the actual number of bytes captured. Must be set before the socket is enabled.
+         */
+
+        void
+        varlen_enable(bool value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (varlen could not be set)");
+
+            int varlen = value ? Q_SLOTS_VARLEN : Q_SLOTS_FIXED;
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_VARLEN, &varlen, sizeof(varlen)) == -1)
+                throw pfq_error(errno, "PFQ: set varlen mode");
+
+            data()->rx_varlen = value;
+        }
+
+        //! Check whether variable-length slots are enabled.
+
+        bool
+        varlen_enabled() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_VARLEN, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get varlen mode");
+           return ret;
+        }
+
+        //! Specify the Rx queue mode.
+        /*!
+         * Q_RX_MODE_DOUBLE_BUFFER (default): each read swaps the halves of a double buffer.
+         * Q_RX_MODE_CONTINUOUS: the whole memory is a single ring with producer/consumer indices;
+         * each read releases the packets returned by the previous one.
+         * Must be set before the socket is enabled.
+         */
+
+        void
+        rx_mode(int mode)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (Rx mode could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_MODE, &mode, sizeof(mode)) == -1)
+                throw pfq_error(errno, "PFQ: set Rx mode");
+
+            data()->rx_mode = mode;
+        }
+
+        //! Return the Rx queue mode.
+
+        int
+        rx_mode() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_MODE, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Rx mode");
+           return ret;
+        }
+
+        //! Specify the layout of the Rx slots.
+        /*!
+         * Q_RX_LAYOUT_INLINE (default): each header is followed by its payload.
+         * Q_RX_LAYOUT_SPLIT: a dense array of headers followed by the payload arena;
+         * see queue::headers() and queue::payload(). Not compatible with variable-length
+         * slots nor with recv(). Must be set before the socket is enabled.
+         */
+
+        void
+        rx_layout(int layout)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (Rx layout could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_LAYOUT, &layout, sizeof(layout)) == -1)
+                throw pfq_error(errno, "PFQ: set Rx layout");
+
+            data()->rx_layout = layout;
+        }
+
+        //! Return the layout of the Rx slots.
+
+        int
+        rx_layout() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_LAYOUT, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Rx layout");
+           return ret;
+        }
+
+        //! Specify the NUMA node of the socket queues memory.
+        /*!
+         * Q_NODE_ANY (default): no preference.
+         * Q_NODE_DEVICE: the node of the device bound to the socket, resolved at enable().
+         * Otherwise the id of an online node. Must be set before the socket is enabled.
+         */
+
+        void
+        shmem_node(int node)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (shmem node could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_SHMEM_NODE, &node, sizeof(node)) == -1)
+                throw pfq_error(errno, "PFQ: set shmem node");
+        }
+
+        //! Specify the hugepages policy of the socket queues memory.
+        /*!
+         * Q_HUGEPAGES_AUTO (default): hugetlbfs pages when available, otherwise
+         * hugepages allocated by the kernel, otherwise 4K pages.
+         * Q_HUGEPAGES_OFF: hugetlbfs pages when available, otherwise 4K pages.
+         * Q_HUGEPAGES_REQUIRE: hugepages allocated by the kernel; enable() fails otherwise.
+         */
+
+        void
+        shmem_hugepages(int policy)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (shmem hugepages could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_SHMEM_HUGEPAGES, &policy, sizeof(policy)) == -1)
+                throw pfq_error(errno, "PFQ: set shmem hugepages");
+
+            data()->shm_hugepages = policy;
+        }
+
+        //! Return the hugepages policy of the socket queues memory.
+
+        int
+        shmem_hugepages() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_SHMEM_HUGEPAGES, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get shmem hugepages");
+           return ret;
+        }
+
+        //! Return the NUMA node of the socket queues memory.
+        /*!
+         * The actual node once enabled (-1 if not node-bound), the requested one otherwise.
+         */
+
+        int
+        shmem_node() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_SHMEM_NODE, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get shmem node");
+           return ret;
+        }
+
+        //! Enable the batch commit of the Rx queue.
+        /*!
+         * The kernel publishes each burst with a single store of the producer index,
+         * and read() returns only the published packets: they are all ready, with
+         * no need to wait on the commit of each slot. It requires the continuous Rx mode
+         * and must be set before the socket is enabled.
+         */
+
+        void
+        batch_commit_enable(bool value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (batch commit could not be set)");
+
+            int batch_commit = value;
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_BATCH_COMMIT, &batch_commit, sizeof(batch_commit)) == -1)
+                throw pfq_error(errno, "PFQ: set batch commit");
+
+            data()->rx_batch_commit = value;
+        }
+
+        //! Check whether the batch commit of the Rx queue is enabled.
+
+        bool
+        batch_commit_enabled() const
+        {
+           int ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_BATCH_COMMIT, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get batch commit");
+           return ret;
+        }
+
+        //! Specify the Rx wakeup watermark, in packets.
+        /*!
+         * A reader blocked in poll is woken up when the queue holds at least
+         * this number of packets (default 1). It can be changed at run-time.
+         */
+
+        void
+        rx_wakeup_watermark(size_t value)
+        {
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_WAKEUP_WATERMARK, &value, sizeof(value)) == -1)
+                throw pfq_error(errno, "PFQ: set Rx wakeup watermark");
+        }
+
+        //! Return the Rx wakeup watermark.
+
+        size_t
+        rx_wakeup_watermark() const
+        {
+           size_t ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_WAKEUP_WATERMARK, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Rx wakeup watermark");
+           return ret;
+        }
+
+        //! Specify the max latency of the Rx wakeup.
+        /*!
+         * Below the watermark, the reader is woken up at most after the given
+         * time since the first pending packet. A zero duration disables the timer (default).
+         */
+
+        template <typename Rep, typename Period>
+        void
+        rx_wakeup_timeout(std::chrono::duration<Rep, Period> timeout)
+        {
+            unsigned int usec = static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_WAKEUP_TIMEOUT, &usec, sizeof(usec)) == -1)
+                throw pfq_error(errno, "PFQ: set Rx wakeup timeout");
+        }
+
+        //! Return the max latency of the Rx wakeup.
+
+        std::chrono::microseconds
+        rx_wakeup_timeout() const
+        {
+           unsigned int ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_WAKEUP_TIMEOUT, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Rx wakeup timeout");
+           return std::chrono::microseconds(ret);
+        }
+
+        //! Enable the Rx busy-poll mode.
+        /*!
+         * The kernel never wakes up the reader: the application is expected to
+         * spin on the queue (e.g. read with a zero timeout).
+         */
+
+        void
+        rx_busy_poll_enable(bool value)
+        {
+            int busy_poll = value;
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_WAKEUP_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1)
+                throw pfq_error(errno, "PFQ: set Rx busy-poll mode");
+        }
+
+        //! Check whether the Rx busy-poll mode is enabled.
+
+        bool
+        rx_busy_poll_enabled() const
+        {
+           int ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_RX_WAKEUP_BUSY_POLL, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Rx busy-poll mode");
+           return ret;
+        }
+
         //! Specify the capture length of packets, in bytes.
         /*!
          * Capture length must be set before the socket is enabled to capture.
@@ -677,6 +1186,34 @@ namespace pfq {
             return data()->rx_slots;
         }
 
+        //! Specify the number of Rx rings.
+        /*!
+         * Each ring is fed by the CPUs with index modulo the number of rings, so that
+         * with as many rings as producing CPUs no contention occurs among them.
+         * Each ring has rx_slots() slots.
+         */
+
+        void
+        rx_rings(size_t value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (Rx rings could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RX_RINGS, &value, sizeof(value)) == -1) {
+                throw pfq_error(errno, "PFQ: set Rx rings error");
+            }
+
+            data()->rx_rings = value;
+        }
+
+        //! Return the number of Rx rings.
+
+        size_t
+        rx_rings() const
+        {
+            return data()->rx_rings;
+        }
+
         //! Return the length of a Rx slot, in bytes.
 
         size_t
@@ -859,6 +1396,70 @@ namespace pfq {
             data()->tx_num_bind = 0;
         }
 
+        //! Return the number of Tx queues the socket is bound to.
+
+        int
+        tx_queues() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_TX_QUEUES, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Tx queues");
+           return ret;
+        }
+
+        //! Enable zero-copy transmission.
+        /*!
+         * The payload of the frames is attached to the skbs as pages of the Tx queue.
+         * A half of the Tx queue is given back for writing only when its frames are sent.
+         * The socket must be disabled.
+         */
+
+        void
+        tx_zerocopy_enable(bool value)
+        {
+            int zerocopy = value ? 1 : 0;
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_TX_ZEROCOPY, &zerocopy, sizeof(zerocopy)) == -1)
+                throw pfq_error(errno, "PFQ: set Tx zero-copy");
+        }
+
+        //! Check whether zero-copy transmission is enabled.
+
+        bool
+        tx_zerocopy_enabled() const
+        {
+           int ret; socklen_t size = sizeof(int);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_TX_ZEROCOPY, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Tx zero-copy");
+           return ret;
+        }
+
+        //! Shape a Tx queue with a token bucket.
+        /*!
+         * Packets leave the queue at most at pps packets and bps bits per second
+         * (frame bytes, 0 = unlimited), with up to burst packets back-to-back.
+         * Any queue (-1) shapes all the Tx queues of the socket.
+         */
+
+        void
+        tx_rate(int queue, uint64_t pps, uint64_t bps = 0, unsigned int burst = 1)
+        {
+            struct pfq_tx_rate rate = { queue, burst, pps, bps };
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_TX_RATE, &rate, sizeof(rate)) == -1)
+                throw pfq_error(errno, "PFQ: set Tx rate");
+        }
+
+        //! Return the token-bucket parameters of a Tx queue.
+
+        pfq_tx_rate
+        tx_rate(int queue) const
+        {
+            struct pfq_tx_rate rate = { queue, 0, 0, 0 };
+            socklen_t size = sizeof(rate);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_TX_RATE, &rate, &size) == -1)
+                throw pfq_error(errno, "PFQ: get Tx rate");
+            return rate;
+        }
+
 
         //! Return the mask of the joined groups.
         /*!
@@ -1061,11 +1662,41 @@ namespace pfq {
             return 0;
         }
 
+        //! Specify the wait strategy used by read() when the Rx queue is empty.
+
+        void
+        rx_wait_strategy(pfq::wait_strategy const &ws)
+        {
+            if (ws.spin.count() < 0 || ws.yield.count() < 0)
+                throw pfq_error("PFQ: invalid wait strategy");
+
+            data()->rx_wait = ws;
+        }
+
+        //! Return the wait strategy used by read().
+
+        pfq::wait_strategy
+        rx_wait_strategy() const
+        {
+            return data()->rx_wait;
+        }
+
+        //! Return the time spent by read() in each phase of the wait strategy.
+
+        pfq::wait_stats
+        rx_wait_stats() const
+        {
+            return data()->rx_wait_stats;
+        }
+
         //! Read packets in place.
         /*!
-         * Wait for packets and return a queue descriptor.
+         * Wait for packets (according to the wait strategy) and return a queue descriptor.
          * Packets are stored in the memory mapped queue of the socket.
          * The timeout is specified in microseconds.
+         *
+         * With multiple Rx rings, the returned queue merges the non-empty rings;
+         * it remains valid until the next read.
          */
 
         queue
@@ -1076,25 +1707,33 @@ namespace pfq {
 
             auto q = static_cast<struct pfq_shared_queue *>(data()->shm_addr);
 
-            size_t data = q->rx.data;
-            size_t index = Q_SHARED_QUEUE_INDEX(data);
+            size_t index = Q_SHARED_QUEUE_INDEX(q->rx[0].data);
 
-            if( Q_SHARED_QUEUE_LEN(data) == 0 ) {
-#ifdef PFQ_USE_POLL
-                this->poll(microseconds);
-#else
-                (void)microseconds;
-#endif
-            }
+            if (rx_available() == 0)
+                this->wait(microseconds);
 
-            // reset the next buffer...
+            if (data_->rx_rings == 1)
+                return read_ring(0, index);
 
-            data = __sync_lock_test_and_set(&q->rx.data, (unsigned int)((index+1) << 24));
+            // merge the non-empty rings
 
-            auto queue_len = std::min(static_cast<size_t>(Q_SHARED_QUEUE_LEN(data)), data_->rx_slots);
+            auto first = data_->rx_ring.data(), last = first;
 
-            return queue(static_cast<char *>(data_->rx_queue_addr) + (index & 1) * data_->rx_queue_size,
-                         data_->rx_slot_size, queue_len, index);
+            for(size_t n = 0; n < data_->rx_rings; n++)
+            {
+                auto ring = read_ring(n, index);
+                if (ring.empty())
+                    continue;
+
+                *last++ = queue::ring { static_cast<pfq_pkthdr *>(const_cast<void *>(ring.data())),
+                                        reinterpret_cast<pfq_pkthdr *>(static_cast<char *>(const_cast<void *>(ring.data())) + ring.data_size()),
+                                        ring.size(),
+                                        ring.index(),
+                                        const_cast<char *>(ring.payload()) };
+            }
+
+            return queue(first, last, data_->rx_varlen ? 0 : data_->rx_layout == Q_RX_LAYOUT_SPLIT ? sizeof(pfq_pkthdr) : data_->rx_slot_size,
+                                      data_->rx_layout == Q_RX_LAYOUT_SPLIT ? data_->rx_slot_size - sizeof(pfq_pkthdr) : 0);
         }
 
         //! Return the current commit version (used internally by the memory mapped queue).
@@ -1103,7 +1742,7 @@ namespace pfq {
         current_commit() const
         {
             auto q = static_cast<struct pfq_shared_queue *>(data_->shm_addr);
-            return Q_SHARED_QUEUE_INDEX(q->rx.data);
+            return Q_SHARED_QUEUE_INDEX(q->rx[0].data);
         }
 
         //! Receive packets in the given mutable buffer.
@@ -1119,13 +1758,29 @@ namespace pfq {
             if (fd_ == -1)
                 throw pfq_error("PFQ: socket not open");
 
+            if (data_->rx_layout == Q_RX_LAYOUT_SPLIT)
+                throw pfq_error("PFQ: recv: not supported with the header-split layout");
+
             auto this_queue = this->read(microseconds);
 
-            if (buff.second < data_->rx_slots * data_->rx_slot_size)
+            if (buff.second < data_->rx_slots * data_->rx_slot_size * data_->rx_rings)
                 throw pfq_error("PFQ: buffer too small");
 
-            memcpy(buff.first, this_queue.data(), this_queue.slot_size() * this_queue.size());
-            return queue(buff.first, this_queue.slot_size(), this_queue.size(), this_queue.index());
+            if (this_queue.rings() == 0)
+                memcpy(buff.first, this_queue.data(), this_queue.data_size());
+
+            // merge the rings into a single queue
+
+            auto ptr = static_cast<char *>(buff.first);
+            for(size_t n = 0; n < this_queue.rings(); n++)
+            {
+                auto const &r = this_queue.get_ring(n);
+                auto size = static_cast<size_t>(reinterpret_cast<char *>(r.end) - reinterpret_cast<char *>(r.begin));
+                memcpy(ptr, r.begin, size);
+                ptr += size;
+            }
+
+            return queue(buff.first, this_queue.slot_size(), this_queue.size(), this_queue.index(), this_queue.data_size());
         }
 
 
@@ -1148,7 +1803,7 @@ namespace pfq {
             for(; it != it_e; ++it)
             {
                 while (!it.ready())
-                    std::this_thread::yield();
+                    pfq_cpu_relax();
 
                 callback(user, &(*it), reinterpret_cast<const char *>(it.data()));
                 n++;
@@ -1331,6 +1986,9 @@ namespace pfq {
             if (!data_->shm_addr)
                 throw pfq_error("PFQ: inject: socket not enabled");
 
+            if (!data_->tx_num_bind)
+                throw pfq_error("PFQ: inject: socket not bound");
+
             const int tss = [=]() -> size_t {
                 if (queue == any_queue)
                     return fold(symmetric_hash(buf.first), data_->tx_num_bind);
@@ -1377,6 +2035,8 @@ namespace pfq {
         //! Flush the Tx queue(s).
         /*!
          * Transmit the packets in the Tx queues of the socket.
+         * With zero-copy transmission, the flush throws (EAGAIN)
+         * when the frames of the previous one are still in flight.
          */
 
         void
@@ -39,6 +39,17 @@ namespace pfq {
     {
     public:
 
+        //! A ring of a multi-ring queue.
+
+        struct ring
+        {
+            pfq_pkthdr *begin;
+            pfq_pkthdr *end;
+            size_t      len;
+            size_t      index;
+            char       *payload;    // payload arena (header-split layout), or nullptr
+        };
+
         struct const_iterator;
 
         //! Forward iterator over packets.
@@ -47,21 +58,28 @@ namespace pfq {
         {
             friend struct queue::const_iterator;
 
-            iterator(pfq_pkthdr *h, size_t slot_size, size_t index)
-            : hdr_(h), slot_size_(slot_size), index_(index)
+            iterator(pfq_pkthdr *h, size_t slot_size, size_t index, ring const *r = nullptr, ring const *r_end = nullptr,
+                     char *payload = nullptr, size_t payload_size = 0)
+            : hdr_(h), slot_size_(slot_size), index_(index), ring_(r), ring_end_(r_end), payload_(payload), payload_size_(payload_size)
             {}
 
             ~iterator() = default;
 
             iterator(const iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_), ring_(other.ring_), ring_end_(other.ring_end_)
+            , payload_(other.payload_), payload_size_(other.payload_size_)
             {}
 
             iterator &
             operator++()
             {
-                hdr_ = reinterpret_cast<pfq_pkthdr *>(
-                        reinterpret_cast<char *>(hdr_) + slot_size_);
+                hdr_ = queue::next_slot(hdr_, slot_size_);
+                payload_ += payload_size_;
+                if (ring_ && hdr_ == ring_->end && ring_ + 1 != ring_end_) {
+                    hdr_ = (++ring_)->begin;
+                    index_ = ring_->index;
+                    payload_ = ring_->payload;
+                }
                 return *this;
             }
 
@@ -88,7 +106,7 @@ namespace pfq {
             void *
             data() const
             {
-                return hdr_+1;
+                return payload_ ? static_cast<void *>(payload_) : hdr_+1;
             }
 
             bool
@@ -115,22 +133,29 @@ namespace pfq {
             pfq_pkthdr *hdr_;
             size_t   slot_size_;
             size_t   index_;
+            ring const *ring_;
+            ring const *ring_end_;
+            char    *payload_;
+            size_t  payload_size_;
         };
 
         //! Constant forward iterator over packets.
 
         struct const_iterator : public std::iterator<std::forward_iterator_tag, pfq_pkthdr>
         {
-            const_iterator(pfq_pkthdr *h, size_t slot_size, size_t index)
-            : hdr_(h), slot_size_(slot_size), index_(index)
+            const_iterator(pfq_pkthdr *h, size_t slot_size, size_t index, ring const *r = nullptr, ring const *r_end = nullptr,
+                           char *payload = nullptr, size_t payload_size = 0)
+            : hdr_(h), slot_size_(slot_size), index_(index), ring_(r), ring_end_(r_end), payload_(payload), payload_size_(payload_size)
             {}
 
             const_iterator(const const_iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_), ring_(other.ring_), ring_end_(other.ring_end_)
+            , payload_(other.payload_), payload_size_(other.payload_size_)
             {}
 
             const_iterator(const queue::iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_), ring_(other.ring_), ring_end_(other.ring_end_)
+            , payload_(other.payload_), payload_size_(other.payload_size_)
             {}
 
             ~const_iterator() = default;
@@ -138,8 +163,13 @@ namespace pfq {
             const_iterator &
             operator++()
             {
-                hdr_ = reinterpret_cast<pfq_pkthdr *>(
-                        reinterpret_cast<char *>(hdr_) + slot_size_);
+                hdr_ = queue::next_slot(hdr_, slot_size_);
+                payload_ += payload_size_;
+                if (ring_ && hdr_ == ring_->end && ring_ + 1 != ring_end_) {
+                    hdr_ = (++ring_)->begin;
+                    index_ = ring_->index;
+                    payload_ = ring_->payload;
+                }
                 return *this;
             }
 
@@ -166,7 +196,7 @@ namespace pfq {
             const void *
             data() const
             {
-                return hdr_+1;
+                return payload_ ? static_cast<const void *>(payload_) : hdr_+1;
             }
 
             bool
@@ -193,6 +223,10 @@ namespace pfq {
             pfq_pkthdr *hdr_;
             size_t  slot_size_;
             size_t  index_;
+            ring const *ring_;
+            ring const *ring_end_;
+            char    *payload_;
+            size_t  payload_size_;
         };
 
     public:
@@ -203,9 +237,50 @@ namespace pfq {
          */
 
         queue(void *addr, size_t slot_size, size_t queue_len, size_t index)
-        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len), index_(index)
+        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len), queue_size_(queue_len * slot_size), index_(index)
+        , rings_(nullptr), rings_end_(nullptr), payload_(nullptr), payload_size_(0)
+        {}
+
+        //! Constructor
+        /*!
+         * Construct a queue descriptor of the given size (in bytes), stored at the given address.
+         * A slot_size of 0 denotes a queue of variable-length slots.
+         */
+
+        queue(void *addr, size_t slot_size, size_t queue_len, size_t index, size_t queue_size)
+        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len), queue_size_(queue_size), index_(index)
+        , rings_(nullptr), rings_end_(nullptr), payload_(nullptr), payload_size_(0)
         {}
 
+        //! Constructor
+        /*!
+         * Construct a queue descriptor with the header-split layout: a dense array of
+         * headers stored at the given address, and the payload arena.
+         */
+
+        queue(void *hdrs, size_t queue_len, size_t index, void *payload, size_t payload_size)
+        : addr_(hdrs), slot_size_(sizeof(pfq_pkthdr)), queue_len_(queue_len), queue_size_(queue_len * sizeof(pfq_pkthdr)), index_(index)
+        , rings_(nullptr), rings_end_(nullptr), payload_(static_cast<char *>(payload)), payload_size_(payload_size)
+        {}
+
+        //! Constructor
+        /*!
+         * Construct a queue descriptor that merges the given non-empty rings.
+         * The rings are not owned by the queue and must outlive it.
+         * A payload_size other than 0 denotes the header-split layout.
+         */
+
+        queue(ring const *first, ring const *last, size_t slot_size, size_t payload_size = 0)
+        : addr_(first != last ? first->begin : nullptr), slot_size_(slot_size), queue_len_(0), queue_size_(0), index_(first != last ? first->index : 0)
+        , rings_(first), rings_end_(last), payload_(first != last ? first->payload : nullptr), payload_size_(payload_size)
+        {
+            for(auto r = first; r != last; ++r)
+            {
+                queue_len_  += r->len;
+                queue_size_ += static_cast<size_t>(reinterpret_cast<char *>(r->end) - reinterpret_cast<char *>(r->begin));
+            }
+        }
+
         //! Defaulted copy constructor.
 
         queue(queue const &) = default;
@@ -232,6 +307,9 @@ namespace pfq {
         }
 
         //! Return the index position.
+        /*!
+         * For a multi-ring queue, it is the index of the first ring.
+         */
 
         size_t
         index() const
@@ -240,6 +318,9 @@ namespace pfq {
         }
 
         //! Return the size of the queue slot, in bytes.
+        /*!
+         * Return 0 in case of variable-length slots.
+         */
 
         size_t
         slot_size() const
@@ -247,7 +328,72 @@ namespace pfq {
             return slot_size_;
         }
 
+        //! Return the size of the packets stored in this queue, in bytes.
+        /*!
+         * With the header-split layout, it is the size of the array of headers.
+         */
+
+        size_t
+        data_size() const
+        {
+            return queue_size_;
+        }
+
+        //! Return the number of rings merged in this queue.
+        /*!
+         * Return 0 for a single-ring queue.
+         */
+
+        size_t
+        rings() const
+        {
+            return static_cast<size_t>(rings_end_ - rings_);
+        }
+
+        //! Return the n-th ring merged in this queue.
+
+        ring const &
+        get_ring(size_t n) const
+        {
+            return rings_[n];
+        }
+
+        //! Return the array of headers of a queue with the header-split layout.
+        /*!
+         * Return nullptr for the inline layout.
+         * For a multi-ring queue, it is the array of the first ring.
+         */
+
+        const pfq_pkthdr *
+        headers() const
+        {
+            return payload_ ? static_cast<const pfq_pkthdr *>(addr_) : nullptr;
+        }
+
+        //! Return the payload arena of a queue with the header-split layout.
+        /*!
+         * The n-th payload belongs to the n-th header. Return nullptr for the inline layout.
+         * For a multi-ring queue, it is the arena of the first ring.
+         */
+
+        const char *
+        payload() const
+        {
+            return payload_;
+        }
+
+        //! Return the size of a payload in the arena, in bytes (0 for the inline layout).
+
+        size_t
+        payload_size() const
+        {
+            return payload_size_;
+        }
+
         //! Return the pointer to the packet.
+        /*!
+         * For a multi-ring queue, it is the pointer to the first ring.
+         */
 
         const void *
         data() const
@@ -263,7 +409,7 @@ namespace pfq {
         iterator
         begin()
         {
-            return iterator(reinterpret_cast<pfq_pkthdr *>(addr_), slot_size_, index_);
+            return iterator(reinterpret_cast<pfq_pkthdr *>(addr_), slot_size_, index_, rings_, rings_end_, payload_, payload_size_);
         }
 
         //! Return a constant iterator to the first slot of a non-empty queue.
@@ -274,7 +420,7 @@ namespace pfq {
         const_iterator
         begin() const
         {
-            return const_iterator(reinterpret_cast<pfq_pkthdr *>(addr_), slot_size_, index_);
+            return const_iterator(reinterpret_cast<pfq_pkthdr *>(addr_), slot_size_, index_, rings_, rings_end_, payload_, payload_size_);
         }
 
         //! Return an iterator past to the end of the queue.
@@ -282,8 +428,7 @@ namespace pfq {
         iterator
         end()
         {
-            return iterator(reinterpret_cast<pfq_pkthdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+            return iterator(end_slot(), slot_size_, index_);
         }
 
         //! Return a constant iterator past to the end of the queue.
@@ -291,8 +436,7 @@ namespace pfq {
         const_iterator
         end() const
         {
-            return const_iterator(reinterpret_cast<pfq_pkthdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+            return const_iterator(end_slot(), slot_size_, index_);
         }
 
         //! Return a constant iterator to the first slot of an non-empty queue.
@@ -303,7 +447,7 @@ namespace pfq {
         const_iterator
         cbegin() const
         {
-            return const_iterator(reinterpret_cast<pfq_pkthdr *>(addr_), slot_size_, index_);
+            return const_iterator(reinterpret_cast<pfq_pkthdr *>(addr_), slot_size_, index_, rings_, rings_end_, payload_, payload_size_);
         }
 
         //! Return a constant iterator past to the end of the queue.
@@ -311,15 +455,44 @@ namespace pfq {
         const_iterator
         cend() const
         {
-            return const_iterator(reinterpret_cast<pfq_pkthdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+            return const_iterator(end_slot(), slot_size_, index_);
         }
 
     private:
+
+        //! Return the slot past to the end of the queue (the end of the last ring, for a multi-ring queue).
+
+        pfq_pkthdr *
+        end_slot() const
+        {
+            if (rings_ != rings_end_)
+                return (rings_end_-1)->end;
+            return reinterpret_cast<pfq_pkthdr *>(static_cast<char *>(addr_) + (rings_ ? 0 : queue_size_));
+        }
+
+        //! Return the slot following the given one.
+        /*!
+         * With variable-length slots the size of the slot is taken from the caplen
+         * of the header: the slot must be ready before moving to the next one.
+         */
+
+        static pfq_pkthdr *
+        next_slot(pfq_pkthdr *h, size_t slot_size)
+        {
+            if (slot_size == 0)
+                slot_size = (sizeof(pfq_pkthdr) + h->caplen + 7) & ~7;
+            return reinterpret_cast<pfq_pkthdr *>(reinterpret_cast<char *>(h) + slot_size);
+        }
+
         void    *addr_;
         size_t  slot_size_;
         size_t  queue_len_;
+        size_t  queue_size_;
         size_t  index_;
+        ring const *rings_;
+        ring const *rings_end_;
+        char    *payload_;
+        size_t  payload_size_;
     };
 
     //! Return the pointer to the packet.
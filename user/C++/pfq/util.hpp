@@ -250,6 +250,9 @@ namespace pfq {
                 case 4: return hash & 3;
             }
 
+            if ((n & (n - 1)) == 0)
+                return hash & (n - 1);
+
             return hash % n;
         }
 
@@ -43,6 +43,8 @@
 #include <ctype.h>
 #include <sched.h>
 #include <fcntl.h>
+#include <time.h>
+#include <limits.h>
 
 #include <poll.h>
 
@@ -138,6 +140,7 @@ typedef struct pfq_data
 {
 	void * shm_addr;
 	size_t shm_size;
+	int    shm_hugepages;
 
 	void * tx_queue_addr;
 	size_t tx_queue_size;
@@ -147,6 +150,11 @@ typedef struct pfq_data
 
 	size_t rx_slots;
 	size_t rx_slot_size;
+	size_t rx_rings;
+	int    rx_varlen;
+	int    rx_mode;
+	int    rx_batch_commit;
+	int    rx_layout;
 
         size_t tx_slots;
 	size_t tx_slot_size;
@@ -165,6 +173,11 @@ typedef struct pfq_data
 	int gid;
 
 	struct pfq_net_queue netq;
+	struct pfq_net_queue rx_ring[Q_MAX_RX_RINGS];
+	size_t rx_pending[Q_MAX_RX_RINGS];
+
+	struct pfq_wait_strategy rx_wait;
+	struct pfq_wait_stats rx_wait_stats;
 } pfq_t;
 
 /* return the string error */
@@ -254,6 +267,7 @@ pfq_open_group(unsigned long class_mask, int group_policy, size_t caplen, size_t
 	}
 
 	q->rx_slots = rx_slots;
+	q->rx_rings = 1;
 
 	/* set caplen */
 	if (setsockopt(fd, PF_Q, Q_SO_SET_RX_CAPLEN, &caplen, sizeof(caplen)) == -1) {
@@ -328,9 +342,11 @@ pfq_enable(pfq_t *q)
 		return Q_ERROR(q, "PFQ: queue memory error");
 	}
 
+	/* hugetlbfs is not used when kernel hugepages are required */
+
 	snprintf(filename, 64, "/dev/hugepages/pfq.%d", q->fd);
 
-	q->hd = open(filename, O_CREAT | O_RDWR, 0755);
+	q->hd = q->shm_hugepages == Q_HUGEPAGES_REQUIRE ? -1 : open(filename, O_CREAT | O_RDWR, 0755);
 	if (q->hd != -1)
 		q->shm_addr = mmap(NULL, tot_mem, PROT_READ|PROT_WRITE, MAP_SHARED, q->hd, 0);
 
@@ -356,10 +372,12 @@ pfq_enable(pfq_t *q)
 
 	q->shm_size = tot_mem;
 
-       	q->rx_queue_addr = (char *)(q->shm_addr) + sizeof(struct pfq_shared_queue);
+	memset(q->rx_pending, 0, sizeof(q->rx_pending));
+
+       	q->rx_queue_addr = (char *)(q->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(q->rx_rings);
         q->rx_queue_size = q->rx_slots * q->rx_slot_size;
 
-        q->tx_queue_addr = (char *)(q->shm_addr) + sizeof(struct pfq_shared_queue) + q->rx_queue_size * 2;
+        q->tx_queue_addr = (char *)(q->shm_addr) + Q_SHARED_QUEUE_HDR_SIZE(q->rx_rings) + q->rx_queue_size * 2 * q->rx_rings;
         q->tx_queue_size = q->tx_slots * q->tx_slot_size;
 
         return Q_OK(q);
@@ -433,6 +451,246 @@ pfq_is_timestamp_enabled(pfq_t const *q)
 }
 
 
+int
+pfq_set_timestamp_source(pfq_t *q, int source)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_TSTAMP, &source, sizeof(source)) == -1) {
+		return Q_ERROR(q, "PFQ: set timestamp source");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_timestamp_source(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_TSTAMP, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get timestamp source");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_get_timestamp_error(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_TSTAMP_ERROR, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get timestamp error");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_varlen_enable(pfq_t *q, int value)
+{
+	int varlen = value ? Q_SLOTS_VARLEN : Q_SLOTS_FIXED;
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_VARLEN, &varlen, sizeof(varlen)) == -1) {
+		return Q_ERROR(q, "PFQ: set varlen mode");
+	}
+	q->rx_varlen = varlen;
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_varlen_enabled(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_VARLEN, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get varlen mode");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_set_rx_mode(pfq_t *q, int mode)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_MODE, &mode, sizeof(mode)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx mode");
+	}
+	q->rx_mode = mode;
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_mode(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_MODE, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Rx mode");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_set_rx_layout(pfq_t *q, int layout)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_LAYOUT, &layout, sizeof(layout)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx layout");
+	}
+	q->rx_layout = layout;
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_layout(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_LAYOUT, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Rx layout");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_set_shmem_node(pfq_t *q, int node)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_SHMEM_NODE, &node, sizeof(node)) == -1) {
+		return Q_ERROR(q, "PFQ: set shmem node");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_set_shmem_hugepages(pfq_t *q, int policy)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_SHMEM_HUGEPAGES, &policy, sizeof(policy)) == -1) {
+		return Q_ERROR(q, "PFQ: set shmem hugepages");
+	}
+	q->shm_hugepages = policy;
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_shmem_hugepages(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_SHMEM_HUGEPAGES, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get shmem hugepages");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_get_shmem_node(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_SHMEM_NODE, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get shmem node");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_batch_commit_enable(pfq_t *q, int value)
+{
+	int batch_commit = value ? 1 : 0;
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_BATCH_COMMIT, &batch_commit, sizeof(batch_commit)) == -1) {
+		return Q_ERROR(q, "PFQ: set batch commit");
+	}
+	q->rx_batch_commit = batch_commit;
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_batch_commit_enabled(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_BATCH_COMMIT, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get batch commit");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_set_rx_wakeup_watermark(pfq_t *q, size_t value)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_WAKEUP_WATERMARK, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx wakeup watermark");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_wakeup_watermark(pfq_t const *q)
+{
+	size_t ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_WAKEUP_WATERMARK, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Rx wakeup watermark");
+	}
+	return Q_VALUE(q, (int)ret);
+}
+
+
+int
+pfq_set_rx_wakeup_timeout(pfq_t *q, unsigned int microseconds)
+{
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_WAKEUP_TIMEOUT, &microseconds, sizeof(microseconds)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx wakeup timeout");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_wakeup_timeout(pfq_t const *q)
+{
+	unsigned int ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_WAKEUP_TIMEOUT, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Rx wakeup timeout");
+	}
+	return Q_VALUE(q, (int)ret);
+}
+
+
+int
+pfq_rx_busy_poll_enable(pfq_t *q, int value)
+{
+	int busy_poll = value ? 1 : 0;
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_WAKEUP_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx busy-poll mode");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_rx_busy_poll_enabled(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_RX_WAKEUP_BUSY_POLL, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Rx busy-poll mode");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
 int
 pfq_ifindex(pfq_t const *q, const char *dev)
 {
@@ -535,6 +793,29 @@ pfq_get_rx_slots(pfq_t const *q)
 }
 
 
+int
+pfq_set_rx_rings(pfq_t *q, size_t value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return Q_ERROR(q, "PFQ: enabled (Rx rings could not be set)");
+	}
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RX_RINGS, &value, sizeof(value)) == -1) {
+		return Q_ERROR(q, "PFQ: set Rx rings error");
+	}
+
+	q->rx_rings = value;
+	return Q_OK(q);
+}
+
+
+size_t
+pfq_get_rx_rings(pfq_t const *q)
+{
+	return q->rx_rings;
+}
+
+
 int
 pfq_set_tx_slots(pfq_t *q, size_t value)
 {
@@ -831,6 +1112,131 @@ pfq_poll(pfq_t *q, long int microseconds /* = -1 -> infinite */)
 }
 
 
+int
+pfq_set_rx_wait_strategy(pfq_t *q, struct pfq_wait_strategy const *ws)
+{
+	if (ws->spin_ns < 0 || ws->yield_ns < 0) {
+		return Q_ERROR(q, "PFQ: invalid wait strategy");
+	}
+	q->rx_wait = *ws;
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_wait_strategy(pfq_t const *q, struct pfq_wait_strategy *ws)
+{
+	*ws = q->rx_wait;
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_rx_wait_stats(pfq_t const *q, struct pfq_wait_stats *stats)
+{
+	*stats = q->rx_wait_stats;
+	return Q_OK(q);
+}
+
+
+static inline unsigned long long
+pfq_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+
+/* producer index of a continuous ring: with batch commit only the published slots are returned */
+
+static inline unsigned long long
+pfq_ring_head(pfq_t const *q, size_t ring)
+{
+	struct pfq_shared_queue * qd = (struct pfq_shared_queue *)(q->shm_addr);
+	return q->rx_batch_commit ? qd->rx[ring].commit : qd->rx[ring].data;
+}
+
+
+/* number of packets not yet returned by pfq_read */
+
+static size_t
+pfq_rx_available(pfq_t const *q)
+{
+	struct pfq_shared_queue * qd = (struct pfq_shared_queue *)(q->shm_addr);
+	size_t n, len = 0;
+
+	for(n = 0; n < q->rx_rings; n++)
+		len += q->rx_mode == Q_RX_MODE_CONTINUOUS ? (size_t)(pfq_ring_head(q, n) - qd->rx[n].cons) - q->rx_pending[n]
+							  : Q_SHARED_QUEUE_LEN(qd->rx[n].data);
+	return len;
+}
+
+
+static int
+pfq_wait_phase(pfq_t const *q, unsigned long long *now, unsigned long long end, int yield)
+{
+	while (*now < end)
+	{
+		if (pfq_rx_available(q))
+			return 1;
+
+		if (yield)
+			pfq_yield();
+		else
+			pfq_cpu_relax();
+
+		*now = pfq_now_ns();
+	}
+	return 0;
+}
+
+
+/* wait for packets: spin, then yield, then block in ppoll (timeout in microseconds, -1 -> infinite) */
+
+static int
+pfq_wait(pfq_t *q, long int microseconds)
+{
+	struct pfq_wait_strategy const *ws = &q->rx_wait;
+	unsigned long long start, mark, now, timeout;
+
+	if (microseconds == 0)
+		return 0;
+
+	timeout = microseconds < 0 ? ULLONG_MAX : (unsigned long long)microseconds * 1000;
+	start = mark = now = pfq_now_ns();
+
+	if (ws->spin_ns > 0) {
+		int ready = pfq_wait_phase(q, &now, start + min(timeout, (unsigned long long)ws->spin_ns), 0);
+		q->rx_wait_stats.spin_ns += now - mark;
+		if (ready) {
+			q->rx_wait_stats.spin++;
+			return 0;
+		}
+		mark = now;
+	}
+
+	if (ws->yield_ns > 0) {
+		int ready = pfq_wait_phase(q, &now, start + min(timeout, (unsigned long long)(ws->spin_ns + ws->yield_ns)), 1);
+		q->rx_wait_stats.yield_ns += now - mark;
+		if (ready) {
+			q->rx_wait_stats.yield++;
+			return 0;
+		}
+		mark = now;
+	}
+
+	if (ws->block && now - start < timeout) {
+		int ret = pfq_poll(q, microseconds < 0 ? -1 : (long int)((timeout - (now - start)) / 1000));
+		q->rx_wait_stats.block_ns += pfq_now_ns() - mark;
+		q->rx_wait_stats.block++;
+		return ret;
+	}
+
+	return 0;
+}
+
+
 int
 pfq_get_stats(pfq_t const *q, struct pfq_stats *stats)
 {
@@ -905,40 +1311,138 @@ int pfq_vlan_reset_filter(pfq_t *q, int gid, int vid)
 }
 
 
+/* set the views of a queue of fixed-size slots, starting at the given position of a region of slots */
+
+static void
+pfq_net_queue_setup(pfq_t const *q, struct pfq_net_queue *nq, char *region, size_t slots, size_t pos)
+{
+	if (q->rx_layout == Q_RX_LAYOUT_SPLIT) {
+		nq->queue        = region + pos * sizeof(struct pfq_pkthdr);
+		nq->slot_size    = sizeof(struct pfq_pkthdr);
+		nq->payload_size = q->rx_slot_size - sizeof(struct pfq_pkthdr);
+		nq->payload      = region + slots * sizeof(struct pfq_pkthdr) + pos * nq->payload_size;
+	}
+	else {
+		nq->queue        = region + pos * q->rx_slot_size;
+		nq->slot_size    = q->rx_slot_size;
+		nq->payload      = NULL;
+		nq->payload_size = 0;
+	}
+}
+
+
+static size_t
+pfq_read_ring_continuous(pfq_t *q, struct pfq_net_queue *nq, size_t ring)
+{
+	struct pfq_shared_queue * qd = (struct pfq_shared_queue *)(q->shm_addr);
+	size_t capacity = q->rx_slots * 2, pos;
+	unsigned long long head, cons;
+
+	/* release the slots returned by the previous read... */
+
+	cons = qd->rx[ring].cons + q->rx_pending[ring];
+
+	smp_mb();
+
+	qd->rx[ring].cons = cons;
+
+	/* return the contiguous slots available up to the end of the ring */
+
+	head = pfq_ring_head(q, ring);
+	pos  = cons % capacity;
+
+	smp_rmb();
+
+	pfq_net_queue_setup(q, nq, (char *)(q->rx_queue_addr) + ring * 2 * q->rx_queue_size, capacity, pos);
+
+	nq->index = (unsigned int)((cons / capacity + 1) & 0xff);
+	nq->next  = NULL;
+	nq->len   = min((size_t)(head - cons), capacity - pos);
+	nq->size  = nq->len * nq->slot_size;
+
+	return q->rx_pending[ring] = nq->len;
+}
+
+
+static size_t
+pfq_read_ring(pfq_t *q, struct pfq_net_queue *nq, size_t ring, unsigned int index)
+{
+	struct pfq_shared_queue * qd = (struct pfq_shared_queue *)(q->shm_addr);
+	unsigned long long data;
+
+	if (q->rx_mode == Q_RX_MODE_CONTINUOUS)
+		return pfq_read_ring_continuous(q, nq, ring);
+
+	/* reset the next buffer... */
+
+	data = __sync_lock_test_and_set(&qd->rx[ring].data, Q_SHARED_QUEUE_DATA(index+1, 0, 0));
+
+	nq->index = index;
+	nq->next  = NULL;
+
+	/* with variable-length slots the kernel never overshoots the queue */
+
+	if (q->rx_varlen) {
+		nq->queue = (char *)(q->rx_queue_addr) + (ring * 2 + (index & 1)) * q->rx_queue_size;
+		nq->len = Q_SHARED_QUEUE_LEN(data);
+		nq->size = Q_SHARED_QUEUE_OFF(data);
+		nq->slot_size = 0;
+		nq->payload = NULL;
+		nq->payload_size = 0;
+	}
+	else {
+		pfq_net_queue_setup(q, nq, (char *)(q->rx_queue_addr) + (ring * 2 + (index & 1)) * q->rx_queue_size, q->rx_slots, 0);
+		nq->len = min(Q_SHARED_QUEUE_LEN(data), q->rx_slots);
+		nq->size = nq->len * nq->slot_size;
+	}
+
+	return nq->len;
+}
+
+
 int
 pfq_read(pfq_t *q, struct pfq_net_queue *nq, long int microseconds)
 {
 	struct pfq_shared_queue * qd;
-	unsigned int index, data;
+	struct pfq_net_queue *last;
+	size_t n, queue_len;
+	unsigned int index;
 
         if (q->shm_addr == NULL) {
          	return Q_ERROR(q, "PFQ: read: socket not enabled");
 	}
 
 	qd    = (struct pfq_shared_queue *)(q->shm_addr);
-	data  = qd->rx.data;
-	index = Q_SHARED_QUEUE_INDEX(data);
+	index = Q_SHARED_QUEUE_INDEX(qd->rx[0].data);
 
-	if(Q_SHARED_QUEUE_LEN(data) == 0 ) {
-#ifdef PFQ_USE_POLL
-		if (pfq_poll(q, microseconds) < 0) {
+	if (pfq_rx_available(q) == 0) {
+		if (pfq_wait(q, microseconds) < 0) {
         		return Q_ERROR(q, "PFQ: poll error");
 		}
-#else
-		(void)microseconds;
-#endif
 	}
 
-	/* reset the next buffer... */
+	queue_len = pfq_read_ring(q, nq, 0, index);
 
-	data = __sync_lock_test_and_set(&qd->rx.data, ((index+1) << 24));
+	if (q->rx_rings == 1)
+		return Q_VALUE(q, (int)queue_len);
 
-	size_t queue_len = min(Q_SHARED_QUEUE_LEN(data), q->rx_slots);
+	/* link the non-empty rings: all of them share the same index (double-buffer mode) */
 
-	nq->queue = (char *)(q->rx_queue_addr) + (index & 1) * q->rx_queue_size;
-	nq->index = index;
-	nq->len   = queue_len;
-        nq->slot_size = q->rx_slot_size;
+	last = queue_len ? nq : NULL;
+
+	for(n = 1; n < q->rx_rings; n++)
+	{
+		struct pfq_net_queue *ring = last ? &q->rx_ring[n] : nq;
+
+		if (pfq_read_ring(q, ring, n, index) == 0)
+			continue;
+
+		if (last)
+			last->next = ring;
+
+		queue_len += ring->len;
+		last = ring;
+	}
 
 	return Q_VALUE(q, (int)queue_len);
 }
@@ -947,14 +1451,35 @@ pfq_read(pfq_t *q, struct pfq_net_queue *nq, long int microseconds)
 int
 pfq_recv(pfq_t *q, void *buf, size_t buflen, struct pfq_net_queue *nq, long int microseconds)
 {
+	struct pfq_net_queue *ring;
+	size_t len, size;
+
+	if (q->rx_layout == Q_RX_LAYOUT_SPLIT) {
+		return Q_ERROR(q, "PFQ: recv: not supported with the header-split layout");
+	}
+
        	if (pfq_read(q, nq, microseconds) < 0)
 		return -1;
 
-	if (buflen < (q->rx_slots * q->rx_slot_size)) {
+	if (buflen < (q->rx_slots * q->rx_slot_size * q->rx_rings)) {
 		return Q_ERROR(q, "PFQ: buffer too small");
 	}
 
-	memcpy(buf, nq->queue, q->rx_slot_size * nq->len);
+	memcpy(buf, nq->queue, nq->size);
+
+	/* merge the rings into a single queue */
+
+	for(ring = nq->next, len = nq->len, size = nq->size; ring; ring = ring->next)
+	{
+		memcpy((char *)buf + size, ring->queue, ring->size);
+		len  += ring->len;
+		size += ring->size;
+	}
+
+	nq->len  = len;
+	nq->size = size;
+	nq->next = NULL;
+
 	return Q_OK(q);
 }
 
@@ -963,21 +1488,25 @@ int
 pfq_dispatch(pfq_t *q, pfq_handler_t cb, long int microseconds, char *user)
 {
 	pfq_iterator_t it, it_end;
+	struct pfq_net_queue *nq;
 	int n = 0;
 
 	if (pfq_read(q, &q->netq, microseconds) < 0)
 		return -1;
 
-	it = pfq_net_queue_begin(&q->netq);
-	it_end = pfq_net_queue_end(&q->netq);
-
-	for(; it != it_end; it = pfq_net_queue_next(&q->netq, it))
+	for(nq = &q->netq; nq; nq = nq->next)
 	{
-		while (!pfq_iterator_ready(&q->netq, it))
-			pfq_yield();
+		it = pfq_net_queue_begin(nq);
+		it_end = pfq_net_queue_end(nq);
 
-		cb(user, pfq_iterator_header(it), pfq_iterator_data(it));
-		n++;
+		for(; it != it_end; it = pfq_net_queue_next(nq, it))
+		{
+			while (!pfq_iterator_ready(nq, it))
+				pfq_cpu_relax();
+
+			cb(user, pfq_iterator_header(it), pfq_net_queue_data(nq, it));
+			n++;
+		}
 	}
         return Q_VALUE(q, n);
 }
@@ -1022,6 +1551,67 @@ pfq_unbind_tx(pfq_t *q)
 	return Q_OK(q);
 }
 
+
+int
+pfq_get_tx_queues(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_TX_QUEUES, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Tx queues");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_tx_zerocopy_enable(pfq_t *q, int value)
+{
+	int zerocopy = value ? 1 : 0;
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_TX_ZEROCOPY, &zerocopy, sizeof(zerocopy)) == -1) {
+		return Q_ERROR(q, "PFQ: set Tx zero-copy");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_is_tx_zerocopy_enabled(pfq_t const *q)
+{
+	int ret; socklen_t size = sizeof(int);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_TX_ZEROCOPY, &ret, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Tx zero-copy");
+	}
+	return Q_VALUE(q, ret);
+}
+
+
+int
+pfq_set_tx_rate(pfq_t *q, int queue, uint64_t pps, uint64_t bps, unsigned int burst)
+{
+	struct pfq_tx_rate rate = { queue, burst, pps, bps };
+
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_TX_RATE, &rate, sizeof(rate)) == -1) {
+		return Q_ERROR(q, "PFQ: set Tx rate");
+	}
+	return Q_OK(q);
+}
+
+
+int
+pfq_get_tx_rate(pfq_t const *q, int queue, struct pfq_tx_rate *rate)
+{
+	socklen_t size = sizeof(struct pfq_tx_rate);
+
+	rate->queue = queue;
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_TX_RATE, rate, &size) == -1) {
+	        return Q_ERROR(q, "PFQ: get Tx rate");
+	}
+	return Q_OK(q);
+}
+
+
 int
 pfq_inject(pfq_t *q, const void *buf, size_t len, uint64_t nsec, int queue)
 {
@@ -1035,6 +1625,9 @@ pfq_inject(pfq_t *q, const void *buf, size_t len, uint64_t nsec, int queue)
 	if (q->shm_addr == NULL)
          	return Q_ERROR(q, "PFQ: inject: socket not enabled");
 
+	if (q->tx_num_bind == 0)
+         	return Q_ERROR(q, "PFQ: inject: socket not bound");
+
 	if (queue == Q_ANY_QUEUE) {
 		tss = pfq_fold(pfq_symmetric_hash(buf), q->tx_num_bind);
 	}
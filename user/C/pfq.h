@@ -52,8 +52,43 @@ struct pfq_net_queue
 {
         pfq_iterator_t queue; 	  		/* net queue */
         size_t         len;       		/* number of packets in the queue */
-        size_t         slot_size;
+        size_t         size;      		/* size of the queue in bytes */
+        size_t         slot_size; 		/* 0 -> variable-length slots */
         unsigned int   index; 	  		/* current queue index */
+
+        struct pfq_net_queue *next; 		/* next non-empty ring (multi-ring sockets), or NULL */
+
+        const char    *payload;                 /* payload arena (header-split layout), or NULL */
+        size_t         payload_size;            /* size of a payload in the arena, in bytes */
+};
+
+
+/*! Wait strategy used by pfq_read when the Rx queue is empty. */
+/*!
+ * The reader spins (pause) for spin_ns nanoseconds, then yields the cpu for
+ * yield_ns nanoseconds and eventually, if block is set, sleeps in ppoll for the
+ * rest of the timeout. The default strategy {0, 0, 0} returns immediately.
+ */
+
+struct pfq_wait_strategy
+{
+        long           spin_ns;
+        long           yield_ns;
+        int            block;
+};
+
+
+/*! Time spent in each phase of the wait strategy, and the number of waits ended there. */
+
+struct pfq_wait_stats
+{
+        unsigned long long spin_ns;
+        unsigned long long yield_ns;
+        unsigned long long block_ns;
+
+        unsigned long long spin;
+        unsigned long long yield;
+        unsigned long long block;
 };
 
 
@@ -72,19 +107,28 @@ static inline
 pfq_iterator_t
 pfq_net_queue_end(struct pfq_net_queue const *nq)
 {
-        return nq->queue + nq->len * nq->slot_size;
+        return nq->queue + nq->size;
 }
 
 /*! Return an iterator to the next slot. */
+/*!
+ * With variable-length slots the size of a slot is given by the
+ * caplen of its header: the slot must be ready before moving to the next one.
+ */
 
 static inline
 pfq_iterator_t
 pfq_net_queue_next(struct pfq_net_queue const *nq, pfq_iterator_t iter)
 {
+        if (nq->slot_size == 0)
+                return iter + ((sizeof(struct pfq_pkthdr) + ((const struct pfq_pkthdr *)iter)->caplen + 7) & ~7);
         return iter + nq->slot_size;
 }
 
 /*! Return an iterator to the previous slot. */
+/*!
+ * Not available with variable-length slots.
+ */
 
 static inline
 pfq_iterator_t
@@ -111,6 +155,30 @@ pfq_iterator_data(pfq_iterator_t iter)
         return (const char *)(iter + sizeof(struct pfq_pkthdr));
 }
 
+/*! Given an iterator, return a pointer to the packet data, for any layout of the queue. */
+/*!
+ * With the header-split layout the queue is a dense array of headers
+ * and the n-th packet is the n-th payload of the arena.
+ */
+
+static inline
+const char *
+pfq_net_queue_data(struct pfq_net_queue const *nq, pfq_iterator_t iter)
+{
+        if (nq->payload)
+                return nq->payload + (size_t)(iter - nq->queue) / sizeof(struct pfq_pkthdr) * nq->payload_size;
+        return (const char *)(iter + sizeof(struct pfq_pkthdr));
+}
+
+/*! Return the array of headers of a queue with the header-split layout, NULL otherwise. */
+
+static inline
+const struct pfq_pkthdr *
+pfq_net_queue_headers(struct pfq_net_queue const *nq)
+{
+        return nq->payload ? (const struct pfq_pkthdr *)nq->queue : NULL;
+}
+
 /*! Given an iterator, return 1 if the packet is available. */
 
 static inline
@@ -185,6 +253,9 @@ unsigned int pfq_fold(unsigned int hash, unsigned int n)
             case 4: return hash & 3;
         }
 
+        if ((n & (n - 1)) == 0)
+        	return hash & (n - 1);
+
         return hash % n;
 }
 
@@ -311,6 +382,174 @@ extern int pfq_timestamp_enable(pfq_t *q, int value);
 extern int pfq_is_timestamp_enabled(pfq_t const *q);
 
 
+/*! Set the timestamp source of the packets. */
+/*!
+ * Q_TSTAMP_OFF: no timestamp (the kernel does not read the clock).
+ * Q_TSTAMP_SOFTWARE: kernel time on receive.
+ * Q_TSTAMP_HARDWARE: raw hardware stamp of the device, 0 if not available.
+ * Q_TSTAMP_BATCH: kernel time read once per batch (see pfq_get_timestamp_error).
+ */
+
+extern int pfq_set_timestamp_source(pfq_t *q, int source);
+
+
+/*! Return the timestamp source of the packets. */
+
+extern int pfq_get_timestamp_source(pfq_t const *q);
+
+
+/*! Return the worst-case error of the timestamps, in usec. */
+/*!
+ * Non-zero for Q_TSTAMP_BATCH when packets are batched: the max hold
+ * time of a batch (flush_timeout module parameter).
+ */
+
+extern int pfq_get_timestamp_error(pfq_t const *q);
+
+
+/*! Enable variable-length slots for the Rx queue. */
+/*!
+ * Each slot takes sizeof(pfq_pkthdr) + ALIGN(caplen, 8) bytes, where caplen is
+ * the actual number of bytes captured. The option must be set before the socket is enabled.
+ */
+
+extern int pfq_varlen_enable(pfq_t *q, int value);
+
+
+/*! Check whether variable-length slots are enabled. */
+
+extern int pfq_is_varlen_enabled(pfq_t const *q);
+
+
+/*! Specify the Rx queue mode. */
+/*!
+ * Q_RX_MODE_DOUBLE_BUFFER (default): each read swaps the halves of a double buffer.
+ * Q_RX_MODE_CONTINUOUS: the whole memory is a single ring with producer/consumer indices;
+ * each read releases the packets returned by the previous one and returns the packets
+ * available (up to the end of the ring). Not compatible with variable-length slots.
+ * The mode must be set before the socket is enabled.
+ */
+
+extern int pfq_set_rx_mode(pfq_t *q, int mode);
+
+
+/*! Return the Rx queue mode. */
+
+extern int pfq_get_rx_mode(pfq_t const *q);
+
+
+/*! Enable the batch commit of the Rx queue. */
+/*!
+ * The kernel publishes each burst with a single store of the producer index,
+ * and pfq_read returns only the published packets: they are all ready, with
+ * no need to wait on the commit of each slot. It requires the continuous Rx mode
+ * and must be set before the socket is enabled.
+ */
+
+extern int pfq_batch_commit_enable(pfq_t *q, int value);
+
+
+/*! Check whether the batch commit of the Rx queue is enabled. */
+
+extern int pfq_is_batch_commit_enabled(pfq_t const *q);
+
+
+/*! Specify the layout of the Rx slots. */
+/*!
+ * Q_RX_LAYOUT_INLINE (default): each header is followed by its payload.
+ * Q_RX_LAYOUT_SPLIT: a dense array of headers followed by the payload arena;
+ * pfq_net_queue_headers returns the array and pfq_net_queue_data the payload
+ * of a packet. Not compatible with variable-length slots nor with pfq_recv.
+ * The layout must be set before the socket is enabled.
+ */
+
+extern int pfq_set_rx_layout(pfq_t *q, int layout);
+
+
+/*! Return the layout of the Rx slots. */
+
+extern int pfq_get_rx_layout(pfq_t const *q);
+
+
+/*! Specify the NUMA node of the socket queues memory. */
+/*!
+ * Q_NODE_ANY (default): no preference.
+ * Q_NODE_DEVICE: the node of the device bound to the socket (Tx binding first,
+ * then the devices bound to the joined groups), resolved when the socket is enabled.
+ * Otherwise the id of an online node. Must be set before the socket is enabled.
+ */
+
+extern int pfq_set_shmem_node(pfq_t *q, int node);
+
+
+/*! Specify the hugepages policy of the socket queues memory. */
+/*!
+ * Q_HUGEPAGES_AUTO (default): hugetlbfs pages (/dev/hugepages) when available,
+ * otherwise hugepages allocated by the kernel, otherwise 4K pages.
+ * Q_HUGEPAGES_OFF: hugetlbfs pages when available, otherwise 4K pages.
+ * Q_HUGEPAGES_REQUIRE: hugepages allocated by the kernel; pfq_enable fails otherwise.
+ * Must be set before the socket is enabled.
+ */
+
+extern int pfq_set_shmem_hugepages(pfq_t *q, int policy);
+
+
+/*! Return the hugepages policy of the socket queues memory. */
+
+extern int pfq_get_shmem_hugepages(pfq_t const *q);
+
+
+/*! Return the NUMA node of the socket queues memory. */
+/*!
+ * Once the socket is enabled this is the node where the memory was actually
+ * allocated (-1 if not node-bound), otherwise the requested one.
+ */
+
+extern int pfq_get_shmem_node(pfq_t const *q);
+
+
+/*! Specify the Rx wakeup watermark, in packets. */
+/*!
+ * A reader blocked in poll is woken up when the queue holds at least
+ * this number of packets (default 1). It can be changed at run-time.
+ */
+
+extern int pfq_set_rx_wakeup_watermark(pfq_t *q, size_t value);
+
+
+/*! Return the Rx wakeup watermark. */
+
+extern int pfq_get_rx_wakeup_watermark(pfq_t const *q);
+
+
+/*! Specify the max latency of the Rx wakeup, in microseconds. */
+/*!
+ * Below the watermark, the reader is woken up at most after the given
+ * time since the first pending packet. 0 disables the timer (default).
+ */
+
+extern int pfq_set_rx_wakeup_timeout(pfq_t *q, unsigned int microseconds);
+
+
+/*! Return the max latency of the Rx wakeup, in microseconds. */
+
+extern int pfq_get_rx_wakeup_timeout(pfq_t const *q);
+
+
+/*! Enable the Rx busy-poll mode. */
+/*!
+ * The kernel never wakes up the reader: the application is expected to
+ * spin on the queue (e.g. pfq_read with 0 microseconds).
+ */
+
+extern int pfq_rx_busy_poll_enable(pfq_t *q, int value);
+
+
+/*! Check whether the Rx busy-poll mode is enabled. */
+
+extern int pfq_is_rx_busy_poll_enabled(pfq_t const *q);
+
+
 /*! Specify the capture length of packets, in bytes. */
 /*!
  * Capture length must be set before the socket is enabled.
@@ -343,7 +582,25 @@ extern int pfq_set_rx_slots(pfq_t *q, size_t value);
 extern size_t pfq_get_rx_slots(pfq_t const *q);
 
 
+/*! Specify the number of Rx rings. */
+/*!
+ * Each ring is fed by the CPUs with index modulo the number of rings, so that
+ * with as many rings as producing CPUs no contention occurs among them.
+ * Each ring has the given number of Rx slots. The option must be set before the socket is enabled.
+ */
+
+extern int pfq_set_rx_rings(pfq_t *q, size_t value);
+
+
+/*! Return the number of Rx rings. */
+
+extern size_t pfq_get_rx_rings(pfq_t const *q);
+
+
 /*! Return the length of a Rx slot, in bytes. */
+/*!
+ * With variable-length slots this is the maximum length of a slot.
+ */
 
 extern size_t pfq_get_rx_slot_size(pfq_t const *q);
 
@@ -405,7 +662,8 @@ extern int pfq_egress_unbind(pfq_t *q);
 
 /*! Bind the socket for transmission to the given device name and queue. */
 /*!
- *  A socket can be bound up to a maximum number of queues.
+ *  A socket can be bound up to Q_MAX_TX_QUEUES queues. Memory is reserved
+ *  only for the queues bound before the socket is enabled.
  *  The core parameter specifies the CPU index where to run a
  *  kernel thread (unless no_kthread id is specified).
  */
@@ -421,6 +679,42 @@ extern int pfq_bind_tx(pfq_t *q, const char *dev, int queue, int core);
 extern int pfq_unbind_tx(pfq_t *q);
 
 
+/*! Return the number of Tx queues the socket is bound to. */
+
+extern int pfq_get_tx_queues(pfq_t const *q);
+
+
+/*! Enable zero-copy transmission. */
+/*!
+ * The payload of the frames is attached to the skbs as pages of the Tx queue,
+ * instead of being copied. A half of the Tx queue is given back for writing
+ * only when the transmission of its frames is complete.
+ * The socket must be disabled.
+ */
+
+extern int pfq_tx_zerocopy_enable(pfq_t *q, int value);
+
+
+/*! Check whether zero-copy transmission is enabled. */
+
+extern int pfq_is_tx_zerocopy_enabled(pfq_t const *q);
+
+
+/*! Shape a Tx queue with a token bucket. */
+/*!
+ * Packets leave the queue at most at pps packets and bps bits per second
+ * (frame bytes, 0 = unlimited), with up to burst packets back-to-back.
+ * Q_ANY_QUEUE shapes all the Tx queues of the socket.
+ */
+
+extern int pfq_set_tx_rate(pfq_t *q, int queue, uint64_t pps, uint64_t bps, unsigned int burst);
+
+
+/*! Return the token-bucket parameters of a Tx queue. */
+
+extern int pfq_get_tx_rate(pfq_t const *q, int queue, struct pfq_tx_rate *rate);
+
+
 /*! Return the mask of the joined groups. */
 /*!
  * Each socket can bind to multiple groups. Each bit of the mask represents
@@ -496,11 +790,29 @@ extern int pfq_leave_group(pfq_t *q, int gid);
 extern int pfq_poll(pfq_t *q, long int microseconds /* = -1 -> infinite */);
 
 
+/*! Specify the wait strategy used by pfq_read when the Rx queue is empty. */
+
+extern int pfq_set_rx_wait_strategy(pfq_t *q, struct pfq_wait_strategy const *ws);
+
+
+/*! Return the wait strategy used by pfq_read. */
+
+extern int pfq_get_rx_wait_strategy(pfq_t const *q, struct pfq_wait_strategy *ws);
+
+
+/*! Return the time spent by pfq_read in each phase of the wait strategy. */
+
+extern int pfq_get_rx_wait_stats(pfq_t const *q, struct pfq_wait_stats *stats);
+
+
 /*! Read packets in place. */
 /*!
- * Wait for packets and return the number of packets available in the queue.
+ * Wait for packets (according to the wait strategy) and return the number of packets available in the queue.
  * Packets are stored in the memory mapped queue of the socket.
  * The timeout is specified in microseconds.
+ *
+ * With multiple Rx rings, nq is the first non-empty ring and the others are
+ * linked through nq->next; the returned value is the total number of packets.
  */
 
 extern int pfq_read(pfq_t *q, struct pfq_net_queue *nq, long int microseconds);
@@ -509,7 +821,7 @@ extern int pfq_read(pfq_t *q, struct pfq_net_queue *nq, long int microseconds);
 /*! Receive packets in the given mutable buffer. */
 /*!
  * Wait for packets and return the number of packets available.
- * Packets are stored in the given buffer.
+ * Packets are stored in the given buffer (rings are merged one after the other).
  * It is possible to specify a timeout in microseconds.
  */
 
@@ -559,6 +871,8 @@ extern int pfq_get_group_counters(pfq_t const *q, int gid, struct pfq_counters *
 /*! Flush the Tx queue(s). */
 /*!
  * Transmit the packets in the Tx queues of the socket.
+ * With zero-copy transmission, the flush fails with errno EAGAIN
+ * when the frames of the previous one are still in flight.
  */
 
 extern int pfq_tx_queue_flush(pfq_t *q, int queue);
@@ -82,8 +82,8 @@ sender xs = do
     fp <- Q.open' 64 1024 1024
 
     withForeignPtr fp  $ \q -> do
-            Q.enable q
             Q.bindTxOnCpu q dev queue core
+            Q.enable q
 
             if core /= -1
             then do
@@ -159,6 +159,8 @@ struct pcap_md {
     struct pfq_data
     {
         pfq_t          *q;
+        struct pfq_net_queue nq;
+        struct pfq_net_queue *ring;
         pfq_iterator_t 	current;
         pfq_iterator_t 	end;
         uint64_t        ifs_promisc;
@@ -234,13 +236,16 @@ struct pcap_opt {
 		int caplen;
 
 		int rx_slots;
+		int rx_varlen;
+		int rx_rings;
+		int rx_mode;
 		int tx_slots;
 
 		int tx_flush;
         	int tx_async;
 
-		int tx_queue[4];
-		int tx_task[4];
+		int tx_queue[Q_MAX_TX_QUEUES];
+		int tx_task[Q_MAX_TX_QUEUES];
 
 		const char *vlan;
 		const char *comp;
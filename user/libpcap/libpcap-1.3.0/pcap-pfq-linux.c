@@ -475,7 +475,7 @@ pfq_count_tx_queues(struct pfq_opt const *opt)
 {
 	size_t n, txq = 0;
 
-        for(n = 0; n < 4; n++)
+        for(n = 0; n < Q_MAX_TX_QUEUES; n++)
         {
         	if (opt->tx_queue[n] != Q_ANY_QUEUE ||
 		    	opt->tx_task[n]  != Q_NO_KTHREAD)
@@ -496,14 +496,22 @@ pfq_getenv(pcap_t *handle)
        		.group    = -1,
        		.caplen   = handle->snapshot,
        		.rx_slots = 4096,
+       		.rx_varlen = 0,
+       		.rx_rings = 1,
+       		.rx_mode  = Q_RX_MODE_DOUBLE_BUFFER,
 		.tx_slots = 4096,
 		.tx_flush = 1,
 		.tx_async = 0,
-		.tx_queue = {-1, -1, -1, -1},
-		.tx_task  = { Q_NO_KTHREAD, Q_NO_KTHREAD, Q_NO_KTHREAD, Q_NO_KTHREAD },
 		.vlan     = NULL,
 		.comp     = NULL
 	};
+	size_t n;
+
+	for(n = 0; n < Q_MAX_TX_QUEUES; n++)
+	{
+		rc.tx_queue[n] = Q_ANY_QUEUE;
+		rc.tx_task[n]  = Q_NO_KTHREAD;
+	}
 
 	if ((opt = getenv("PFQ_GROUP")))
 		rc.group = atoi(opt);
@@ -514,6 +522,15 @@ pfq_getenv(pcap_t *handle)
 	if ((opt = getenv("PFQ_RX_SLOTS")))
 		rc.rx_slots = atoi(opt);
 
+	if ((opt = getenv("PFQ_RX_VARLEN")))
+		rc.rx_varlen = atoi(opt);
+
+	if ((opt = getenv("PFQ_RX_RINGS")))
+		rc.rx_rings = atoi(opt);
+
+	if ((opt = getenv("PFQ_RX_MODE")))
+		rc.rx_mode = atoi(opt);
+
 	if ((opt = getenv("PFQ_TX_SLOTS")))
 		rc.tx_slots = atoi(opt);
 
@@ -527,14 +544,14 @@ pfq_getenv(pcap_t *handle)
 		rc.comp = opt;
 
 	if ((opt = getenv("PFQ_TX_QUEUE"))) {
-		if (pfq_parse_integers(rc.tx_queue, 4, opt) < 0) {
+		if (pfq_parse_integers(rc.tx_queue, Q_MAX_TX_QUEUES, opt) < 0) {
 			fprintf(stderr, "[PFQ] PFQ_TX_QUEUE parse error!\n");
 			exit(-1);
 		}
 	}
 
 	if ((opt = getenv("PFQ_TX_TASK"))) {
-		if (pfq_parse_integers(rc.tx_task, 4, opt) < 0) {
+		if (pfq_parse_integers(rc.tx_task, Q_MAX_TX_QUEUES, opt) < 0) {
 			fprintf(stderr, "[PFQ] PFQ_TX_TASK parse error!\n");
 			exit(-1);
 		}
@@ -567,6 +584,9 @@ pfq_parse_filename(const char *device)
 #define KEY_tx_task 		6
 #define KEY_vlan 		7
 #define KEY_computation 	8
+#define KEY_rx_varlen 		9
+#define KEY_rx_rings 		10
+#define KEY_rx_mode 		11
 
 
 struct pfq_conf_key {
@@ -581,7 +601,10 @@ struct pfq_conf_key {
 	KEY(tx_flush),
 	KEY(tx_task),
 	KEY(vlan),
-	KEY(computation)
+	KEY(computation),
+	KEY(rx_varlen),
+	KEY(rx_rings),
+	KEY(rx_mode)
 };
 
 
@@ -638,16 +661,19 @@ pfq_parse_config(struct pfq_opt *opt, const char *filename)
 				case KEY_group:  	opt->group 	= atoi(value); 	break;
 				case KEY_caplen:	opt->caplen 	= atoi(value);  break;
 				case KEY_rx_slots: 	opt->rx_slots 	= atoi(value);  break;
+				case KEY_rx_varlen: 	opt->rx_varlen 	= atoi(value);  break;
+				case KEY_rx_rings: 	opt->rx_rings 	= atoi(value);  break;
+				case KEY_rx_mode: 	opt->rx_mode 	= atoi(value);  break;
 				case KEY_tx_slots:	opt->tx_slots 	= atoi(value);  break;
 				case KEY_tx_flush:	opt->tx_flush   = atoi(value);  break;
 				case KEY_tx_queue:  {
-					if (pfq_parse_integers(opt->tx_queue, 4, value) < 0) {
+					if (pfq_parse_integers(opt->tx_queue, Q_MAX_TX_QUEUES, value) < 0) {
 						fprintf(stderr, "[PFQ] %s: parse error at: %s\n", filename, tkey);
 					 	rc = -1;
 					}
 				} break;
 				case KEY_tx_task:   {
-					if (pfq_parse_integers(opt->tx_task, 4, value) < 0) {
+					if (pfq_parse_integers(opt->tx_task, Q_MAX_TX_QUEUES, value) < 0) {
 						fprintf(stderr, "[PFQ] %s: parse error at: %s\n", filename, tkey);
 					 	rc = -1;
 					}
@@ -988,6 +1014,30 @@ pfq_activate_linux(pcap_t *handle)
 		goto fail;
 	}
 
+	/* variable-length slots */
+
+	if (handle->opt.pfq.rx_varlen &&
+	    pfq_varlen_enable(handle->md.pfq.q, 1) == -1) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "%s", pfq_error(handle->md.pfq.q));
+		goto fail;
+	}
+
+	/* Rx rings */
+
+	if (handle->opt.pfq.rx_rings > 1 &&
+	    pfq_set_rx_rings(handle->md.pfq.q, handle->opt.pfq.rx_rings) == -1) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "%s", pfq_error(handle->md.pfq.q));
+		goto fail;
+	}
+
+	/* Rx mode */
+
+	if (handle->opt.pfq.rx_mode != Q_RX_MODE_DOUBLE_BUFFER &&
+	    pfq_set_rx_mode(handle->md.pfq.q, handle->opt.pfq.rx_mode) == -1) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "%s", pfq_error(handle->md.pfq.q));
+		goto fail;
+	}
+
 	/* enable socket */
 
 	if (pfq_enable(handle->md.pfq.q) == -1) {
@@ -1095,7 +1145,7 @@ static int
 pfq_read_linux(pcap_t *handle, int max_packets, pcap_handler callback, u_char *user)
 {
         int start = handle->md.packets_read;
-	struct pfq_net_queue nq;
+	struct pfq_net_queue *nq = handle->md.pfq.ring;
 	int n = max_packets;
 
 	pfq_iterator_t it, it_end;
@@ -1103,55 +1153,65 @@ pfq_read_linux(pcap_t *handle, int max_packets, pcap_handler callback, u_char *u
 	it =  handle->md.pfq.current;
 	it_end = handle->md.pfq.end;
 
-        if (it == it_end) {
+        if (it == it_end && (nq == NULL || nq->next == NULL)) {
+
+		nq = &handle->md.pfq.nq;
 
-        	if (pfq_read(handle->md.pfq.q, &nq, handle->md.timeout > 0 ? handle->md.timeout * 1000 : 1000000) < 0) {
+        	if (pfq_read(handle->md.pfq.q, nq, handle->md.timeout > 0 ? handle->md.timeout * 1000 : 1000000) < 0) {
 			snprintf(handle->errbuf, sizeof(handle->errbuf), "PFQ read error");
 			return PCAP_ERROR;
 		}
 
-		it = handle->md.pfq.current = pfq_net_queue_begin(&nq);
-	        it_end = handle->md.pfq.end = pfq_net_queue_end(&nq);
+		it = handle->md.pfq.current = pfq_net_queue_begin(nq);
+	        it_end = handle->md.pfq.end = pfq_net_queue_end(nq);
 	}
 
-	for(; (max_packets <= 0 || n > 0) && (it != it_end); it = pfq_net_queue_next(&nq, it))
+	/* rings of a multi-ring socket are consumed one after the other */
+
+	for(;; nq = nq->next, it = pfq_net_queue_begin(nq), it_end = pfq_net_queue_end(nq))
 	{
-		struct pcap_pkthdr pcap_h;
-		struct pfq_pkthdr *h;
-                uint16_t vlan_tci;
-		const char *pkt;
+		for(; (max_packets <= 0 || n > 0) && (it != it_end); it = pfq_net_queue_next(nq, it))
+		{
+			struct pcap_pkthdr pcap_h;
+			struct pfq_pkthdr *h;
+	                uint16_t vlan_tci;
+			const char *pkt;
 
-		while (!pfq_iterator_ready(&nq, it))
-			pfq_yield();
+			while (!pfq_iterator_ready(nq, it))
+				pfq_yield();
 
-		h = (struct pfq_pkthdr *)pfq_iterator_header(it);
+			h = (struct pfq_pkthdr *)pfq_iterator_header(it);
 
-		pcap_h.ts.tv_sec  = h->tstamp.tv.sec;
-		pcap_h.ts.tv_usec = h->tstamp.tv.nsec / 1000;
-		pcap_h.caplen     = h->caplen;
-		pcap_h.len        = h->len;
+			pcap_h.ts.tv_sec  = h->tstamp.tv.sec;
+			pcap_h.ts.tv_usec = h->tstamp.tv.nsec / 1000;
+			pcap_h.caplen     = h->caplen;
+			pcap_h.len        = h->len;
 
-		pkt = pfq_iterator_data(it);
+			pkt = pfq_iterator_data(it);
 
-		if ((vlan_tci = h->un.vlan_tci) != 0) {
+			if ((vlan_tci = h->un.vlan_tci) != 0) {
 
-			struct vlan_tag *tag;
+				struct vlan_tag *tag;
 
-			pkt -= VLAN_TAG_LEN;
+				pkt -= VLAN_TAG_LEN;
 
-			memmove((char *)pkt, pkt + VLAN_TAG_LEN, 2 * ETH_ALEN);
+				memmove((char *)pkt, pkt + VLAN_TAG_LEN, 2 * ETH_ALEN);
 
-			tag = (struct vlan_tag *)(pkt + 2 * ETH_ALEN);
-			tag->vlan_tpid = htons(ETH_P_8021Q);
-			tag->vlan_tci  = htons(vlan_tci);
+				tag = (struct vlan_tag *)(pkt + 2 * ETH_ALEN);
+				tag->vlan_tpid = htons(ETH_P_8021Q);
+				tag->vlan_tci  = htons(vlan_tci);
 
-			pcap_h.len += VLAN_TAG_LEN;
-		}
+				pcap_h.len += VLAN_TAG_LEN;
+			}
 
-		callback(user, &pcap_h, pkt);
+			callback(user, &pcap_h, pkt);
 
-		handle->md.packets_read++;
-		n--;
+			handle->md.packets_read++;
+			n--;
+		}
+
+		if (it != it_end || nq->next == NULL)
+			break;
 	}
 
 	if (handle->break_loop) {
@@ -1160,7 +1220,9 @@ pfq_read_linux(pcap_t *handle, int max_packets, pcap_handler callback, u_char *u
 		return PCAP_ERROR_BREAK;
 	}
 
+	handle->md.pfq.ring = nq;
 	handle->md.pfq.current = it;
+	handle->md.pfq.end = it_end;
 	return handle->md.packets_read-start;
 }
 
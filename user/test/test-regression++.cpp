@@ -1,4 +1,10 @@
 #include <future>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
 #include <system_error>
 
 #include <sys/types.h>
@@ -119,6 +125,19 @@ Context(PFQ)
     }
 
 
+    Test(timestamp_error)
+    {
+        pfq::socket x;
+        AssertThrow(x.timestamp_error());
+
+        x.open(pfq::group_policy::undefined, 64);
+        Assert(x.timestamp_error(), is_equal_to(0));
+
+        x.timestamp_source(Q_TSTAMP_BATCH);
+        Assert(x.timestamp_error(), is_greater_equal(0));
+    }
+
+
     Test(caplen)
     {
         pfq::socket x;
@@ -169,6 +188,30 @@ Context(PFQ)
     }
 
 
+    Test(rx_wait_strategy)
+    {
+        pfq::socket x;
+        AssertThrow(x.rx_wait_strategy());
+
+        x.open(pfq::group_policy::undefined, 64);
+        auto ws = x.rx_wait_strategy();
+        Assert(ws.spin.count(), is_equal_to(0));
+        Assert(ws.block, is_equal_to(false));
+
+        AssertThrow(x.rx_wait_strategy(pfq::wait_strategy{std::chrono::nanoseconds(-1), std::chrono::nanoseconds(0), false}));
+
+        x.rx_wait_strategy(pfq::wait_strategy{std::chrono::microseconds(10), std::chrono::microseconds(10), true});
+        x.enable();
+
+        auto q = x.read(1000);
+        Assert(q.size(), is_equal_to(0UL));
+
+        auto stats = x.rx_wait_stats();
+        Assert(stats.spin_time >= std::chrono::microseconds(10), is_equal_to(true));
+        Assert(stats.block, is_equal_to(1UL));
+    }
+
+
     Test(rx_slot_size)
     {
         pfq::socket x;
@@ -534,6 +577,444 @@ Context(PFQ)
     }
 
 
+    Test(tx_queues)
+    {
+        pfq::socket q(64);
+        Assert(q.tx_queues(), is_equal_to(0));
+
+        for(int n = 0; n < 16; n++)
+            q.bind_tx("lo", -1);
+
+        Assert(q.tx_queues(), is_equal_to(16));
+        q.enable();
+
+        AssertThrow(q.bind_tx("lo", -1));
+        AssertThrow(q.unbind_tx());
+        AssertNoThrow(q.tx_queue_flush(15));
+    }
+
+
+    Test(tx_rate)
+    {
+        pfq::socket q(64);
+        Assert(q.tx_rate(0).pps, is_equal_to(uint64_t(0)));
+
+        q.tx_rate(-1, 1000000, 0, 32);
+        Assert(q.tx_rate(0).pps, is_equal_to(uint64_t(1000000)));
+        Assert(q.tx_rate(0).burst, is_equal_to(32U));
+
+        AssertThrow(q.tx_rate(64, 1000));
+
+        q.tx_rate(0, 0);
+        Assert(q.tx_rate(0).pps, is_equal_to(uint64_t(0)));
+    }
+
+
+    Test(tx_rate_burst)
+    {
+        // time to flush n packets through the shaped Tx queue 0 on lo...
+
+        auto flush = [&](uint64_t pps, unsigned int burst, int n) -> std::chrono::microseconds
+        {
+            pfq::socket q(64);
+
+            q.tx_rate(0, pps, 0, burst);
+            q.bind_tx("lo", -1);
+            q.enable();
+
+            char packet[64] = { 0 };
+
+            for(int i = 0; i < n; i++)
+                Assert(q.inject(pfq::const_buffer(packet, sizeof(packet)), 0), is_equal_to(true));
+
+            auto begin = std::chrono::steady_clock::now();
+            q.tx_queue_flush(0);
+            auto end = std::chrono::steady_clock::now();
+
+            auto s = q.stats();
+            Assert(s.sent + s.disc, is_equal_to(static_cast<unsigned long>(n)));
+
+            return std::chrono::duration_cast<std::chrono::microseconds>(end - begin);
+        };
+
+        // 101 packets at 1000 pps: 100 msec with burst 1, 50 msec with burst 51
+
+        auto paced = flush(1000, 1, 101);
+        auto burst = flush(1000, 51, 101);
+
+        Assert(paced.count(), is_greater_equal(90000));
+        Assert(burst.count(), is_greater_equal(45000));
+        Assert(burst.count(), is_less(paced.count()));
+    }
+
+
+    Test(socket_options)
+    {
+        // option: default, a value rejected (if any), a value accepted and whether it can be changed while enabled...
+
+        struct option
+        {
+            const char *name;
+            std::function<int(pfq::socket &)> get;
+            std::function<void(pfq::socket &, int)> set;
+            int def;
+            bool has_bad; int bad;
+            int value;
+            bool runtime;
+        };
+
+        std::vector<option> options =
+        {
+            { "timestamp source",
+              [](pfq::socket &q) { return q.timestamp_source(); },
+              [](pfq::socket &q, int v) { q.timestamp_source(v); },             Q_TSTAMP_OFF, true, 42, Q_TSTAMP_SOFTWARE, true },
+            { "varlen",
+              [](pfq::socket &q) { return static_cast<int>(q.varlen_enabled()); },
+              [](pfq::socket &q, int v) { q.varlen_enable(v); },                0, false, 0, 1, false },
+            { "rx rings",
+              [](pfq::socket &q) { return static_cast<int>(q.rx_rings()); },
+              [](pfq::socket &q, int v) { q.rx_rings(static_cast<size_t>(v)); }, 1, true, 0, 4, false },
+            { "rx mode",
+              [](pfq::socket &q) { return q.rx_mode(); },
+              [](pfq::socket &q, int v) { q.rx_mode(v); },                      Q_RX_MODE_DOUBLE_BUFFER, true, 42, Q_RX_MODE_CONTINUOUS, false },
+            { "rx layout",
+              [](pfq::socket &q) { return q.rx_layout(); },
+              [](pfq::socket &q, int v) { q.rx_layout(v); },                    Q_RX_LAYOUT_INLINE, true, 42, Q_RX_LAYOUT_SPLIT, false },
+            { "shmem node",
+              [](pfq::socket &q) { return q.shmem_node(); },
+              [](pfq::socket &q, int v) { q.shmem_node(v); },                   Q_NODE_ANY, true, 4096, 0, false },
+            { "shmem hugepages",
+              [](pfq::socket &q) { return q.shmem_hugepages(); },
+              [](pfq::socket &q, int v) { q.shmem_hugepages(v); },              Q_HUGEPAGES_AUTO, true, 42, Q_HUGEPAGES_OFF, false },
+            { "rx wakeup watermark",
+              [](pfq::socket &q) { return static_cast<int>(q.rx_wakeup_watermark()); },
+              [](pfq::socket &q, int v) { q.rx_wakeup_watermark(static_cast<size_t>(v)); }, Q_WAKEUP_WATERMARK_DEFAULT, true, 0, 64, true },
+            { "rx wakeup timeout",
+              [](pfq::socket &q) { return static_cast<int>(q.rx_wakeup_timeout().count()); },
+              [](pfq::socket &q, int v) { q.rx_wakeup_timeout(std::chrono::microseconds(v)); }, Q_WAKEUP_TIMEOUT_OFF, true, Q_WAKEUP_TIMEOUT_MAX+1, 100, true },
+            { "rx busy poll",
+              [](pfq::socket &q) { return static_cast<int>(q.rx_busy_poll_enabled()); },
+              [](pfq::socket &q, int v) { q.rx_busy_poll_enable(v); },          0, false, 0, 1, true },
+            { "tx zerocopy",
+              [](pfq::socket &q) { return static_cast<int>(q.tx_zerocopy_enabled()); },
+              [](pfq::socket &q, int v) { q.tx_zerocopy_enable(v); },           0, false, 0, 1, false },
+        };
+
+        for(auto const &o : options)
+        {
+            std::cout << "    " << o.name << std::endl;
+
+            pfq::socket closed;
+            AssertThrow(o.set(closed, o.value));
+
+            pfq::socket q(64);
+            Assert(o.get(q), is_equal_to(o.def));
+
+            if (o.has_bad) {
+                AssertThrow(o.set(q, o.bad));
+                Assert(o.get(q), is_equal_to(o.def));
+            }
+
+            o.set(q, o.value);
+            Assert(o.get(q), is_equal_to(o.value));
+
+            q.enable();
+            if (o.runtime) {
+                o.set(q, o.def);
+                Assert(o.get(q), is_equal_to(o.def));
+            }
+            else {
+                AssertThrow(o.set(q, o.def));
+                Assert(o.get(q), is_equal_to(o.value));
+            }
+        }
+    }
+
+
+    Test(rx_option_conflicts)
+    {
+        // batch commit requires the continuous ring, variable-length slots the inline double buffer...
+
+        pfq::socket x(64);
+        AssertThrow(x.batch_commit_enable(true));
+
+        x.rx_mode(Q_RX_MODE_CONTINUOUS);
+        x.batch_commit_enable(true);
+        Assert(x.batch_commit_enabled(), is_equal_to(true));
+        AssertThrow(x.rx_mode(Q_RX_MODE_DOUBLE_BUFFER));
+        AssertThrow(x.varlen_enable(true));
+
+        x.enable();
+        AssertThrow(x.batch_commit_enable(false));
+
+        pfq::socket y(64);
+        y.rx_layout(Q_RX_LAYOUT_SPLIT);
+        AssertThrow(y.varlen_enable(true));
+    }
+
+
+    // loopback capture: frames with a local experimental ethertype, alternately len and len/2 bytes long...
+
+    const int eth_type = 0x88b5;
+
+    struct capture
+    {
+        int packets;
+        int intact;
+        int stamped;
+        int long_frames;
+    };
+
+    std::vector<char>
+    make_frame(size_t len)
+    {
+        std::vector<char> frame(len);
+
+        std::fill(frame.begin(), frame.begin() + 6, static_cast<char>(0xff));
+        std::fill(frame.begin() + 6, frame.begin() + 12, 0);
+        frame[12] = static_cast<char>(eth_type >> 8);
+        frame[13] = static_cast<char>(eth_type & 0xff);
+
+        for(size_t n = 14; n < len; n++)
+            frame[n] = static_cast<char>(n);
+
+        return frame;
+    }
+
+    void
+    inject_frames(pfq::socket &tx, int n, size_t len)
+    {
+        auto frame = make_frame(len);
+
+        tx.bind_tx("lo", -1);
+        tx.enable();
+
+        for(int i = 0; i < n; i++)
+        {
+            auto l = i & 1 ? len/2 : len;
+            if (!tx.inject(pfq::const_buffer(frame.data(), l), 0))
+                throw std::runtime_error("inject");
+        }
+
+        tx.tx_queue_flush(0);
+    }
+
+    capture
+    lo_capture(pfq::socket &q, bool zerocopy, int n, size_t len)
+    {
+        capture c = { 0, 0, 0, 0 };
+        auto caplen = q.caplen();
+
+        pfq::socket tx(64);
+        tx.tx_zerocopy_enable(zerocopy);
+        inject_frames(tx, n, len);
+
+        auto handler = [&](char *, const pfq_pkthdr *h, const char *data)
+        {
+            if (h->caplen < 14 || static_cast<unsigned char>(data[12]) != (eth_type >> 8) ||
+                                  static_cast<unsigned char>(data[13]) != (eth_type & 0xff))
+                return;
+
+            bool intact = h->caplen == std::min<size_t>(h->len, caplen);
+            for(size_t i = 14; intact && i < h->caplen; i++)
+                intact = data[i] == static_cast<char>(i);
+
+            c.packets++;
+            c.intact += intact;
+            c.stamped += h->tstamp.tv64 != 0;
+            c.long_frames += h->len > 64;
+        };
+
+        for(int i = 0; i < 100 && c.packets < n; i++)
+            q.dispatch(handler, 10000);
+
+        return c;
+    }
+
+
+    Test(lo_capture)
+    {
+        // Rx and Tx configurations: every frame is captured intact, twice in a row...
+
+        struct capture_test
+        {
+            const char *name;
+            std::function<void(pfq::socket &)> setup;
+            size_t caplen;
+            bool zerocopy;
+            size_t len;
+            bool optional;      // the socket may fail to enable (e.g. no hugepages)
+            bool stamped;       // every packet has a timestamp
+        };
+
+        auto none = [](pfq::socket &) {};
+
+        std::vector<capture_test> tests =
+        {
+            { "default",          none,                                                   64,   false, 120,  false, false },
+            { "varlen",           [](pfq::socket &q) { q.varlen_enable(true); },          64,   false, 120,  false, false },
+            { "rx rings",         [](pfq::socket &q) { q.rx_rings(4); },                  64,   false, 120,  false, false },
+            { "continuous ring",  [](pfq::socket &q) { q.rx_mode(Q_RX_MODE_CONTINUOUS); }, 64,  false, 120,  false, false },
+            { "batch commit",     [](pfq::socket &q) { q.rx_mode(Q_RX_MODE_CONTINUOUS);
+                                                       q.batch_commit_enable(true); },    64,   false, 120,  false, false },
+            { "split layout",     [](pfq::socket &q) { q.rx_layout(Q_RX_LAYOUT_SPLIT); }, 64,   false, 120,  false, false },
+            { "shmem node",       [](pfq::socket &q) { q.shmem_node(0); },                64,   false, 120,  false, false },
+            { "kernel hugepages", [](pfq::socket &q) { q.shmem_hugepages(Q_HUGEPAGES_REQUIRE); }, 64, false, 120, true, false },
+            { "software tstamp",  [](pfq::socket &q) { q.timestamp_source(Q_TSTAMP_SOFTWARE); }, 64, false, 120, false, true },
+            { "batch tstamp",     [](pfq::socket &q) { q.timestamp_source(Q_TSTAMP_BATCH); }, 64,  false, 120, false, true },
+            { "tx zerocopy",      none,                                                   1514, true,  1000, false, false },
+        };
+
+        const int n = 32;
+
+        for(auto const &t : tests)
+        {
+            std::cout << "    " << t.name << std::endl;
+
+            pfq::socket q(t.caplen);
+            t.setup(q);
+            q.bind("lo", -1);
+
+            try
+            {
+                q.enable();
+            }
+            catch(pfq::pfq_error &)
+            {
+                Assert(t.optional, is_equal_to(true));
+                continue;
+            }
+
+            for(int round = 0; round < 2; round++)
+            {
+                auto c = lo_capture(q, t.zerocopy, n, t.len);
+
+                Assert(c.packets, is_equal_to(n));
+                Assert(c.intact, is_equal_to(n));
+                Assert(c.long_frames, is_equal_to(n/2));
+                if (t.stamped)
+                    Assert(c.stamped, is_equal_to(n));
+            }
+        }
+    }
+
+
+    Test(rx_wakeup_timeout)
+    {
+        // below the watermark the blocked reader is woken up by the latency timer...
+
+        pfq::socket q(64);
+
+        q.rx_wakeup_watermark(16);
+        q.rx_wakeup_timeout(std::chrono::milliseconds(1));
+        q.rx_wait_strategy(pfq::wait_strategy{std::chrono::nanoseconds(0), std::chrono::nanoseconds(0), true});
+        q.bind("lo", -1);
+        q.enable();
+
+        std::thread t([] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            pfq::socket tx(64);
+            inject_frames(tx, 2, 64);
+        });
+
+        size_t packets = 0;
+        auto begin = std::chrono::steady_clock::now();
+
+        while (packets < 2)
+            packets += q.dispatch([](char *, const pfq_pkthdr *, const char *) {}, 1000000);
+
+        auto end = std::chrono::steady_clock::now();
+        t.join();
+
+        Assert(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count(), is_less(500));
+    }
+
+
+    // read a counter of a /proc/net/pfq file, in the form "name : value"...
+
+    long
+    proc_counter(const char *file, std::string const &name)
+    {
+        std::ifstream in(file);
+        std::string line, key, colon;
+        long value = -1;
+
+        while (std::getline(in, line))
+        {
+            std::istringstream ss(line);
+            long v;
+            if ((ss >> key >> colon >> v) && key == name)
+                value = v;
+        }
+        return value;
+    }
+
+    // users of the BPF filter of a group, from /proc/net/pfq/groups...
+
+    int
+    proc_group_bpf_users(int gid)
+    {
+        std::ifstream in("/proc/net/pfq/groups");
+        std::string line;
+        int users = -1;
+
+        while (std::getline(in, line))
+        {
+            int id, n;
+            if (sscanf(line.c_str(), "%d: %*u %*u %*u %*u %*u %*u %*d %*d %d", &id, &n) == 2 && id == gid)
+                users = n;
+        }
+        return users;
+    }
+
+
+    Test(drop_no_group)
+    {
+        // a socket is open, but no group listens to lo...
+
+        auto before = proc_counter("/proc/net/pfq/stats", "dropped");
+        Assert(before, is_greater_equal(0));
+
+        pfq::socket tx(64);
+        inject_frames(tx, 16, 64);
+
+        auto after = before;
+        for(int n = 0; n < 100 && after < before + 16; n++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            after = proc_counter("/proc/net/pfq/stats", "dropped");
+        }
+
+        Assert(after, is_greater_equal(before + 16));
+    }
+
+
+    Test(group_fprog_shared)
+    {
+        sock_filter ipv4[] = { { 0x28, 0, 0, 12 }, { 0x15, 0, 1, 0x0800 }, { 0x6, 0, 0, 65535 }, { 0x6, 0, 0, 0 } };
+        sock_filter ipv6[] = { { 0x28, 0, 0, 12 }, { 0x15, 0, 1, 0x86dd }, { 0x6, 0, 0, 65535 }, { 0x6, 0, 0, 0 } };
+
+        pfq::socket x(64), y(64);
+        auto gx = x.group_id(), gy = y.group_id();
+
+        Assert(gx, is_not_equal_to(gy));
+
+        // identical programs: one filter for both groups...
+
+        x.set_group_fprog(gx, sock_fprog{ 4, ipv4 });
+        y.set_group_fprog(gy, sock_fprog{ 4, ipv4 });
+        Assert(proc_group_bpf_users(gx), is_equal_to(2));
+        Assert(proc_group_bpf_users(gy), is_equal_to(2));
+
+        y.set_group_fprog(gy, sock_fprog{ 4, ipv6 });
+        Assert(proc_group_bpf_users(gx), is_equal_to(1));
+        Assert(proc_group_bpf_users(gy), is_equal_to(1));
+
+        x.reset_group_fprog(gx);
+        Assert(proc_group_bpf_users(gx), is_equal_to(0));
+    }
+
+
     Test(tx_thread)
     {
         pfq::socket q(64);
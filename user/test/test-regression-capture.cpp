@@ -313,6 +313,16 @@ unsigned int hardware_concurrency()
 }
 
 
+std::string rx_engine()
+{
+    std::ifstream param("/sys/module/pfq/parameters/rx_engine");
+    int engine;
+    if (!(param >> engine))
+        return "unknown";
+    return engine == 1 ? "packet-major" : "group-major";
+}
+
+
 void usage(const char *name)
 {
     throw std::runtime_error(std::string("usage: ")
@@ -435,6 +445,7 @@ try
 
     std::cout << "Caplen: " << opt::caplen << std::endl;
     std::cout << "Slots : " << opt::slots << std::endl;
+    std::cout << "Engine: " << rx_engine() << std::endl;
 
     char errbuf[PCAP_ERRBUF_SIZE];
 
@@ -3,7 +3,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <time.h>
 #include <pfq.h>
 
 #include <pthread.h>
@@ -63,6 +66,23 @@ void test_timestamp()
 }
 
 
+void test_timestamp_error()
+{
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	assert(pfq_get_timestamp_error(q) == 0);
+	assert(pfq_set_timestamp_source(q, Q_TSTAMP_BATCH) == 0);
+	assert(pfq_get_timestamp_source(q) == Q_TSTAMP_BATCH);
+	assert(pfq_get_timestamp_error(q) >= 0);
+
+	assert(pfq_set_timestamp_source(q, Q_TSTAMP_SOFTWARE) == 0);
+	assert(pfq_get_timestamp_error(q) == 0);
+
+	pfq_close(q);
+}
+
+
 void test_caplen()
 {
 	pfq_t * q = pfq_open(64, 1024);
@@ -111,6 +131,39 @@ void test_rx_slots()
 }
 
 
+void test_rx_wait_strategy()
+{
+	struct pfq_wait_strategy ws;
+	struct pfq_wait_stats stats;
+	struct pfq_net_queue nq;
+
+	pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+	assert(pfq_get_rx_wait_strategy(q, &ws) == 0);
+	assert(ws.spin_ns == 0 && ws.yield_ns == 0 && ws.block == 0);
+
+	ws.spin_ns = -1;
+	assert(pfq_set_rx_wait_strategy(q, &ws) == -1);
+
+	ws.spin_ns  = 10000;
+	ws.yield_ns = 10000;
+	ws.block    = 1;
+	assert(pfq_set_rx_wait_strategy(q, &ws) == 0);
+
+	assert(pfq_enable(q) == 0);
+	assert(pfq_read(q, &nq, 1000) == 0);
+
+	assert(pfq_get_rx_wait_stats(q, &stats) == 0);
+	assert(stats.spin_ns >= 10000);
+	assert(stats.yield_ns > 0);
+	assert(stats.block == 1);
+
+	assert(pfq_disable(q) == 0);
+	pfq_close(q);
+}
+
+
 void test_tx_slots()
 {
 	pfq_t * q = pfq_open_(64, 1, 2048);
@@ -574,6 +627,504 @@ void test_bind_tx()
 }
 
 
+void test_tx_queues()
+{
+        pfq_t * q = pfq_open(64, 1024);
+        int n;
+
+        assert(pfq_get_tx_queues(q) == 0);
+
+        for(n = 0; n < 16; n++)
+        	assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+
+        assert(pfq_get_tx_queues(q) == 16);
+        assert(pfq_enable(q) == 0);
+
+        /* no memory reserved for additional queues */
+
+        assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == -1);
+        assert(pfq_unbind_tx(q) == -1);
+
+        assert(pfq_inject(q, "packet", 6, 0, Q_ANY_QUEUE) == 6);
+        assert(pfq_tx_queue_flush(q, 15) == 0);
+        assert(pfq_tx_queue_flush(q, 16) == -1);
+
+        assert(pfq_disable(q) == 0);
+        assert(pfq_unbind_tx(q) == 0);
+        assert(pfq_get_tx_queues(q) == 0);
+
+        pfq_close(q);
+}
+
+
+void test_tx_rate()
+{
+        pfq_t * q = pfq_open(64, 1024);
+        struct pfq_tx_rate rate;
+
+        assert(pfq_get_tx_rate(q, 0, &rate) == 0);
+        assert(rate.pps == 0 && rate.bps == 0);
+
+        assert(pfq_set_tx_rate(q, Q_ANY_QUEUE, 1000000, 0, 32) == 0);
+        assert(pfq_get_tx_rate(q, 0, &rate) == 0);
+        assert(rate.pps == 1000000 && rate.bps == 0 && rate.burst == 32);
+
+        assert(pfq_set_tx_rate(q, Q_MAX_TX_QUEUES, 1000, 0, 1) == -1);
+
+        assert(pfq_set_tx_rate(q, 0, 0, 0, 0) == 0);
+        assert(pfq_get_tx_rate(q, 0, &rate) == 0);
+        assert(rate.pps == 0 && rate.bps == 0);
+
+        pfq_close(q);
+}
+
+
+/* time (usec) to flush n packets through the shaped Tx queue 0 on lo */
+
+static long tx_rate_flush_usec(uint64_t pps, unsigned int burst, int n)
+{
+        pfq_t * q = pfq_open(64, 1024);
+        char packet[64] = { 0 };
+        struct pfq_stats stats;
+        struct timespec begin, end;
+        int i;
+
+        assert(pfq_set_tx_rate(q, 0, pps, 0, burst) == 0);
+        assert(pfq_bind_tx(q, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+        assert(pfq_enable(q) == 0);
+
+        for(i = 0; i < n; i++)
+                assert(pfq_inject(q, packet, sizeof(packet), 0, Q_ANY_QUEUE) == sizeof(packet));
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        assert(pfq_tx_queue_flush(q, 0) == 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        assert(pfq_get_stats(q, &stats) == 0);
+        assert(stats.sent + stats.disc == (unsigned long)n);
+
+        pfq_close(q);
+
+        return (end.tv_sec - begin.tv_sec) * 1000000 + (end.tv_nsec - begin.tv_nsec) / 1000;
+}
+
+
+void test_tx_rate_burst()
+{
+        /* 101 packets at 1000 pps: 100 msec with burst 1, 50 msec with burst 51 */
+
+        long paced = tx_rate_flush_usec(1000, 1, 101);
+        long burst = tx_rate_flush_usec(1000, 51, 101);
+
+        assert(paced >= 90000);
+        assert(burst >= 45000 && burst < paced);
+}
+
+
+/*
+ * socket options with a getter and a setter: the default, a value rejected
+ * (if any), a value accepted and whether it can be changed while enabled.
+ */
+
+static int get_rx_rings(pfq_t const *q) { return (int)pfq_get_rx_rings(q); }
+static int set_rx_rings(pfq_t *q, int value) { return pfq_set_rx_rings(q, (size_t)value); }
+static int set_rx_wakeup_watermark(pfq_t *q, int value) { return pfq_set_rx_wakeup_watermark(q, (size_t)value); }
+static int set_rx_wakeup_timeout(pfq_t *q, int value) { return pfq_set_rx_wakeup_timeout(q, (unsigned int)value); }
+
+struct socket_option
+{
+        const char *name;
+        int (*get)(pfq_t const *);
+        int (*set)(pfq_t *, int);
+        int def;
+        int has_bad, bad;
+        int value;
+        int runtime;
+};
+
+static struct socket_option socket_options[] =
+{
+        { "timestamp source",    pfq_get_timestamp_source,     pfq_set_timestamp_source, Q_TSTAMP_OFF,               1, 42,                     Q_TSTAMP_SOFTWARE,    1 },
+        { "varlen",              pfq_is_varlen_enabled,        pfq_varlen_enable,        0,                          0, 0,                      1,                    0 },
+        { "rx rings",            get_rx_rings,                 set_rx_rings,             1,                          1, 0,                      4,                    0 },
+        { "rx mode",             pfq_get_rx_mode,              pfq_set_rx_mode,          Q_RX_MODE_DOUBLE_BUFFER,    1, 42,                     Q_RX_MODE_CONTINUOUS, 0 },
+        { "rx layout",           pfq_get_rx_layout,            pfq_set_rx_layout,        Q_RX_LAYOUT_INLINE,         1, 42,                     Q_RX_LAYOUT_SPLIT,    0 },
+        { "shmem node",          pfq_get_shmem_node,           pfq_set_shmem_node,       Q_NODE_ANY,                 1, 4096,                   0,                    0 },
+        { "shmem hugepages",     pfq_get_shmem_hugepages,      pfq_set_shmem_hugepages,  Q_HUGEPAGES_AUTO,           1, 42,                     Q_HUGEPAGES_OFF,      0 },
+        { "rx wakeup watermark", pfq_get_rx_wakeup_watermark,  set_rx_wakeup_watermark,  Q_WAKEUP_WATERMARK_DEFAULT, 1, 0,                      64,                   1 },
+        { "rx wakeup timeout",   pfq_get_rx_wakeup_timeout,    set_rx_wakeup_timeout,    Q_WAKEUP_TIMEOUT_OFF,       1, Q_WAKEUP_TIMEOUT_MAX+1, 100,                  1 },
+        { "rx busy poll",        pfq_is_rx_busy_poll_enabled,  pfq_rx_busy_poll_enable,  0,                          0, 0,                      1,                    1 },
+        { "tx zerocopy",         pfq_is_tx_zerocopy_enabled,   pfq_tx_zerocopy_enable,   0,                          0, 0,                      1,                    0 },
+};
+
+
+void test_socket_options()
+{
+        size_t n;
+
+        for(n = 0; n < sizeof(socket_options)/sizeof(socket_options[0]); n++)
+        {
+                struct socket_option const *o = &socket_options[n];
+                pfq_t * q = pfq_open(64, 1024);
+                assert(q);
+
+                fprintf(stdout, "    %s\n", o->name);
+
+                assert(o->get(q) == o->def);
+                if (o->has_bad) {
+                        assert(o->set(q, o->bad) == -1);
+                        assert(o->get(q) == o->def);
+                }
+
+                assert(o->set(q, o->value) == 0);
+                assert(o->get(q) == o->value);
+
+                assert(pfq_enable(q) == 0);
+                assert(o->set(q, o->def) == (o->runtime ? 0 : -1));
+                assert(o->get(q) == (o->runtime ? o->def : o->value));
+                assert(pfq_disable(q) == 0);
+
+                pfq_close(q);
+        }
+}
+
+
+void test_rx_option_conflicts()
+{
+        pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+        /* batch commit requires the continuous ring, variable-length slots the inline double buffer */
+
+        assert(pfq_batch_commit_enable(q, 1) == -1);
+        assert(pfq_set_rx_mode(q, Q_RX_MODE_CONTINUOUS) == 0);
+        assert(pfq_batch_commit_enable(q, 1) == 0);
+        assert(pfq_is_batch_commit_enabled(q) == 1);
+        assert(pfq_set_rx_mode(q, Q_RX_MODE_DOUBLE_BUFFER) == -1);
+        assert(pfq_varlen_enable(q, 1) == -1);
+
+        assert(pfq_enable(q) == 0);
+        assert(pfq_batch_commit_enable(q, 0) == -1);
+        assert(pfq_disable(q) == 0);
+        pfq_close(q);
+
+        q = pfq_open(64, 1024);
+        assert(pfq_set_rx_layout(q, Q_RX_LAYOUT_SPLIT) == 0);
+        assert(pfq_varlen_enable(q, 1) == -1);
+        pfq_close(q);
+}
+
+
+/*
+ * Loopback capture: frames injected on lo with a local experimental ethertype,
+ * alternately len and len/2 bytes long, and checked by the handler.
+ */
+
+#define TEST_ETH_TYPE   0x88b5
+
+struct capture
+{
+        size_t caplen;
+        int packets;
+        int intact;
+        int stamped;
+        int long_frames;
+};
+
+static void make_frame(char *frame, size_t len)
+{
+        size_t n;
+
+        memset(frame, 0xff, 6);
+        memset(frame + 6, 0, 6);
+        frame[12] = (char)(TEST_ETH_TYPE >> 8);
+        frame[13] = (char)(TEST_ETH_TYPE & 0xff);
+
+        for(n = 14; n < len; n++)
+                frame[n] = (char)n;
+}
+
+static void capture_handler(char *user, const struct pfq_pkthdr *h, const char *data)
+{
+        struct capture *c = (struct capture *)user;
+        size_t n, caplen = h->len < c->caplen ? h->len : c->caplen;
+        int intact;
+
+        if (h->caplen < 14 || (unsigned char)data[12] != (TEST_ETH_TYPE >> 8) || (unsigned char)data[13] != (TEST_ETH_TYPE & 0xff))
+                return;
+
+        intact = h->caplen == caplen;
+        for(n = 14; intact && n < h->caplen; n++)
+                intact = data[n] == (char)n;
+
+        c->packets++;
+        c->intact += intact;
+        c->stamped += h->tstamp.tv64 != 0;
+        c->long_frames += h->len > 64;
+}
+
+static struct capture lo_capture(pfq_t *q, int zerocopy, int n, size_t len)
+{
+        struct capture c = { (size_t)pfq_get_caplen(q), 0, 0, 0, 0 };
+        pfq_t * tx = pfq_open(64, 1024);
+        char frame[1514];
+        int i;
+
+        make_frame(frame, sizeof(frame));
+
+        assert(pfq_tx_zerocopy_enable(tx, zerocopy) == 0);
+        assert(pfq_bind_tx(tx, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+        assert(pfq_enable(tx) == 0);
+
+        for(i = 0; i < n; i++)
+        {
+                size_t l = i & 1 ? len/2 : len;
+                assert(pfq_inject(tx, frame, l, 0, Q_ANY_QUEUE) == (int)l);
+        }
+
+        assert(pfq_tx_queue_flush(tx, 0) == 0);
+
+        for(i = 0; i < 100 && c.packets < n; i++)
+                assert(pfq_dispatch(q, capture_handler, 10000, (char *)&c) >= 0);
+
+        pfq_close(tx);
+        return c;
+}
+
+
+static int setup_varlen(pfq_t *q)       { return pfq_varlen_enable(q, 1); }
+static int setup_rx_rings(pfq_t *q)     { return pfq_set_rx_rings(q, 4); }
+static int setup_continuous(pfq_t *q)   { return pfq_set_rx_mode(q, Q_RX_MODE_CONTINUOUS); }
+static int setup_batch_commit(pfq_t *q) { return setup_continuous(q) || pfq_batch_commit_enable(q, 1); }
+static int setup_split(pfq_t *q)        { return pfq_set_rx_layout(q, Q_RX_LAYOUT_SPLIT); }
+static int setup_node(pfq_t *q)         { return pfq_set_shmem_node(q, 0); }
+static int setup_hugepages(pfq_t *q)    { return pfq_set_shmem_hugepages(q, Q_HUGEPAGES_REQUIRE); }
+static int setup_tstamp(pfq_t *q)       { return pfq_set_timestamp_source(q, Q_TSTAMP_SOFTWARE); }
+static int setup_tstamp_batch(pfq_t *q) { return pfq_set_timestamp_source(q, Q_TSTAMP_BATCH); }
+
+/* Rx and Tx configurations: every frame is captured intact, twice in a row */
+
+struct capture_test
+{
+        const char *name;
+        int (*setup)(pfq_t *);
+        size_t caplen;
+        int zerocopy;
+        size_t len;
+        int optional;   /* the socket may fail to enable (e.g. no hugepages) */
+        int stamped;    /* every packet has a timestamp */
+};
+
+static struct capture_test capture_tests[] =
+{
+        { "default",            NULL,               64,   0, 120,  0, 0 },
+        { "varlen",             setup_varlen,       64,   0, 120,  0, 0 },
+        { "rx rings",           setup_rx_rings,     64,   0, 120,  0, 0 },
+        { "continuous ring",    setup_continuous,   64,   0, 120,  0, 0 },
+        { "batch commit",       setup_batch_commit, 64,   0, 120,  0, 0 },
+        { "split layout",       setup_split,        64,   0, 120,  0, 0 },
+        { "shmem node",         setup_node,         64,   0, 120,  0, 0 },
+        { "kernel hugepages",   setup_hugepages,    64,   0, 120,  1, 0 },
+        { "software tstamp",    setup_tstamp,       64,   0, 120,  0, 1 },
+        { "batch tstamp",       setup_tstamp_batch, 64,   0, 120,  0, 1 },
+        { "tx zerocopy",        NULL,               1514, 1, 1000, 0, 0 },
+};
+
+
+void test_lo_capture()
+{
+        const int n = 32;
+        size_t t;
+        int round;
+
+        for(t = 0; t < sizeof(capture_tests)/sizeof(capture_tests[0]); t++)
+        {
+                struct capture_test const *ct = &capture_tests[t];
+                pfq_t * q = pfq_open(ct->caplen, 1024);
+                assert(q);
+
+                fprintf(stdout, "    %s\n", ct->name);
+
+                if (ct->setup)
+                        assert(ct->setup(q) == 0);
+
+                assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+
+                if (pfq_enable(q) < 0) {
+                        assert(ct->optional);
+                        pfq_close(q);
+                        continue;
+                }
+
+                for(round = 0; round < 2; round++)
+                {
+                        struct capture c = lo_capture(q, ct->zerocopy, n, ct->len);
+
+                        assert(c.packets == n);
+                        assert(c.intact == n);
+                        assert(c.long_frames == n/2);
+                        assert(!ct->stamped || c.stamped == n);
+                }
+
+                pfq_close(q);
+        }
+}
+
+
+/* inject frames on lo after a while, from another thread */
+
+static void *lo_inject_later(void *n)
+{
+        pfq_t * tx = pfq_open(64, 1024);
+        char frame[64];
+        int i;
+
+        make_frame(frame, sizeof(frame));
+
+        usleep(50000);
+
+        assert(pfq_bind_tx(tx, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+        assert(pfq_enable(tx) == 0);
+        for(i = 0; i < *(int *)n; i++)
+                assert(pfq_inject(tx, frame, sizeof(frame), 0, Q_ANY_QUEUE) == sizeof(frame));
+        assert(pfq_tx_queue_flush(tx, 0) == 0);
+
+        pfq_close(tx);
+        return NULL;
+}
+
+
+void test_rx_wakeup_timeout()
+{
+        struct pfq_wait_strategy ws = { 0, 0, 1 };
+        struct capture c = { 64, 0, 0, 0, 0 };
+        struct timespec begin, end;
+        pthread_t t;
+        int n = 2;
+        long msec;
+
+        pfq_t * q = pfq_open(64, 1024);
+        assert(q);
+
+        /* below the watermark the blocked reader is woken up by the latency timer */
+
+        assert(pfq_set_rx_wakeup_watermark(q, 16) == 0);
+        assert(pfq_set_rx_wakeup_timeout(q, 1000) == 0);
+        assert(pfq_set_rx_wait_strategy(q, &ws) == 0);
+        assert(pfq_bind(q, "lo", Q_ANY_QUEUE) == 0);
+        assert(pfq_enable(q) == 0);
+
+        assert(pthread_create(&t, NULL, lo_inject_later, &n) == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        while (c.packets < n)
+                assert(pfq_dispatch(q, capture_handler, 1000000, (char *)&c) >= 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        pthread_join(t, NULL);
+
+        msec = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000;
+        assert(msec < 500);
+
+        pfq_close(q);
+}
+
+
+/* read a counter of a /proc/net/pfq file, in the form "name : value" */
+
+static long proc_counter(const char *file, const char *name)
+{
+        char line[256], key[64];
+        long value = -1, v;
+        FILE *f = fopen(file, "r");
+
+        assert(f);
+        while (fgets(line, sizeof(line), f))
+                if (sscanf(line, "%63s : %ld", key, &v) == 2 && strcmp(key, name) == 0)
+                        value = v;
+        fclose(f);
+        return value;
+}
+
+
+/* users of the BPF filter of a group, from /proc/net/pfq/groups */
+
+static int proc_group_bpf_users(int gid)
+{
+        char line[512];
+        int id, n, users = -1;
+        FILE *f = fopen("/proc/net/pfq/groups", "r");
+
+        assert(f);
+        while (fgets(line, sizeof(line), f))
+                if (sscanf(line, "%d: %*u %*u %*u %*u %*u %*u %*d %*d %d", &id, &n) == 2 && id == gid)
+                        users = n;
+        fclose(f);
+        return users;
+}
+
+
+void test_drop_no_group()
+{
+        pfq_t * tx = pfq_open(64, 1024);
+        char frame[64];
+        long before, after = 0;
+        int n;
+
+        /* a socket is open, but no group listens to lo */
+
+        make_frame(frame, sizeof(frame));
+        before = proc_counter("/proc/net/pfq/stats", "dropped");
+        assert(before >= 0);
+
+        assert(pfq_bind_tx(tx, "lo", Q_ANY_QUEUE, Q_NO_KTHREAD) == 0);
+        assert(pfq_enable(tx) == 0);
+        for(n = 0; n < 16; n++)
+                assert(pfq_inject(tx, frame, sizeof(frame), 0, Q_ANY_QUEUE) == sizeof(frame));
+        assert(pfq_tx_queue_flush(tx, 0) == 0);
+
+        for(n = 0; n < 100 && after < before + 16; n++) {
+                usleep(10000);
+                after = proc_counter("/proc/net/pfq/stats", "dropped");
+        }
+
+        assert(after >= before + 16);
+
+        pfq_close(tx);
+}
+
+
+void test_group_fprog_shared()
+{
+        struct sock_filter ipv4[] = { { 0x28, 0, 0, 12 }, { 0x15, 0, 1, 0x0800 }, { 0x6, 0, 0, 65535 }, { 0x6, 0, 0, 0 } };
+        struct sock_filter ipv6[] = { { 0x28, 0, 0, 12 }, { 0x15, 0, 1, 0x86dd }, { 0x6, 0, 0, 65535 }, { 0x6, 0, 0, 0 } };
+        struct sock_fprog fprog4 = { 4, ipv4 }, fprog6 = { 4, ipv6 };
+
+        pfq_t * x = pfq_open(64, 1024);
+        pfq_t * y = pfq_open(64, 1024);
+        int gx = pfq_group_id(x), gy = pfq_group_id(y);
+
+        assert(gx != gy);
+
+        /* identical programs: one filter for both groups */
+
+        assert(pfq_group_fprog(x, gx, &fprog4) == 0);
+        assert(pfq_group_fprog(y, gy, &fprog4) == 0);
+        assert(proc_group_bpf_users(gx) == 2);
+        assert(proc_group_bpf_users(gy) == 2);
+
+        assert(pfq_group_fprog(y, gy, &fprog6) == 0);
+        assert(proc_group_bpf_users(gx) == 1);
+        assert(proc_group_bpf_users(gy) == 1);
+
+        assert(pfq_group_fprog_reset(x, gx) == 0);
+        assert(proc_group_bpf_users(gx) == 0);
+
+        pfq_close(y);
+        pfq_close(x);
+}
+
+
 void test_tx_thread()
 {
         pfq_t * q = pfq_open(64, 1024);
@@ -628,10 +1179,12 @@ main(int argc __attribute__((unused)), char *argv[]__attribute__((unused)))
 	TEST(test_is_enabled);
 	TEST(test_ifindex);
 	TEST(test_timestamp);
+	TEST(test_timestamp_error);
 	TEST(test_caplen);
 	TEST(test_maxlen);
 	TEST(test_rx_slots);
 	TEST(test_rx_slot_size);
+	TEST(test_rx_wait_strategy);
 	TEST(test_tx_slots);
 
 	TEST(test_bind_device);
@@ -667,6 +1220,16 @@ main(int argc __attribute__((unused)), char *argv[]__attribute__((unused)))
         TEST(test_group_context);
 
         TEST(test_bind_tx);
+        TEST(test_tx_queues);
+        TEST(test_tx_rate);
+        TEST(test_tx_rate_burst);
+
+        TEST(test_socket_options);
+        TEST(test_rx_option_conflicts);
+        TEST(test_lo_capture);
+        TEST(test_rx_wakeup_timeout);
+        TEST(test_drop_no_group);
+        TEST(test_group_fprog_shared);
 
         TEST(test_tx_thread);
 
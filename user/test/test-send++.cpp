@@ -64,10 +64,9 @@ try
 
     pfq::socket q(64, 1024, 1024);
 
-    q.enable();
-
     q.bind_tx(dev, queue, node);
 
+    q.enable();
 
     if (node == -1) {
         send_packets(q, num);
@@ -70,10 +70,10 @@ main(int argc, char *argv[])
 
         pfq_t * q= pfq_open_(64, 1024, 1024);
 
-        pfq_enable(q);
-
         pfq_bind_tx(q, dev, queue, node);
 
+        pfq_enable(q);
+
 	if (node == -1) {
 		send_packets(q, num);
 	}
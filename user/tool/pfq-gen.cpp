@@ -77,16 +77,14 @@ namespace opt
     size_t len     = 1514;
     size_t maxlen  = 0;
     size_t slots   = 4096;
-<<<<<<< HEAD
-=======
     size_t npackets = std::numeric_limits<size_t>::max();
 
     std::atomic_int nthreads;
 
->>>>>>> experimental
     bool   rand_ip = false;
     bool   active_ts = false;
     double rate    = 0;
+    unsigned int burst = 1;
 
     std::vector< std::vector<int> > kcore;
 
@@ -115,21 +113,6 @@ namespace thread
             if (m_bind.queue.empty())
                 m_bind.queue.push_back(-1);
 
-<<<<<<< HEAD
-            auto q = pfq::socket(param::list, param::maxlen{opt::maxlen},
-                                              param::tx_slots{opt::slots});
-
-            std::cout << "thread     : " << id << " -> "  << show_binding(m_bind) << " kcore { ";
-
-            for(auto x : kcpu)
-                std::cout << x  << ' ';
-
-            std::cout << "}" << std::endl;
-
-            for(unsigned int n = 0; n < m_bind.queue.size(); n++)
-            {
-                q.bind_tx (m_bind.dev.at(0).c_str(), m_bind.queue[n], kcpu[n]);
-=======
             auto q = pfq::socket(param::list, param::tx_slots{opt::slots});
 
             std::cout << "thread     : " << id << " -> "  << show_binding(m_bind) << " kcore { ";
@@ -149,7 +132,6 @@ namespace thread
             if (std::any_of(std::begin(kcpu), std::end(kcpu), [](int cpu) { return cpu != -1; }))
             {
                     q.tx_async(true);
->>>>>>> experimental
             }
 
             m_pfq = std::move(q);
@@ -161,6 +143,16 @@ namespace thread
         context(context &&) = default;
         context& operator=(context &&) = default;
 
+        void tx_rate(double mpps, unsigned int burst)
+        {
+            // the kernel shapes each Tx queue with a token bucket...
+
+            auto pps = static_cast<uint64_t>(mpps * 1000000 / m_bind.queue.size());
+
+            for(unsigned int n = 0; n < m_bind.queue.size(); n++)
+                m_pfq.tx_rate(static_cast<int>(n), pps, 0, burst);
+        }
+
         void operator()()
         {
             if (opt::file.empty())
@@ -192,31 +184,10 @@ namespace thread
         {
             auto ip = reinterpret_cast<iphdr *>(m_packet.get() + 14);
 
-            auto delta = std::chrono::nanoseconds(static_cast<uint64_t>(1000/opt::rate));
-
-            auto now = std::chrono::system_clock::now();
-
-<<<<<<< HEAD
             auto len = std::min(opt::len, opt::maxlen);
 
-            for(size_t n = 0;;n++)
-=======
-            auto len = opt::len;
-
             for(size_t n = 0; n < opt::npackets;)
->>>>>>> experimental
             {
-                //
-                // poor-man rate control...
-                //
-
-                if ((n & 8191) == 0)
-                {
-                    while (std::chrono::system_clock::now() < (now + delta*8192))
-                    {}
-                    now = std::chrono::system_clock::now();
-                }
-
                 if (!m_pfq.send_async(pfq::const_buffer(reinterpret_cast<const char *>(m_packet.get()), len), opt::flush))
                 {
                     m_fail->fetch_add(1, std::memory_order_relaxed);
@@ -232,14 +203,6 @@ namespace thread
                     ip->daddr = static_cast<uint32_t>(m_gen());
                 }
 
-<<<<<<< HEAD
-                if (m_pfq.send_async(pfq::const_buffer(reinterpret_cast<const char *>(opt::packet), len), opt::flush))
-                {
-                    m_sent->fetch_add(1, std::memory_order_relaxed);
-                    m_band->fetch_add(len, std::memory_order_relaxed);
-                }
-                else
-=======
                 n++;
             }
         }
@@ -252,13 +215,12 @@ namespace thread
 
             auto now = std::chrono::system_clock::now();
 
-            auto len = opt::len;
+            auto len = std::min(opt::len, opt::maxlen);
 
             for(size_t n = 0; n < opt::npackets;)
             {
                 if (!m_pfq.send_at(pfq::const_buffer(reinterpret_cast<const char *>(m_packet.get()), len), now))
                 {
->>>>>>> experimental
                     m_fail->fetch_add(1, std::memory_order_relaxed);
                     continue;
                 }
@@ -292,30 +254,11 @@ namespace thread
             if (n == -2)
                 return;
 
-            auto delta = std::chrono::nanoseconds(static_cast<uint64_t>(1000/opt::rate));
-
-<<<<<<< HEAD
             auto len = std::min(opt::len, opt::maxlen);
 
-            for(;;)
-=======
-            auto now = std::chrono::system_clock::now();
-
             for(size_t i = 0; i < opt::npackets;)
->>>>>>> experimental
             {
-                //
-                // poor-man rate control...
-                //
-
-                if ((n & 8191) == 0)
-                {
-                    while (std::chrono::system_clock::now() < (now + delta*8192))
-                    {}
-                    now = std::chrono::system_clock::now();
-                }
-
-                auto plen = std::min<size_t>(hdr->caplen, opt::len);
+                auto plen = std::min<size_t>(hdr->caplen, len);
 
                 if (!m_pfq.send_async(pfq::const_buffer(reinterpret_cast<const char *>(data), plen), opt::flush))
                 {
@@ -326,17 +269,6 @@ namespace thread
                 m_sent->fetch_add(1, std::memory_order_relaxed);
                 m_band->fetch_add(plen, std::memory_order_relaxed);
 
-<<<<<<< HEAD
-                    auto plen = std::min<size_t>(hdr->caplen, len);
-
-                    if (m_pfq.send_async(pfq::const_buffer(reinterpret_cast<const char *>(data), plen), opt::flush))
-                    {
-                        m_sent->fetch_add(1, std::memory_order_relaxed);
-                        m_band->fetch_add(plen, std::memory_order_relaxed);
-                    }
-                    else
-                        m_fail->fetch_add(1, std::memory_order_relaxed);
-=======
                 n = pcap_next_ex(p, &hdr, (u_char const **)&data);
                 if (n == -2)
                     break;
@@ -345,7 +277,6 @@ namespace thread
                 {
                     ip->saddr = static_cast<uint32_t>(m_gen());
                     ip->daddr = static_cast<uint32_t>(m_gen());
->>>>>>> experimental
                 }
 
                 i++;
@@ -432,20 +363,15 @@ void usage(std::string name)
         "usage: " + std::move(name) + " [OPTIONS]\n\n"
         " -h --help                     Display this help\n"
         " -l --len INT                  Set packet length\n"
-<<<<<<< HEAD
         " -m --maxlen INT               Set max packet length\n"
-=======
         " -n --packets INT              Number of packets\n"
->>>>>>> experimental
         " -s --queue-slots INT          Set Tx queue length\n"
         " -k --kcore IDX,IDX...         Async with kernel threads\n"
         " -r --read FILE                Read pcap trace file to send\n"
         " -R --rand-ip                  Randomize IP addresses\n"
-        "    --rate DOUBLE              Packet rate in Mpps\n"
-<<<<<<< HEAD
-=======
+        "    --rate DOUBLE              Packet rate in Mpps (kernel shaping)\n"
+        "    --burst INT                Packets sent back-to-back at rate\n"
         " -a --active-tstamp            Use active timestamp as rate control\n"
->>>>>>> experimental
         " -f --flush INT                Set flush length, used in sync Tx\n"
         " -t --thread BINDING\n\n"
         "      BINDING = " + pfq::binding_format
@@ -499,7 +425,6 @@ try
             continue;
         }
 
-<<<<<<< HEAD
         if ( any_strcmp(argv[i], "-m", "--maxlen") )
         {
             if (++i == argc)
@@ -508,7 +433,9 @@ try
             }
 
             opt::maxlen = static_cast<size_t>(std::atoi(argv[i]));
-=======
+            continue;
+        }
+
         if ( any_strcmp(argv[i], "-n", "--packets") )
         {
             if (++i == argc)
@@ -517,7 +444,6 @@ try
             }
 
             opt::npackets = static_cast<size_t>(std::atoi(argv[i]));
->>>>>>> experimental
             continue;
         }
 
@@ -581,13 +507,23 @@ try
             continue;
         }
 
+        if ( any_strcmp(argv[i], "--burst") )
+        {
+            if (++i == argc)
+            {
+                throw std::runtime_error("burst missing");
+            }
+
+            opt::burst = static_cast<unsigned int>(std::atoi(argv[i]));
+            continue;
+        }
+
         if ( any_strcmp(argv[i], "-?", "-h", "--help") )
             usage(argv[0]);
 
         throw std::runtime_error(std::string("pfq-gen: ") + argv[i] + " unknown option");
     }
 
-<<<<<<< HEAD
     if (!opt::maxlen) {
         opt::maxlen = opt::len;
     }
@@ -595,27 +531,14 @@ try
     std::cout << "rand_ip    : "  << std::boolalpha << opt::rand_ip << std::endl;
     std::cout << "len        : "  << opt::len << std::endl;
     std::cout << "maxlen     : "  << opt::maxlen << std::endl;
-=======
-    std::cout << "rand_ip    : "  << std::boolalpha << opt::rand_ip << std::endl;
-    std::cout << "len        : "  << opt::len << std::endl;
->>>>>>> experimental
     std::cout << "flush-hint : "  << opt::flush << std::endl;
 
     if (opt::rate != 0.0)
-        std::cout << "rate       : "  << opt::rate << " Mpps" << std::endl;
-
-<<<<<<< HEAD
-
-    if (opt::slots == 0)
-        throw std::runtime_error("tx_slots set to 0!");
-
-    opt::packet = make_packet(opt::len);
+        std::cout << "rate       : "  << opt::rate << " Mpps, burst " << opt::burst << std::endl;
 
-=======
     if (opt::slots == 0)
         throw std::runtime_error("tx_slots set to 0!");
 
->>>>>>> experimental
     //
     // process binding:
     //
@@ -645,11 +568,6 @@ try
         std::cout << vt100::BOLD << "*** Multiple queue detected! Consider to enable asynchronous transmission, with -k option! ***" << vt100::RESET << std::endl;
     }
 
-<<<<<<< HEAD
-    //
-    // process kcore:
-=======
->>>>>>> experimental
     //
     // process kcore:
     //
@@ -657,12 +575,6 @@ try
     while (opt::kcore.size() < binding.size())
         opt::kcore.push_back(std::vector<int>{});
 
-<<<<<<< HEAD
-    while (opt::kcore.size() < binding.size())
-        opt::kcore.push_back(std::vector<int>{});
-
-=======
->>>>>>> experimental
     //
     // finally pad each kcore list...
     //
@@ -684,15 +596,14 @@ try
     for(unsigned int i = 0; i < binding.size(); ++i)
     {
         thread_ctx.push_back(new thread::context(static_cast<int>(i), binding[i], opt::kcore[i]));
-    }
 
-<<<<<<< HEAD
+        if (opt::rate != 0.0 && !opt::active_ts)
+            thread_ctx.back()->tx_rate(opt::rate, opt::burst);
+    }
 
-=======
     opt::nthreads.store(binding.size(), std::memory_order_relaxed);
 
     //
->>>>>>> experimental
     // create threads:
     //
 
@@ -24,7 +24,7 @@ main(int argc, char *argv[])
 try
 {
     if (argc < 5)
-       throw std::runtime_error(std::string("usage: ").append(argv[0]).append(" dev heap-size n-bin bin-size(ns)"));
+       throw std::runtime_error(std::string("usage: ").append(argv[0]).append(" dev heap-size n-bin bin-size(ns) [hw]"));
 
     auto heap_size = static_cast<size_t>(atoi(argv[2]));
     auto nbin      = static_cast<size_t>(atoi(argv[3]));
@@ -41,9 +41,13 @@ try
     q.bind(argv[1]);
 
 
-    // select tstamp type:
+    // select tstamp type: kernel time, or raw hardware stamps (the device must have them enabled)
     //
-    q.timestamp_enable(true);
+    q.timestamp_source(argc > 5 && strcmp(argv[5], "hw") == 0 ? Q_TSTAMP_HARDWARE : Q_TSTAMP_SOFTWARE);
+
+    // only headers are scanned: use the header-split layout
+    //
+    q.rx_layout(Q_RX_LAYOUT_SPLIT);
 
     // enable capturng for this queue:
     //
@@ -72,7 +76,7 @@ try
 
         std::for_each(b.begin(), b.end(), [&](pfq_pkthdr &h) {
 
-           while(!pfq::data_ready(h, q.current_commit()))
+           while(!pfq::data_ready(h, b.index()))
            {
                 std::this_thread::yield();
            }